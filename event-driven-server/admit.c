@@ -0,0 +1,48 @@
+#include <stdlib.h>
+#include "admit.h"
+
+int admit_init(admit_table* t, double per_sec, double burst) {
+    t->slots = (admit_slot*) calloc(ADMIT_SLOTS, sizeof(admit_slot));
+    t->rate = per_sec / 1000;
+    t->burst = burst < 1 ? 1 : burst;
+    return t->slots == NULL ? -1 : 0;
+}
+
+void admit_free(admit_table* t) {
+    free(t->slots);
+}
+
+static inline uint32_t hash(uint32_t addr) {
+    addr *= 0x9E3779B1u;
+    return addr ^ (addr >> 16);
+}
+
+bool admit_take(admit_table* t, uint32_t addr, long now) {
+    uint32_t ms = (uint32_t) now;
+    admit_slot* s = NULL;
+    admit_slot* victim = NULL; // a free slot, or the one refilled longest ago
+    for (uint32_t i = 0, h = hash(addr); i < ADMIT_PROBE; i++) {
+        admit_slot* p = &t->slots[(h + i) & (ADMIT_SLOTS - 1)];
+        if (p->addr == addr) {
+            s = p;
+            break;
+        }
+        if (victim == NULL || (victim->addr != 0 && (p->addr == 0 || (int32_t) (p->stamp - victim->stamp) < 0)))
+            victim = p;
+    }
+    if (s == NULL) {
+        s = victim;
+        s->addr = addr;
+        s->stamp = ms;
+        s->tokens = t->burst;
+    }
+    // refilled for the time since the last look, up to burst
+    s->tokens += (float) (uint32_t) (ms - s->stamp) * t->rate;
+    if (s->tokens > t->burst)
+        s->tokens = t->burst;
+    s->stamp = ms;
+    if (s->tokens < 1)
+        return false;
+    s->tokens -= 1;
+    return true;
+}
@@ -0,0 +1,35 @@
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Token buckets per client address: an address may open burst connections
+// at once, then rate per second. A reactor keeps ADMIT_SLOTS addresses in
+// an open-addressing table probed ADMIT_PROBE slots deep; an address that
+// finds neither its slot nor a free one takes the slot refilled longest
+// ago, and its former owner starts over with a full bucket. Not
+// thread-safe: one table per reactor.
+
+#define ADMIT_SLOTS 4096 // power of two
+#define ADMIT_PROBE 8
+
+typedef struct {
+    uint32_t addr;          // IPv4 address (network order), 0: free slot
+    uint32_t stamp;         // last refill, monotonic ms (low 32 bits)
+    float tokens;
+} admit_slot;
+
+typedef struct {
+    admit_slot* slots;
+    float rate;             // tokens per ms
+    float burst;
+} admit_table;
+
+// 0 on success, -1 out of memory
+int admit_init(admit_table* t, double per_sec, double burst);
+void admit_free(admit_table* t);
+// Takes one of addr's tokens at now (monotonic ms), false if none is left
+bool admit_take(admit_table* t, uint32_t addr, long now);
+
+#endif
@@ -0,0 +1,113 @@
+// Read server throughput with a given share of seat map cache hits
+//
+// usage: ./bench_read <read_port> <write_port> [hit%] [seconds]   (default: 95 3)
+//
+// One client asks the read server for shift 902001 over and over. Between
+// queries a write client locks or cancels seat 40 of that shift, once every
+// 100 / (100 - hit%) queries, so the other queries find the rendered map
+// still current. Only the queries are timed. Both servers must be running on
+// localhost with the same ./csie_trains.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define SESSION_S 4 // servers close a connection 5 sec after accept
+
+static int connect_to(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Reads until the server prompts again (output ends with ": ")
+static void read_prompt(int fd) {
+    char buf[4096];
+    size_t len = 0;
+    while (len < 2 || buf[len - 2] != ':' || buf[len - 1] != ' ') {
+        ssize_t r = read(fd, buf + len, sizeof(buf) - len);
+        if (r <= 0) {
+            fprintf(stderr, "server closed the connection\n");
+            exit(1);
+        }
+        len += r;
+        if (len == sizeof(buf))
+            len = 0; // only the tail matters
+    }
+}
+
+static void ask(int fd, const char* line) {
+    if (write(fd, line, strlen(line)) < 0) {
+        perror("write");
+        exit(1);
+    }
+    read_prompt(fd);
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <read_port> <write_port> [hit%%] [seconds]\n", argv[0]);
+        return 1;
+    }
+    int read_port = atoi(argv[1]);
+    int write_port = atoi(argv[2]);
+    int hit = argc > 3 ? atoi(argv[3]) : 95;
+    double seconds = argc > 4 ? atof(argv[4]) : 3;
+    if (hit < 0 || hit > 100) {
+        fprintf(stderr, "hit%% must be in [0, 100]\n");
+        return 1;
+    }
+    // a write every `every` queries
+    long every = hit == 100 ? 0 : 100 / (100 - hit);
+
+    long queries = 0;
+    double busy = 0;
+    double end = now_s() + seconds;
+    while (now_s() < end) {
+        // fresh connections before the servers time them out
+        int rfd = connect_to(read_port);
+        int wfd = connect_to(write_port);
+        read_prompt(rfd);
+        read_prompt(wfd);
+        ask(wfd, "902001\n");
+
+        double session_end = now_s() + SESSION_S;
+        if (session_end > end)
+            session_end = end;
+        while (now_s() < session_end) {
+            if (every && queries % every == 0)
+                ask(wfd, "40\n"); // lock, then cancel next time
+            double start = now_s();
+            ask(rfd, "902001\n");
+            busy += now_s() - start;
+            queries++;
+        }
+        // the seat lock (if any) goes with the connection
+        close(rfd);
+        close(wfd);
+    }
+    printf("%d%% hits: %ld queries, %.0f queries/s, %.1f us per query\n",
+           hit, queries, queries / busy, busy / queries * 1e6);
+    return 0;
+}
@@ -0,0 +1,136 @@
+// Per-wakeup cost of connection deadline bookkeeping
+//
+// usage: ./bench_timer [sessions...]   (default: 10000 100000)
+//
+// "scan" is what run_server used to do: calculate_timeout() and
+// clean_expired_client() each walk every client and read the clock per
+// client. "heap" is the timer heap: one clock read, a peek for the poll
+// timeout and a pop per expired session. Every wakeup one session expires
+// and is replaced by a new one, as with a steady stream of connections.
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/time.h>
+#include "timer.h"
+
+#define BUDGET_NS 5e8 // time spent per measurement
+#define SESSION_MS 5000
+
+typedef struct {
+    struct timeval deadline;
+} scan_session;
+
+typedef struct {
+    timer_node timer;
+} heap_session;
+
+static double elapsed_ns(struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+static int scan_timeout(scan_session* s, int n) {
+    int min_timeout = INT_MAX;
+    for (int i = 0; i < n; i++) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        long timeout = (s[i].deadline.tv_sec - now.tv_sec) * 1000 + (s[i].deadline.tv_usec - now.tv_usec) / 1000;
+        if (timeout < min_timeout)
+            min_timeout = timeout < 0 ? 0 : timeout;
+    }
+    return min_timeout;
+}
+
+static int scan_expire(scan_session* s, int n, int victim) {
+    int expired = 0;
+    for (int i = 0; i < n; i++) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        // the victim counts as expired, then gets a fresh deadline
+        if (i == victim || timercmp(&s[i].deadline, &now, <=)) {
+            s[i].deadline = now;
+            s[i].deadline.tv_sec += SESSION_MS / 1000;
+            expired++;
+        }
+    }
+    return expired;
+}
+
+static double bench_scan(int n) {
+    scan_session* s = (scan_session*) malloc(sizeof(scan_session) * n);
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    for (int i = 0; i < n; i++) {
+        s[i].deadline = now;
+        s[i].deadline.tv_sec += SESSION_MS / 1000;
+    }
+    long sink = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int w;
+    double ns;
+    for (w = 0; (ns = elapsed_ns(&start)) < BUDGET_NS; w++) {
+        sink += scan_timeout(s, n);
+        sink += scan_expire(s, n, w % n);
+    }
+    ns /= w;
+    if (sink == 42)
+        printf("\n");
+    free(s);
+    return ns;
+}
+
+static double bench_heap(int n) {
+    heap_session* s = (heap_session*) malloc(sizeof(heap_session) * n);
+    timer_heap heap;
+    timer_heap_init(&heap, n);
+    long now = monotonic_ms();
+    for (int i = 0; i < n; i++) {
+        timer_node_init(&s[i].timer);
+        // spread the deadlines like sessions accepted over time
+        timer_arm(&heap, &s[i].timer, now + SESSION_MS + (long) i * SESSION_MS / n);
+    }
+    long sink = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int w;
+    double ns = 0;
+    for (w = 0; (w & 255) || (ns = elapsed_ns(&start)) < BUDGET_NS; w++) {
+        now = monotonic_ms();
+        sink += timer_next_timeout(&heap, now);
+        // the earliest session expires, its slot is reused by a new one
+        // (the clock is not advanced for real, so expire it explicitly)
+        timer_node* node = timer_peek(&heap);
+        long expire_at = node->deadline;
+        while ((node = timer_pop_expired(&heap, expire_at)) != NULL) {
+            timer_arm(&heap, node, expire_at + SESSION_MS);
+            sink++;
+        }
+    }
+    ns /= w;
+    if (sink == 42)
+        printf("\n");
+    timer_heap_free(&heap);
+    free(s);
+    return ns;
+}
+
+int main(int argc, char** argv) {
+    int defaults[] = {10000, 100000};
+    int num = argc > 1 ? argc - 1 : 2;
+
+    printf("%10s %14s %14s %10s\n", "sessions", "scan ns/wake", "heap ns/wake", "speedup");
+    for (int i = 0; i < num; i++) {
+        int n = argc > 1 ? atoi(argv[i + 1]) : defaults[i];
+        if (n <= 0) {
+            fprintf(stderr, "usage: %s [sessions...]\n", argv[0]);
+            return 1;
+        }
+        double scan = bench_scan(n);
+        double heap = bench_heap(n);
+        printf("%10d %14.0f %14.0f %9.0fx\n", n, scan, heap, scan / heap);
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef BITSET_H
+#define BITSET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Fixed size bitsets stored as uint64_t words. Seat n (1-based) is bit n-1.
+
+#define BITSET_WORDS(bits) (((bits) + 63) / 64)
+
+static inline bool bit_test(const uint64_t* set, int i) {
+    return (set[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void bit_set(uint64_t* set, int i) {
+    set[i / 64] |= (uint64_t) 1 << (i % 64);
+}
+
+static inline void bit_clear(uint64_t* set, int i) {
+    set[i / 64] &= ~((uint64_t) 1 << (i % 64));
+}
+
+static inline int bitset_count(const uint64_t* set, int words) {
+    int n = 0;
+    for (int w = 0; w < words; w++)
+        n += __builtin_popcountll(set[w]);
+    return n;
+}
+
+static inline bool bitset_empty(const uint64_t* set, int words) {
+    for (int w = 0; w < words; w++)
+        if (set[w])
+            return false;
+    return true;
+}
+
+// First set bit at or after i, -1 if none
+static inline int bitset_next(const uint64_t* set, int words, int i) {
+    int w = i / 64;
+    if (w >= words)
+        return -1;
+    uint64_t word = set[w] & (~(uint64_t) 0 << (i % 64));
+    while (word == 0) {
+        if (++w == words)
+            return -1;
+        word = set[w];
+    }
+    return w * 64 + __builtin_ctzll(word);
+}
+
+// set[i] &= set[i + shift] for every bit (bits shifted in from the end are 0)
+static inline void bitset_and_shifted(uint64_t* set, int words, int shift) {
+    int ws = shift / 64, bs = shift % 64;
+    for (int w = 0; w < words; w++) {
+        uint64_t lo = w + ws < words ? set[w + ws] : 0;
+        uint64_t hi = w + ws + 1 < words ? set[w + ws + 1] : 0;
+        uint64_t shifted = bs ? (lo >> bs) | (hi << (64 - bs)) : lo;
+        set[w] &= shifted;
+    }
+}
+
+// First bit starting a run of k set bits, -1 if none. The runs are found by
+// and-ing the set with itself shifted, doubling the covered length each step.
+static inline int bitset_find_run(const uint64_t* set, int words, int k, uint64_t* scratch) {
+    if (k < 1)
+        return -1;
+    for (int w = 0; w < words; w++)
+        scratch[w] = set[w];
+    for (int len = 1; len < k; ) {
+        int step = len < k - len ? len : k - len;
+        bitset_and_shifted(scratch, words, step);
+        len += step;
+    }
+    return bitset_next(scratch, words, 0);
+}
+
+#endif
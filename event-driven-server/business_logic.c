@@ -1,97 +1,98 @@
 #include <stdio.h>
-#include <fcntl.h>
 #include "server.h"
 #include "business_logic.h"
-
-// Global variables
-train_info trains[TRAIN_NUM];
-int local_locked[TRAIN_NUM][SEAT_NUM]; // stores client id
+#include "seat_table.h"
+#include "bitset.h"
+#include "ring.h"
+#include "journal.h"
+#include "metrics.h"
+#include "log.h"
+#include "watch.h"
 
 static const char IAC_IP[3] = "\xff\xf4";
 static const char* welcome_banner = "======================================\n"
                                     " Welcome to CSIE Train Booking System \n"
                                     "======================================\n";
-#ifdef READ_SERVER
-static char* read_shift_msg = "Please select the shift you want to check [902001-902005]: ";
-#elif defined WRITE_SERVER
+// Prompts naming the shifts of the catalog, see init_prompts
+static char read_shift_msg[128];
+static char write_shift_msg[128];
 static const char* book_succ_msg = ">>> Your train booking is successful.\n";
+static const char* pay_failed_msg = ">>> Payment failed, please try again.\n";
 static const char* no_seat_msg = ">>> No seat to pay.\n";
 static const char* seat_booked_msg = ">>> The seat is booked.\n";
 static const char* full_msg = ">>> The shift is fully booked.\n";
 static const char* cancel_msg = ">>> You cancel the seat.\n";
 static const char* lock_msg = ">>> Locked.\n";
-static char* write_shift_msg = "Please select the shift you want to book [902001-902005]: ";
-static char* write_seat_msg = "Select the seat [1-40] or type \"pay\" to confirm: ";
+static const char* write_seat_msg = "Select the seat [1-%d] or type \"pay\" to confirm: ";
 static char* write_seat_or_exit_msg = "Type \"seat\" to continue or \"exit\" to quit [seat/exit]: ";
-#endif
-
 
-#ifdef READ_SERVER
-
-int check_lock(int fd, int whence, int offset, int len, int type) {
-    struct flock lock;
-    lock.l_whence = whence; // seek from begining of the file
-    lock.l_start = offset;
-    lock.l_len = len; // lock two bytes
-    lock.l_type = type;
-    if(fcntl(fd, F_GETLK, &lock) == -1) {
-        fprintf(stderr, "fcntl error\n");
-        return -1;
-    }
+void init_prompts(void) {
+    // "[902001-902005]": the lowest and highest shift ids
+    snprintf(read_shift_msg, sizeof(read_shift_msg), "Please select the shift you want to check [%d-%d]: ",
+             trains[0].shift_id, trains[num_trains - 1].shift_id);
+    snprintf(write_shift_msg, sizeof(write_shift_msg), "Please select the shift you want to book [%d-%d]: ",
+             trains[0].shift_id, trains[num_trains - 1].shift_id);
+}
 
-    if(lock.l_type == F_UNLCK)
-        return 0; // available
-    else
-        return 1; // locked
+// Lock owner of a request, taken the first time it locks a seat
+static uint64_t lock_owner(request *rq) {
+    if(rq->lock_owner == 0)
+        rq->lock_owner = seat_lock_owner();
+    return rq->lock_owner;
 }
 
-static int get_and_check_seat_state(int train_fd, int seat_num) {
-    // should lock if available
-    if(seat_num < 1 || seat_num > SEAT_NUM) {
-        fprintf(stderr, "get_and_check_seat_state invalid seat_num %d\n", seat_num);
-        return -1;
-    }
-    // database
-    char buf[1];
-    off_t offset = (seat_num-1) * 2;
-    int ret = pread(train_fd, buf, 1, offset);
-    if(ret < 0) {
-        fprintf(stderr, "get_and_check_seat_state pread train_fd: %d, ret %d\n", train_fd, ret);
-        return -1;
-    }
-    int seat_state = buf[0] - '0';
-    if(seat_state == 1)
-        return 1; // booked by other request
-    
-    ret = check_lock(train_fd, SEEK_SET, offset, 2, F_WRLCK);
-    if(ret == -1)
-        return -1;
-    else if(ret == 0)
-        return 0; // available
-    else
-        return 2; // locked
+// The lease outlives the connection (closed at its deadline) by
+// LEASE_GRACE_MS, so it only expires if the holder is stuck
+static long lock_lease(request *rq) {
+    return rq->timer.deadline + LEASE_GRACE_MS;
 }
 
-static int fill_train_info(int filefd, request *rq) {
-    // fill train info into the request buffer
+// Reader: seat map queries
+
+// Answer to a shift query (seat map and prompt) as last rendered, per
+// reactor thread so that a hit takes no lock. It is rendered again once the
+// train's seats may have changed. Allocated for the trains queried only.
+typedef struct {
+    bool valid;
+    seat_snapshot snap;     // what reply was rendered from
+    size_t len;
+    char reply[];           // seats * 2 + prompt
+} seat_map_cache;
+
+static __thread seat_map_cache** map_cache; // [num_trains]
+
+static int fill_seat_map(int train, request *rq) {
+    // fill train info (and the next prompt) into the request buffer
     // return 0: Success
     // return -1: Error
-    memset(rq->buf, 0, MAX_MSG_LEN);
-    int seat_state;
-    for(int i = 0; i < SEAT_NUM; i++) {
-        if((seat_state = get_and_check_seat_state(filefd, i+1)) < 0)
-            return -1;
-        rq->buf[i*2] = seat_state + '0'; // to character
-        rq->buf[i*2+1] = ' ';
-        if((i+1) % 4 == 0)
-            rq->buf[i*2+1] = '\n';
+    if(map_cache == NULL && (map_cache = calloc(num_trains, sizeof(seat_map_cache*))) == NULL)
+        return -1;
+    seat_map_cache* c = map_cache[train];
+    size_t size = trains[train].seats * 2 + strlen(read_shift_msg) + 1;
+    if(c == NULL && (c = map_cache[train] = calloc(1, sizeof(seat_map_cache) + size)) == NULL)
+        return -1;
+    if(!c->valid || !seat_snapshot_current(train, &c->snap)) {
+        seat_render(train, c->reply, &c->snap); // "0 1 2 0\n" per 4 seats
+        c->len = trains[train].seats * 2;
+        c->len += snprintf(c->reply + c->len, size - c->len, "%s", read_shift_msg);
+        c->valid = true;
     }
-    rq->buf_len = SEAT_NUM * 2;
+    memcpy(rq->buf, c->reply, c->len);
+    rq->buf_len = c->len;
     return 0;
 }
 
-#elif defined WRITE_SERVER
-static int fill_train_info(request *reqP) {
+// Writer: bookings
+
+// "1,2,5": seats of a bitset, visiting set bits only
+static void seat_list(const uint64_t* seats, char* out, size_t size) {
+    size_t len = 0;
+    out[0] = '\0';
+    for(int i = bitset_next(seats, SEAT_WORDS, 0); i >= 0 && len < size; i = bitset_next(seats, SEAT_WORDS, i+1))
+        len += snprintf(out + len, size - len, len ? ",%d" : "%d", i+1);
+}
+
+static int fill_booking_info(request *reqP) {
     // fill train info into the request buffer
     // return 0: Success
     // return -1: Error
@@ -104,33 +105,10 @@ static int fill_train_info(request *reqP) {
      */
     char chosen_seat[MAX_MSG_LEN];
     char paid_seat[MAX_MSG_LEN];
-    int chosen_index = 0;
-    int paid_index = 0;
 
-    memset(chosen_seat, 0, SEAT_NUM);
-    memset(paid_seat, 0, SEAT_NUM);
     memset(reqP->buf, 0, MAX_MSG_LEN);
-
-    for(int i = 0; i < SEAT_NUM; i++) {
-        if(reqP->booking_info.seat_stat[i] == CHOSEN) {
-            if(chosen_index > 0) {
-                strncat(chosen_seat, ",", sizeof(chosen_seat)-strlen(chosen_seat)-1);
-            }
-            char temp[3]; // at most 2 digits + '\0
-            snprintf(temp, sizeof(temp), "%d", i+1);
-            strncat(chosen_seat, temp, sizeof(chosen_seat)-strlen(chosen_seat)-1);
-            chosen_index++;
-        }
-        else if(reqP->booking_info.seat_stat[i] == PAID) {
-            if(paid_index > 0) {
-                strncat(paid_seat, ",", sizeof(paid_seat)-strlen(paid_seat)-1);
-            }
-            char temp[3];
-            snprintf(temp, sizeof(temp), "%d", i+1);
-            strncat(paid_seat, temp, sizeof(paid_seat)-strlen(paid_seat)-1);
-            paid_index++;
-        }
-    }
+    seat_list(reqP->booking_info.chosen, chosen_seat, sizeof(chosen_seat));
+    seat_list(reqP->booking_info.paid, paid_seat, sizeof(paid_seat));
 
     reqP->buf_len = snprintf(reqP->buf, MAX_MSG_LEN, "\nBooking info\n"
                         "|- Shift ID: %d\n"
@@ -141,114 +119,65 @@ static int fill_train_info(request *reqP) {
 }
 
 
-int lock(int fd, int whence, int offset, int len, int type) {
-    struct flock lock;
-    lock.l_whence = whence; // seek from begining of the file
-    lock.l_start = offset;
-    lock.l_len = len; // lock two bytes
-    lock.l_type = type;
-
-    if(fcntl(fd, F_SETLK, &lock) == -1) {
-        if (errno == EACCES || errno == EAGAIN) {
-            fprintf(stderr, "Unable to obtain lock on\n");
-            return 1; // locked by other process
-        } else {
-            fprintf(stderr, "fcntl error\n");
-            return -1;
-        }
-    }
-    return 0;
-}
-
 static int get_and_lock_seat_state(request *rq, int seat_num) {
     // should lock if available
-    record booking_info = rq->booking_info;
-    int train_fd = booking_info.train_fd;
-    int shift_id = booking_info.shift_id;
-    if(seat_num < 1 || seat_num > SEAT_NUM) {
-        fprintf(stderr, "get_and_lock_seat_state invalid seat_num %d\n", seat_num);
-        return -1;
-    }
-
-    // Check database
-    char buf[1];
-    off_t offset = (seat_num-1) * 2;
-    int ret = pread(train_fd, buf, 1, offset);
-    if(ret < 0) {
-        fprintf(stderr, "get_and_lock_seat_state pread ret %d\n", ret);
-        return -1;
-    }
-    int seat_state = buf[0] - '0';
-    if(seat_state == 1)
-        return 1; // booked by other request
-
-    // Check local state (other client booked from the same server as me)
-    if(local_locked[shift_id - TRAIN_ID_START][seat_num-1] == rq->client_id)
-        return 0; // availabe, chosen by myself
-    else if(local_locked[shift_id - TRAIN_ID_START][seat_num-1] != 0)
-        return 2; // locked by other request
-    
-    // Check inter-process state (other client booked from different server as me)
-    // Note: Directly get lock to prevent race condition
-    ret = lock(train_fd, SEEK_SET, offset, 2, F_WRLCK); // lock 2 bytes
-    if(ret == -1) {
+    // return 0: locked (or already chosen by myself), 1: booked, 2: locked by other request
+    if(seat_num < 1 || seat_num > trains[rq->booking_info.train].seats) {
+        log_warn("get_and_lock_seat_state invalid seat_num %d\n", seat_num);
         return -1;
     }
-    else if(ret == 0) {
-        local_locked[shift_id - TRAIN_ID_START][seat_num-1] = rq->client_id;
-        return 0; // sucessfully locked
-    }
-    else {
-        return 2; // locked by other process
-    }
-}
-
-// used in payment (state = 1 always)
-static int set_seat_state(int train_fd, int seat_num, int state) {
-    if(seat_num < 1 || seat_num > SEAT_NUM)
-        return -1;
-    
-    char buf[3]; // state + '\0' (actually 2 is enough)
-    // convert integer to string
-    snprintf(buf, sizeof(buf), "%d", state);
-    off_t offset = (seat_num-1) * 2;
-    int ret = pwrite(train_fd, buf, strlen(buf), offset);
-    if(ret < 0)
-        return -1;
-    return 0;
+    return seat_try_lock(rq->booking_info.train, seat_num, lock_owner(rq), lock_lease(rq));
 }
 
-static bool fully_booked(int train_fd) {
-    int seat_state;
-    for(int seat_num = 1; seat_num <= SEAT_NUM; seat_num++) {
-        char buf[1];
-        off_t offset = (seat_num-1) * 2;
-        int ret = pread(train_fd, buf, 1, offset);
-        if(ret < 0)
-            fprintf(stderr, "pread error\n");
-        seat_state = buf[0] - '0';
-        if(seat_state == 0) // available
-            return false;
-    }
-    return true;
+// "[1-40]": seats of the shift
+static void queue_seat_prompt(request *rq) {
+    char prompt[128];
+    int len = snprintf(prompt, sizeof(prompt), write_seat_msg, trains[rq->booking_info.train].seats);
+    outq_append(&rq->out, prompt, len);
 }
 
 static int response_seat(request *rq) {
-    write(rq->conn_fd, rq->buf, rq->buf_len);
-    fill_train_info(rq);
-    write(rq->conn_fd, rq->buf, rq->buf_len);
-    write(rq->conn_fd, write_seat_msg, strlen(write_seat_msg));
+    outq_append(&rq->out, rq->buf, rq->buf_len);
+    fill_booking_info(rq);
+    outq_append(&rq->out, rq->buf, rq->buf_len);
+    queue_seat_prompt(rq);
     return SUCCESS;
 
 }
 static int response_payment(request *rq) {
-    write(rq->conn_fd, rq->buf, rq->buf_len);
-    fill_train_info(rq);
-    write(rq->conn_fd, rq->buf, rq->buf_len);
-    write(rq->conn_fd, write_seat_or_exit_msg, strlen(write_seat_or_exit_msg));
+    outq_append(&rq->out, rq->buf, rq->buf_len);
+    fill_booking_info(rq);
+    outq_append(&rq->out, rq->buf, rq->buf_len);
+    outq_puts(&rq->out, write_seat_or_exit_msg);
     return SUCCESS;
 }
 
+void finish_commit(request *rq, bool committed) {
+    if(!committed) {
+        // the seats stay chosen, the client may pay again
+        rq->buf_len = snprintf(rq->buf, MAX_MSG_LEN, "%s", pay_failed_msg);
+        rq->status = SEAT;
+        return;
+    }
+    // update booking record and write to db
+    uint64_t* chosen = rq->booking_info.chosen;
+    for(int i = bitset_next(chosen, SEAT_WORDS, 0); i >= 0; i = bitset_next(chosen, SEAT_WORDS, i+1)) {
+        if(seat_book(rq->booking_info.train, i+1, rq->lock_owner))
+            continue;
+        // its lease ran out and somebody took it meanwhile
+        log_warn("seat %d of shift %d lost before it was booked\n", i+1, rq->booking_info.shift_id);
+        bit_clear(chosen, i);
+    }
+    metrics_add(M_SEATS_PAID, bitset_count(chosen, SEAT_WORDS));
+    for(int w = 0; w < SEAT_WORDS; w++) {
+        rq->booking_info.paid[w] |= chosen[w];
+        chosen[w] = 0;
+    }
+    rq->booking_info.num_of_chosen_seats = 0;
+    rq->buf_len = snprintf(rq->buf, MAX_MSG_LEN, "%s", book_succ_msg);
+    rq->status = PAYMENT;
+}
+
 static int finish_payment(request *rq) {
     if(strncmp(rq->buf, "seat", 4) == 0) {
         rq->buf_len = 0;
@@ -259,61 +188,91 @@ static int finish_payment(request *rq) {
 }
 
 static int select_seat(request *rq) {
-    int ret = 0;
     if(strncmp(rq->buf, "pay", 3) == 0) {
         // Case 1. Failed if chosen seat is empty, print out msg and continue
         if(rq->booking_info.num_of_chosen_seats == 0) {
             rq->buf_len = snprintf(rq->buf, MAX_MSG_LEN, "%s", no_seat_msg);
         }
-        // Case 2. Success seat payment updated
+        // Case 2. Success seat payment journaled, see finish_commit
         else {
-            // update booking record and write to db
-            for(int i = 0; i < SEAT_NUM; i++) {
-                if(rq->booking_info.seat_stat[i] == CHOSEN) {
-                    rq->booking_info.seat_stat[i] = PAID;
-                    if((ret = set_seat_state(rq->booking_info.train_fd, i+1, 1)) < 0) {
-                        fprintf(stderr, "%s", "Failed to set_seat_state!\n");
-                        return FAILURE;
-                    }
-                    if(unlock(rq->booking_info.train_fd, i*2, 2) < 0)
-                        return FAILURE;
-                    local_locked[rq->booking_info.shift_id - TRAIN_ID_START][i] = 0;
-                }
-            }
-            rq->booking_info.num_of_chosen_seats = 0;
-            rq->buf_len = snprintf(rq->buf, MAX_MSG_LEN, "%s", book_succ_msg);
-            return SEAT_TO_PAYMENT;
+            const uint64_t* chosen = rq->booking_info.chosen;
+            for(int i = bitset_next(chosen, SEAT_WORDS, 0); i >= 0; i = bitset_next(chosen, SEAT_WORDS, i+1))
+                journal_add(rq->booking_info.shift_id, i+1, rq->client_id);
+            return SEAT_TO_COMMIT;
+        }
+    } else if(strncmp(rq->buf, "seats ", 6) == 0) {
+        // "seats 3,4,5,6": all of them or none, in one answer
+        uint64_t want[SEAT_WORDS] = {0}, taken[SEAT_WORDS];
+        char* p = rq->buf + 6;
+        for(;;) {
+            char* endptr;
+            int seat_num = strtol(p, &endptr, 10);
+            if(endptr == p || seat_num < 1 || seat_num > trains[rq->booking_info.train].seats || bit_test(rq->booking_info.paid, seat_num-1))
+                return FAILURE;
+            bit_set(want, seat_num-1);
+            if(*endptr == '\0')
+                break;
+            if(*endptr != ',')
+                return FAILURE;
+            p = endptr + 1;
+        }
+        uint64_t* chosen = rq->booking_info.chosen;
+        for(int w = 0; w < SEAT_WORDS; w++)
+            want[w] &= ~chosen[w]; // already ours
+        char list[MAX_MSG_LEN];
+        if(seat_try_lock_all(rq->booking_info.train, want, lock_owner(rq), lock_lease(rq), taken) > 0) {
+            metrics_inc(M_SEATS_TAKEN);
+            seat_list(taken, list, sizeof(list));
+            rq->buf_len = snprintf(rq->buf, MAX_MSG_LEN, ">>> Seat(s) %s taken, nothing chosen.\n", list);
+        } else {
+            for(int w = 0; w < SEAT_WORDS; w++)
+                chosen[w] |= want[w];
+            rq->booking_info.num_of_chosen_seats += bitset_count(want, SEAT_WORDS);
+            rq->buf_len = 0; // the booking info shows them
         }
+    } else if(strncmp(rq->buf, "find ", 5) == 0) {
+        // first K adjacent seats that are neither booked nor locked
+        char* endptr;
+        int k = strtol(rq->buf + 5, &endptr, 10);
+        if(k < 1 || k > trains[rq->booking_info.train].seats || *endptr != '\0')
+            return FAILURE;
+        int first = seat_find_free_run(rq->booking_info.train, k);
+        if(first < 0)
+            rq->buf_len = snprintf(rq->buf, MAX_MSG_LEN, ">>> No %d adjacent free seats.\n", k);
+        else if(k == 1)
+            rq->buf_len = snprintf(rq->buf, MAX_MSG_LEN, ">>> Seat %d is free.\n", first);
+        else
+            rq->buf_len = snprintf(rq->buf, MAX_MSG_LEN, ">>> Seats %d-%d are free.\n", first, first + k - 1);
     } else {
         char* endptr;
         int seat_num = strtol(rq->buf, &endptr, 10);
-        if(!seat_num || seat_num < 0 || seat_num > SEAT_NUM || *endptr != '\0') {
+        if(!seat_num || seat_num < 0 || seat_num > trains[rq->booking_info.train].seats || *endptr != '\0') {
             return FAILURE;
         }
         int seat_state = get_and_lock_seat_state(rq, seat_num);
-        fprintf(stderr, "seat_num: %d, seat_state: %d\n", seat_num, seat_state);
+        log_debug("seat_num: %d, seat_state: %d\n", seat_num, seat_state);
         if(seat_state == 0) { // seat is available
-            if(rq->booking_info.seat_stat[seat_num-1] == DEFAULT) {
-                rq->booking_info.seat_stat[seat_num-1] = CHOSEN;
+            if(bit_test(rq->booking_info.paid, seat_num-1)) {
+                return FAILURE;
+            } else if(!bit_test(rq->booking_info.chosen, seat_num-1)) {
+                bit_set(rq->booking_info.chosen, seat_num-1);
                 rq->booking_info.num_of_chosen_seats++;
                 rq->buf_len = 0; // no message sent to client in this case
-            } else if(rq->booking_info.seat_stat[seat_num-1] == CHOSEN) {
-                rq->booking_info.seat_stat[seat_num-1] = DEFAULT;
+            } else {
+                bit_clear(rq->booking_info.chosen, seat_num-1);
                 rq->booking_info.num_of_chosen_seats--;
                 rq->buf_len = snprintf(rq->buf, MAX_MSG_LEN, "%s", cancel_msg);
-                if(unlock(rq->booking_info.train_fd, (seat_num-1)*2, 2) < 0)
-                    return FAILURE;
-                local_locked[rq->booking_info.shift_id - TRAIN_ID_START][seat_num-1] = 0;
-            } else {
-                return FAILURE;
+                seat_unlock(rq->booking_info.train, seat_num, rq->lock_owner);
             }
         }
         // else if(seat is booked)
         else if(seat_state == 1) {
+            metrics_inc(M_SEAT_BOOKED);
             rq->buf_len = snprintf(rq->buf, MAX_MSG_LEN, "%s", seat_booked_msg);
         }
         // else if (seat is reserved)
         else if(seat_state == 2) {
+            metrics_inc(M_SEAT_LOCKED);
             rq->buf_len = snprintf(rq->buf, MAX_MSG_LEN, "%s", lock_msg);
         }
         else {
@@ -323,194 +282,192 @@ static int select_seat(request *rq) {
     return SUCCESS;
 }
 
-#endif
+// Both roles
 
 static int select_shift(request *rq) {
     // Ensure buffer content & length correctness
     // fill_train_info will ensure the buffer content & length correctness
     char *endptr;
-    int shift = strtol(rq->buf, &endptr, 10);
-    if(!shift || shift < TRAIN_ID_START || shift > TRAIN_ID_END || *endptr != '\0') {
+    // "watch <shift>": the reader's seat map, then its changes
+    bool watch = rq->role == READER && strncmp(rq->buf, "watch ", 6) == 0;
+    int shift = strtol(watch ? rq->buf + 6 : rq->buf, &endptr, 10);
+    int train = catalog_find(shift);
+    if(!shift || train < 0 || *endptr != '\0' || seat_table_open(train) < 0) {
         rq->buf_len = 0;
         return FAILURE;
     }
-    #ifdef READ_SERVER      
-    if(fill_train_info(trains[shift-TRAIN_ID_START].file_fd, rq) < 0) {
-        return FAILURE;
-    }
-    #elif defined WRITE_SERVER
+    if(watch)
+        return watch_add(rq, train) < 0 ? FAILURE : SHIFT_TO_WATCH;
+    if(rq->role == READER)
+        return fill_seat_map(train, rq) < 0 ? FAILURE : SUCCESS;
+
     int ret = 0;
-    if(fully_booked(trains[shift-TRAIN_ID_START].file_fd)) {
+    if(seat_fully_booked(train)) {
         ret = snprintf(rq->buf, MAX_MSG_LEN, "%s", full_msg);
         rq->buf_len = ret;
     } else {
         rq->booking_info.shift_id = shift;
-        rq->booking_info.train_fd = trains[shift-TRAIN_ID_START].file_fd;
-        if((ret = fill_train_info(rq)) < 0) {
+        rq->booking_info.train = train;
+        if((ret = fill_booking_info(rq)) < 0) {
             return FAILURE;
         }
     }
-    #endif
     return SUCCESS;
 }
 
 static int response_init(request *rq) {
-    write(rq->conn_fd, welcome_banner, strlen(welcome_banner));
-    #ifdef READ_SERVER
-    write(rq->conn_fd, read_shift_msg, strlen(read_shift_msg));
-    #elif defined WRITE_SERVER
-    write(rq->conn_fd, write_shift_msg, strlen(write_shift_msg));
-    #endif
+    outq_puts(&rq->out, welcome_banner);
+    outq_puts(&rq->out, rq->role == READER ? read_shift_msg : write_shift_msg);
     return SUCCESS;
 }
 
 static int response_shift(request *rq) {
-    #ifdef READ_SERVER
-    write(rq->conn_fd, rq->buf, rq->buf_len);
-    write(rq->conn_fd, read_shift_msg, strlen(read_shift_msg));
-    #elif defined WRITE_SERVER
+    if(rq->role == READER) {
+        outq_append(&rq->out, rq->buf, rq->buf_len); // the prompt is part of buf
+        return SUCCESS;
+    }
     // shift selection failed
     if(rq->booking_info.shift_id == -1) {
         // prompt user to select shift again
-        write(rq->conn_fd, rq->buf, strlen(rq->buf));
-        write(rq->conn_fd, write_shift_msg, strlen(write_shift_msg));
+        outq_puts(&rq->out, rq->buf);
+        outq_puts(&rq->out, write_shift_msg);
     } else {
-        write(rq->conn_fd, rq->buf, strlen(rq->buf));
-        write(rq->conn_fd, write_seat_msg, strlen(write_seat_msg));
+        outq_puts(&rq->out, rq->buf);
+        queue_seat_prompt(rq);
         return SHIFT_TO_SEAT;
     }
-    #endif
     return SUCCESS;
 }
 
-static int handle_read(request* reqP) {
+static int check_interrupt(request* reqP) {
+    if (ring_starts_with(&reqP->in, IAC_IP, 2)) {
+        // Client presses ctrl+C, regard as disconnection
+        log_debug("Client presses ctrl+C....\n");
+        return 0;
+    }
+    return 1;
+}
+
+int handle_read(request* reqP) {
     /*  Return value:
-     *      1: read successfully
+     *      1: read successfully (or nothing to read yet)
      *      0: read EOF (client down)
      *     -1: read failed
-     *   TODO: handle incomplete input
+     *  Bytes are kept in reqP->in until their line is complete
      */
-    int r;
-    char buf[MAX_MSG_LEN];
-    size_t len;
-
-    memset(buf, 0, sizeof(buf));
-
-    // Read in request from client
-    r = read(reqP->conn_fd, buf, sizeof(buf));
-    if (r < 0) return -1;
+    if (ring_full(&reqP->in)) // a line longer than any command
+        return -1;
+    ssize_t r = ring_read(&reqP->in, reqP->conn_fd);
+    if (r < 0) return (errno == EAGAIN || errno == EINTR) ? 1 : -1;
     if (r == 0) return 0;
-    char* p1 = strstr(buf, "\015\012"); // \r\n
-    if (p1 == NULL) {
-        p1 = strstr(buf, "\012");   // \n
-        if (p1 == NULL) {
-            if (strncmp(buf, IAC_IP, 2) == 0) {
-                // Client presses ctrl+C, regard as disconnection
-                fprintf(stderr, "Client presses ctrl+C....\n");
-                return 0;
-            }
-        }
-    }
-
-    len = p1 - buf + 1; // containing \n
-    memmove(reqP->buf, buf, len);
-    reqP->buf[len - 1] = '\0'; // replace \n with \0
-    reqP->buf_len = len-1;
-    return 1;
+    return check_interrupt(reqP);
 }
 
-int unlock(int filefd, int start, int len) {
-    struct flock lock;
-    lock.l_whence = SEEK_SET;
-    lock.l_start = start;
-    lock.l_len = len;
-    lock.l_type = F_UNLCK;
-    if(fcntl(filefd, F_SETLK, &lock) == -1) {
-        return -1;
-    }
-    return 0;
+int handle_input(request* reqP, const char* data, size_t len) {
+    if (len == 0) return 0;
+    if (ring_put(&reqP->in, data, len) < len) return -1;
+    return check_interrupt(reqP);
 }
 
 void unlock_unpaid_seat(request *rq) {
     // unlock the unpaid seat
-    for(int i = 0; i < SEAT_NUM; i++) {
-        if(rq->booking_info.seat_stat[i] == CHOSEN) {
-            unlock(rq->booking_info.train_fd, i*2, 2);
-            local_locked[rq->booking_info.shift_id-TRAIN_ID_START][i] = 0;
-        }
+    const uint64_t* chosen = rq->booking_info.chosen;
+    for(int i = bitset_next(chosen, SEAT_WORDS, 0); i >= 0; i = bitset_next(chosen, SEAT_WORDS, i+1))
+        seat_unlock(rq->booking_info.train, i+1, rq->lock_owner);
+}
+
+void adopt_chosen_seats(request *rq, uint64_t owner) {
+    uint64_t* chosen = rq->booking_info.chosen;
+    rq->lock_owner = owner == 0 ? 0 : seat_adopted(owner);
+    for(int i = bitset_next(chosen, SEAT_WORDS, 0); i >= 0; i = bitset_next(chosen, SEAT_WORDS, i+1)) {
+        if (seat_adopt(rq->booking_info.train, i+1, owner))
+            continue;
+        // its lease ran out and somebody took it meanwhile
+        log_warn("seat %d of shift %d lost in the handoff\n", i+1, rq->booking_info.shift_id);
+        bit_clear(chosen, i);
+        rq->booking_info.num_of_chosen_seats--;
     }
 }
 
-void response_client_request(int conn_fd) {
-    fprintf(stderr, "Handle [POLLOUT] for conn_fd: %d\n", conn_fd);
+void response_client_request(request *rq) {
+    log_debug("Handle [POLLOUT] for conn_fd: %d\n", rq->conn_fd);
     int ret = 0;
-    switch(requestP[conn_fd].status) {
+    switch(rq->status) {
         case INIT:
-            ret = response_init(&requestP[conn_fd]);
-            requestP[conn_fd].status = SHIFT;
+            ret = response_init(rq);
+            rq->status = SHIFT;
             break;
         case SHIFT:
-            ret = response_shift(&requestP[conn_fd]);
+            ret = response_shift(rq);
             if(ret == SHIFT_TO_SEAT)
-                requestP[conn_fd].status = SEAT;
+                rq->status = SEAT;
+            break;
+        case WATCH: // the seat map was queued by watch_add, changes by watch_poll
             break;
-        #ifdef WRITE_SERVER
+        // only a writer gets further than SHIFT
         case SEAT:
-            ret = response_seat(&requestP[conn_fd]);
+            ret = response_seat(rq);
             break;
         case PAYMENT:
-            ret = response_payment(&requestP[conn_fd]);
+            ret = response_payment(rq);
             break;
-        #endif
         default:
-            fprintf(stderr, "Unknown operation state for fd %d\n", conn_fd);
+            log_warn("Unknown operation state for fd %d\n", rq->conn_fd);
             return;
     }
 }
 
-void process_client_request(int conn_fd) {
-    // Should determine requestP[conn_fd].status with no ambiguity
-    fprintf(stderr, "Handle [POLLIN] for conn_fd: %d\n", conn_fd);
-    int ret = handle_read(&requestP[conn_fd]);
-    if (ret < 0) {
-        fprintf(stderr, "bad request from %s\n", requestP[conn_fd].host);
-        requestP[conn_fd].status = INVALID;
-        return;
+bool process_client_request(request *rq) {
+    // Should determine rq->status with no ambiguity
+    // Return false if no command is complete yet
+    int len = ring_getline(&rq->in, rq->buf, MAX_MSG_LEN);
+    if (len == -1)
+        return false;
+    log_debug("Handle command for conn_fd: %d\n", rq->conn_fd);
+    if (len < 0) {
+        log_debug("bad request from %s\n", rq->host);
+        rq->status = INVALID;
+        return true;
     }
-    if (strncmp(requestP[conn_fd].buf, "exit", 4) == 0) {
-        requestP[conn_fd].status = EXIT;
-        return;
+    rq->buf_len = len;
+    if (strncmp(rq->buf, "exit", 4) == 0) {
+        rq->status = EXIT;
+        return true;
     }
 
-    ret = 0;
-    switch(requestP[conn_fd].status) {
+    int ret = 0;
+    switch(rq->status) {
         case SHIFT: // State 1. Shift selection
-            ret = select_shift(&requestP[conn_fd]);
+            ret = select_shift(rq);
             if (ret == FAILURE) {
-                requestP[conn_fd].status = INVALID;
+                rq->status = INVALID;
+            } else if(ret == SHIFT_TO_WATCH) {
+                rq->status = WATCH;
             }
             break;
-        #ifdef WRITE_SERVER
-        case SEAT: // State 2. Seat selection
-            ret = select_seat(&requestP[conn_fd]);
+        case WATCH: // only "exit" is taken
+            rq->status = INVALID;
+            break;
+        case SEAT: // State 2. Seat selection (writer)
+            ret = select_seat(rq);
             if (ret == FAILURE) {
-                requestP[conn_fd].status = INVALID;
-            } else if(ret == SEAT_TO_PAYMENT) {
-                requestP[conn_fd].status = PAYMENT;
+                rq->status = INVALID;
+            } else if(ret == SEAT_TO_COMMIT) {
+                rq->status = COMMIT; // answered by finish_commit
             }
             break;
         case PAYMENT: // State 3. After payment
-            ret = finish_payment(&requestP[conn_fd]);
+            ret = finish_payment(rq);
             if (ret == FAILURE) {
-                requestP[conn_fd].status = INVALID;
+                rq->status = INVALID;
             } else if(ret == PAYMENT_TO_SEAT) {
-                requestP[conn_fd].status = SEAT;
+                rq->status = SEAT;
             }
             break;
-        #endif
         default:
-            fprintf(stderr, "Unknown operation state for fd %d\n", conn_fd);
-            requestP[conn_fd].status = INVALID;
-            return;
+            log_warn("Unknown operation state for fd %d\n", rq->conn_fd);
+            rq->status = INVALID;
+            return true;
     }
+    return true;
 }
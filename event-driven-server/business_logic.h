@@ -3,14 +3,21 @@
 
 #include "common.h"
 
-// Global variables
-extern train_info trains[TRAIN_NUM];
-extern int local_locked[TRAIN_NUM][SEAT_NUM];
-
 // Interface
-int unlock(int filefd, int start, int len);
+void init_prompts(void); // once the catalog is loaded
 void unlock_unpaid_seat(request *rq);
-void response_client_request(int conn_fd);
-void process_client_request(int conn_fd);
+// Takes over the locks owner (of the old process) held on the chosen seats
+// (restart handoff), a seat somebody else got meanwhile is dropped
+void adopt_chosen_seats(request *rq, uint64_t owner);
+void response_client_request(request *rq);
+// Reads what the client sent: 1 on success, 0 on EOF, -1 on error
+int handle_read(request *reqP);
+// Same, for bytes received by the caller (io_uring), which fit in reqP->in
+int handle_input(request *reqP, const char* data, size_t len);
+// Handles the next complete command, false if there is none
+bool process_client_request(request *rq);
+// Books (or gives back) the seats of a COMMIT request once its journal
+// batch is written, the answer is then in rq->buf
+void finish_commit(request *rq, bool committed);
 
 #endif
\ No newline at end of file
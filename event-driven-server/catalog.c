@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include "common.h"
+#include "catalog.h"
+#include "bitset.h"
+#include "log.h"
+
+#define DEFAULT_FIRST_SHIFT 902001
+#define DEFAULT_TRAINS 5
+#define DEFAULT_SEATS 40
+
+train_info* trains;
+int num_trains;
+
+static int by_shift_id(const void* a, const void* b) {
+    return ((const train_info*) a)->shift_id - ((const train_info*) b)->shift_id;
+}
+
+static int add_train(int* cap, int shift_id, int seats) {
+    if (num_trains == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        train_info* grown = (train_info*) realloc(trains, sizeof(train_info) * *cap);
+        if (grown == NULL)
+            return -1;
+        trains = grown;
+    }
+    trains[num_trains].shift_id = shift_id;
+    trains[num_trains].seats = seats;
+    num_trains++;
+    return 0;
+}
+
+int catalog_load(const char* path) {
+    int cap = 0;
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        if (errno != ENOENT) {
+            perror(path);
+            return -1;
+        }
+        for (int i = 0; i < DEFAULT_TRAINS; i++)
+            if (add_train(&cap, DEFAULT_FIRST_SHIFT + i, DEFAULT_SEATS) < 0)
+                return -1;
+    } else {
+        char line[256];
+        for (int n = 1; fgets(line, sizeof(line), f) != NULL; n++) {
+            char* hash = strchr(line, '#');
+            if (hash != NULL)
+                *hash = '\0';
+            int shift_id, seats;
+            char rest;
+            int fields = sscanf(line, "%d %d %c", &shift_id, &seats, &rest);
+            if (fields <= 0)
+                continue; // blank
+            if (fields != 2 || shift_id <= 0 || seats < 1 || seats > MAX_SEATS) {
+                log_error("%s:%d: expected \"<shift id> <seats (1-%d)>\"\n", path, n, MAX_SEATS);
+                fclose(f);
+                return -1;
+            }
+            if (add_train(&cap, shift_id, seats) < 0) {
+                fclose(f);
+                return -1;
+            }
+        }
+        fclose(f);
+        if (num_trains == 0) {
+            log_error("%s: no shifts\n", path);
+            return -1;
+        }
+    }
+
+    qsort(trains, num_trains, sizeof(train_info), by_shift_id);
+    int lock_base = 0, bits_base = 0;
+    for (int i = 0; i < num_trains; i++) {
+        if (i > 0 && trains[i].shift_id == trains[i - 1].shift_id) {
+            log_error("%s: shift %d is listed twice\n", path, trains[i].shift_id);
+            return -1;
+        }
+        trains[i].lock_base = lock_base;
+        trains[i].bits_base = bits_base;
+        lock_base += trains[i].seats;
+        bits_base += BITSET_WORDS(trains[i].seats);
+    }
+    return 0;
+}
+
+int catalog_find(int shift_id) {
+    int lo = 0, hi = num_trains - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (trains[mid].shift_id == shift_id)
+            return mid;
+        if (trains[mid].shift_id < shift_id)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+uint32_t catalog_hash(void) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < num_trains; i++) {
+        int fields[2] = { trains[i].shift_id, trains[i].seats };
+        const unsigned char* p = (const unsigned char*) fields;
+        for (size_t j = 0; j < sizeof(fields); j++)
+            h = (h ^ p[j]) * 16777619u;
+    }
+    return h;
+}
@@ -0,0 +1,31 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdint.h>
+
+// Shifts served and their seat counts, read from CATALOG_PATH at startup,
+// one shift per line ('#' starts a comment):
+//     902001 40
+// Without the file the catalog is 5 shifts of 40 seats from 902001.
+// trains[] is sorted by shift id and a train is named by its index there.
+
+#define CATALOG_PATH TRAIN_DIR "/catalog"
+
+typedef struct {
+    int shift_id;
+    int seats;          // 1 to MAX_SEATS
+    int lock_base;      // first lock word of the train in the lock segment
+    int bits_base;      // first word of its locked bitset
+} train_info;
+
+extern train_info* trains;
+extern int num_trains;
+
+// 0 on success, -1 on error (reported on stderr)
+int catalog_load(const char* path);
+// Index of a shift in trains[] (binary search), -1 if not served
+int catalog_find(int shift_id);
+// Changes whenever the shifts or their seat counts do
+uint32_t catalog_hash(void);
+
+#endif
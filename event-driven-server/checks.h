@@ -0,0 +1,28 @@
+#ifndef CHECKS_H
+#define CHECKS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Shared by the test_*.c checks: CHECK reports a failed condition and goes
+// on, main returns failed
+
+static int failed;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failed = 1; \
+        } \
+    } while (0)
+
+// Replaces the file with text, exits if it cannot
+static inline void write_file(const char* path, const char* text) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL || fputs(text, f) < 0 || fclose(f) != 0) {
+        perror(path);
+        exit(1);
+    }
+}
+
+#endif
@@ -18,37 +18,33 @@
 #include <fcntl.h>
 #include <time.h>
 #include <limits.h>
+#include "timer.h"
+#include "outq.h"
+#include "ring.h"
+#include "catalog.h"
 
-#define FILE_LEN 50
-#define MAX_MSG_LEN 512
-#define TRAIN_NUM 5
-#define SEAT_NUM 40
-#define TRAIN_ID_START 902001
-#define TRAIN_ID_END TRAIN_ID_START + (TRAIN_NUM - 1)
+#define TRAIN_DIR "./csie_trains"
+#ifndef MAX_SEATS
+#define MAX_SEATS 256 // seats of the largest train in the catalog
+#endif
+#define MAX_MSG_LEN (MAX_SEATS * 6 + 272) // room for the seat lists
+#define SEAT_WORDS ((MAX_SEATS + 63) / 64) // uint64_t words of a seat bitset
 
 // Return value for state transition
 #define FAILURE -1
 #define SUCCESS 0
-#define SEAT_TO_PAYMENT 1
+#define SEAT_TO_COMMIT 1
 #define PAYMENT_TO_SEAT 1
 #define SHIFT_TO_SEAT 1
+#define SHIFT_TO_WATCH 2
 
 // Structures
-enum SEAT {
-    DEFAULT,    // Seat is unknown
-    CHOSEN,     // Seat is currently being reserved 
-    PAID        // Seat is already paid for
-};
-
-typedef struct {
-    int file_fd;                    // fd of file
-} train_info;
-
 typedef struct {
-    int shift_id;               // shift id 902001-902005
-    int train_fd;               // train file fds
+    int shift_id;               // shift id from the catalog
+    int train;                  // its index in trains[]
     int num_of_chosen_seats;    // num of chosen seats
-    enum SEAT seat_stat[SEAT_NUM];   // seat status
+    uint64_t chosen[SEAT_WORDS];    // seats currently being reserved
+    uint64_t paid[SEAT_WORDS];      // seats already paid for
 } record;
 
 enum STATE {
@@ -56,10 +52,22 @@ enum STATE {
     SHIFT,      // Shift selection
     SEAT,       // Seat selection
     PAYMENT,       // After payment
+    COMMIT,     // Payment waiting for the journal, no answer yet
+    WATCH,      // Reader subscribed to a shift's changes, see watch.h
 
     // error states
     INVALID,    // Invalid state
-    EXIT        // Exit
+    EXIT,       // Exit
+
+    LISTEN,     // Not a client: a listening socket
+    HEADER,     // Stats client: rest of an HTTP request header
+    CLOSED      // Closed, its io_uring requests not all completed yet
+};
+
+enum ROLE {
+    READER,     // queries: seat maps
+    WRITER,     // bookings
+    STATS       // metrics, see metrics.h
 };
 
 typedef struct {
@@ -68,15 +76,39 @@ typedef struct {
     int listen_fd;  // fd to wait for a new connection
 } server;
 
-typedef struct {
-    char host[512];             // client's host
+// A connection, allocated from its reactor's slab pool when accepted and
+// given back when closed. Fields touched by every command come first.
+typedef struct request {
     int conn_fd;                // fd to talk with client
-    int client_id;              // client's id
-    char buf[MAX_MSG_LEN];      // data sent by/to client
-    size_t buf_len;             // bytes used by buf
     enum STATE status;          // request status
-    record booking_info;        // booking status (only used by write server)
-    struct timeval deadline; // connection deadline
+    enum ROLE role;             // protocol spoken, that of the port it came in on
+#ifdef USE_IO_URING
+    int inflight;               // io_uring requests not completed
+    int sending;                // sends of the chain not completed
+    bool receiving;             // a recv is queued
+    struct request* stalled_next;   // in the reactor's stalled list: the ring
+    struct request** stalled_pprev; // had no room for it (NULL if not)
+#else
+    int events;                 // EV_* flags registered for conn_fd
+#endif
+    char* buf;                  // command being handled / response being built:
+                                // the reactor's, a command is answered before
+                                // the reactor turns to another connection
+    size_t buf_len;             // bytes used by buf
+    outq out;                   // responses not sent yet
+    timer_node timer;           // connection deadline
+    uint64_t cmd_ns;            // when the payment waiting in COMMIT came in
+    record booking_info;        // booking status (write server), shift watched (read server)
+    uint64_t lock_owner;        // seat lock word, 0 until the first seat is locked
+    ring in;                    // data sent by client, not handled yet
+    struct request* watch_next; // next watcher of the shift
+    struct request** watch_pprev; // link to this watcher, NULL if not watching
+    struct request* conn_next;  // next connection of the reactor
+    struct request** conn_pprev; // link to this one in the reactor's list
+
+    // only for logs and the journal
+    int client_id;              // client's id
+    char host[INET_ADDRSTRLEN]; // client's address
 } request;
 
 
@@ -0,0 +1,242 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "event_loop.h"
+
+#ifdef USE_POLL
+#include <poll.h>
+
+// The arrays grow as fds are registered: with the highest fd for slot, with
+// the fds registered for the others
+struct event_loop {
+    struct pollfd* fds;     // registered fds, packed in [0, nfds)
+    void** data;            // user data of fds[i]
+    int* slot;              // fd -> index in fds, -1 if not registered
+    int nfds;
+    int cap;                // room in fds and data
+    int slots;              // room in slot
+    int max_fds;
+    int next;               // where the next ev_wait starts reporting
+};
+
+static short to_poll(int events) {
+    short ev = 0;
+    if (events & EV_READ)
+        ev |= POLLIN;
+    if (events & EV_WRITE)
+        ev |= POLLOUT;
+    return ev;
+}
+
+event_loop* ev_create(int max_fds) {
+    event_loop* loop = (event_loop*) calloc(1, sizeof(event_loop));
+    if (loop == NULL)
+        return NULL;
+    loop->max_fds = max_fds;
+    return loop;
+}
+
+// Room for one more fd, and for fd in slot. 0 on success, -1 out of memory
+static int grow(event_loop* loop, int fd) {
+    if (loop->nfds == loop->cap) {
+        int cap = loop->cap ? loop->cap * 2 : 64;
+        struct pollfd* fds = (struct pollfd*) realloc(loop->fds, sizeof(struct pollfd) * cap);
+        if (fds == NULL)
+            return -1;
+        loop->fds = fds;
+        void** data = (void**) realloc(loop->data, sizeof(void*) * cap);
+        if (data == NULL)
+            return -1;
+        loop->data = data;
+        loop->cap = cap;
+    }
+    if (fd >= loop->slots) {
+        int slots = loop->slots ? loop->slots : 64;
+        while (slots <= fd)
+            slots *= 2;
+        if (slots > loop->max_fds)
+            slots = loop->max_fds;
+        int* slot = (int*) realloc(loop->slot, sizeof(int) * slots);
+        if (slot == NULL)
+            return -1;
+        for (int i = loop->slots; i < slots; i++)
+            slot[i] = -1;
+        loop->slot = slot;
+        loop->slots = slots;
+    }
+    return 0;
+}
+
+void ev_destroy(event_loop* loop) {
+    if (loop == NULL)
+        return;
+    free(loop->fds);
+    free(loop->data);
+    free(loop->slot);
+    free(loop);
+}
+
+const char* ev_backend(void) {
+    return "poll";
+}
+
+int ev_add(event_loop* loop, int fd, int events, void* data) {
+    if (fd < 0 || fd >= loop->max_fds) {
+        errno = EBADF;
+        return -1;
+    }
+    if (grow(loop, fd) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (loop->slot[fd] != -1) {
+        errno = EEXIST;
+        return -1;
+    }
+    int i = loop->nfds++;
+    loop->fds[i].fd = fd;
+    loop->fds[i].events = to_poll(events);
+    loop->fds[i].revents = 0;
+    loop->data[i] = data;
+    loop->slot[fd] = i;
+    return 0;
+}
+
+int ev_mod(event_loop* loop, int fd, int events, void* data) {
+    if (fd < 0 || fd >= loop->slots || loop->slot[fd] == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+    int i = loop->slot[fd];
+    loop->fds[i].events = to_poll(events);
+    loop->data[i] = data;
+    return 0;
+}
+
+int ev_del(event_loop* loop, int fd) {
+    if (fd < 0 || fd >= loop->slots || loop->slot[fd] == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+    // move the last entry into the hole
+    int i = loop->slot[fd];
+    int last = --loop->nfds;
+    if (i != last) {
+        loop->fds[i] = loop->fds[last];
+        loop->data[i] = loop->data[last];
+        loop->slot[loop->fds[i].fd] = i;
+    }
+    loop->slot[fd] = -1;
+    return 0;
+}
+
+int ev_wait(event_loop* loop, ev_event* events, int max, int timeout) {
+    int ready = poll(loop->fds, loop->nfds, timeout);
+    if (ready < 0)
+        return errno == EINTR ? 0 : -1;
+
+    // revents of fds beyond max are kept by the next poll (level-triggered),
+    // start from where we stopped so that no fd starves
+    int n = 0;
+    for (int k = 0; k < loop->nfds && n < max && n < ready; k++) {
+        int i = (loop->next + k) % loop->nfds;
+        short rev = loop->fds[i].revents;
+        if (rev == 0)
+            continue;
+        events[n].data = loop->data[i];
+        events[n].events = 0;
+        if (rev & POLLIN)
+            events[n].events |= EV_READ;
+        if (rev & POLLOUT)
+            events[n].events |= EV_WRITE;
+        if (rev & (POLLERR | POLLHUP | POLLNVAL))
+            events[n].events |= EV_ERROR;
+        n++;
+        loop->next = i + 1;
+    }
+    return n;
+}
+
+#else
+#include <sys/epoll.h>
+
+struct event_loop {
+    int epfd;
+    struct epoll_event* ready;
+    int max_ready;
+};
+
+static int ctl(event_loop* loop, int op, int fd, int events, void* data) {
+    struct epoll_event ev;
+    ev.events = 0;
+    if (events & EV_READ)
+        ev.events |= EPOLLIN;
+    if (events & EV_WRITE)
+        ev.events |= EPOLLOUT;
+    ev.data.u64 = 0;
+    ev.data.ptr = data;
+    return epoll_ctl(loop->epfd, op, fd, &ev);
+}
+
+event_loop* ev_create(int max_fds) {
+    event_loop* loop = (event_loop*) calloc(1, sizeof(event_loop));
+    if (loop == NULL)
+        return NULL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->max_ready = max_fds < 1024 ? max_fds : 1024;
+    loop->ready = (struct epoll_event*) malloc(sizeof(struct epoll_event) * loop->max_ready);
+    if (loop->epfd < 0 || loop->ready == NULL) {
+        ev_destroy(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+void ev_destroy(event_loop* loop) {
+    if (loop == NULL)
+        return;
+    if (loop->epfd >= 0)
+        close(loop->epfd);
+    free(loop->ready);
+    free(loop);
+}
+
+const char* ev_backend(void) {
+    return "epoll";
+}
+
+int ev_add(event_loop* loop, int fd, int events, void* data) {
+    return ctl(loop, EPOLL_CTL_ADD, fd, events, data);
+}
+
+int ev_mod(event_loop* loop, int fd, int events, void* data) {
+    return ctl(loop, EPOLL_CTL_MOD, fd, events, data);
+}
+
+int ev_del(event_loop* loop, int fd) {
+    struct epoll_event ev; // ignored, non-NULL for old kernels
+    return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+int ev_wait(event_loop* loop, ev_event* events, int max, int timeout) {
+    if (max > loop->max_ready)
+        max = loop->max_ready;
+    int ready = epoll_wait(loop->epfd, loop->ready, max, timeout);
+    if (ready < 0)
+        return errno == EINTR ? 0 : -1;
+    for (int i = 0; i < ready; i++) {
+        uint32_t rev = loop->ready[i].events;
+        events[i].data = loop->ready[i].data.ptr;
+        events[i].events = 0;
+        if (rev & EPOLLIN)
+            events[i].events |= EV_READ;
+        if (rev & EPOLLOUT)
+            events[i].events |= EV_WRITE;
+        if (rev & (EPOLLERR | EPOLLHUP))
+            events[i].events |= EV_ERROR;
+    }
+    return ready;
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+// Small readiness interface over epoll (default) or poll (-D USE_POLL).
+// Both backends are level-triggered and cost O(ready fds) per wakeup: epoll
+// by construction, poll by keeping the registered fds packed (a removed fd
+// is replaced by the last one).
+
+// Event flags
+#define EV_READ  0x1
+#define EV_WRITE 0x2
+#define EV_ERROR 0x4 // error or hang up, always reported
+
+// Only the user data comes back (as with epoll), it has to identify the fd
+typedef struct {
+    int events;     // EV_* flags that are ready
+    void* data;     // user data given to ev_add / ev_mod
+} ev_event;
+
+typedef struct event_loop event_loop;
+
+// max_fds: fds are in [0, max_fds)
+event_loop* ev_create(int max_fds);
+void ev_destroy(event_loop* loop);
+const char* ev_backend(void);
+
+// Return 0 on success, -1 with errno set
+int ev_add(event_loop* loop, int fd, int events, void* data);
+int ev_mod(event_loop* loop, int fd, int events, void* data);
+int ev_del(event_loop* loop, int fd);
+
+// Waits at most timeout milliseconds (-1: forever), fills at most max events
+// Return the number of ready events, 0 on timeout or EINTR, -1 on error
+int ev_wait(event_loop* loop, ev_event* events, int max, int timeout);
+
+#endif
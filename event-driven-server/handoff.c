@@ -0,0 +1,212 @@
+#define _GNU_SOURCE // execvpe, MSG_CMSG_CLOEXEC
+#include <stdio.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include "handoff.h"
+#include "log.h"
+
+#define HANDOFF_SNDBUF (4 << 20) // a message goes whole, output queue included
+
+extern char** environ;
+
+static char** cmdline;      // as given, run again by handoff_spawn
+static int peer = -1;       // our end of the socket pair
+static handoff_item* items; // received by the new process
+static int n_items;
+
+static void set_timeouts(int fd) {
+    struct timeval tv = { HANDOFF_TIMEOUT_MS / 1000, HANDOFF_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+int handoff_init(int argc, char** argv) {
+    if ((cmdline = (char**) calloc(argc + 1, sizeof(char*))) == NULL)
+        return -1;
+    memcpy(cmdline, argv, sizeof(char*) * argc);
+    const char* env = getenv(HANDOFF_ENV);
+    if (env == NULL)
+        return 0;
+    peer = atoi(env);
+    unsetenv(HANDOFF_ENV); // not for a restart of our own
+    fcntl(peer, F_SETFD, FD_CLOEXEC);
+    set_timeouts(peer);
+    handoff_msg ready = { .type = HANDOFF_READY };
+    return handoff_send(&ready, -1, NULL, 0);
+}
+
+int handoff_send(handoff_msg* m, int fd, const struct iovec* data, int n) {
+    struct iovec iov[n + 1];
+    union {
+        char space[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    m->pid = getpid();
+    iov[0].iov_base = m;
+    iov[0].iov_len = sizeof(handoff_msg);
+    if (n > 0)
+        memcpy(iov + 1, data, sizeof(struct iovec) * n);
+    struct msghdr mh = { .msg_iov = iov, .msg_iovlen = n + 1 };
+    if (fd >= 0) {
+        mh.msg_control = ctl.space;
+        mh.msg_controllen = sizeof(ctl.space);
+        struct cmsghdr* c = CMSG_FIRSTHDR(&mh);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+    ssize_t ret;
+    while ((ret = sendmsg(peer, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    return ret < 0 ? -1 : 0;
+}
+
+// Next message into it, its data allocated, the fd (if any) close-on-exec
+static int recv_item(handoff_item* it) {
+    // the whole size first, the data is allocated for it
+    ssize_t size;
+    while ((size = recv(peer, NULL, 0, MSG_PEEK | MSG_TRUNC)) < 0 && errno == EINTR)
+        ;
+    if (size < 0)
+        return -1;
+    if (size < (ssize_t) sizeof(handoff_msg)) { // 0: the other process is gone
+        errno = size == 0 ? ECONNRESET : EPROTO;
+        return -1;
+    }
+    if ((it->data = (char*) malloc(size - sizeof(handoff_msg) + 1)) == NULL)
+        return -1;
+    union {
+        char space[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct iovec iov[2] = { { &it->m, sizeof(handoff_msg) }, { it->data, size - sizeof(handoff_msg) } };
+    struct msghdr mh = { .msg_iov = iov, .msg_iovlen = 2, .msg_control = ctl.space, .msg_controllen = sizeof(ctl.space) };
+    if (recvmsg(peer, &mh, MSG_CMSG_CLOEXEC) != size) {
+        free(it->data);
+        return -1;
+    }
+    it->fd = -1;
+    struct cmsghdr* c = CMSG_FIRSTHDR(&mh);
+    if (c != NULL && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+        memcpy(&it->fd, CMSG_DATA(c), sizeof(int));
+    return 0;
+}
+
+int handoff_spawn(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    // the environment is built before the fork: the child of a threaded
+    // process only makes async-signal-safe calls until it execs
+    char var[64];
+    snprintf(var, sizeof(var), HANDOFF_ENV "=%d", sv[1]);
+    int n = 0;
+    while (environ[n] != NULL)
+        n++;
+    char** envp = (char**) malloc(sizeof(char*) * (n + 2));
+    if (envp == NULL) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    int k = 0;
+    for (int i = 0; i < n; i++)
+        if (strncmp(environ[i], HANDOFF_ENV "=", sizeof(HANDOFF_ENV)) != 0)
+            envp[k++] = environ[i];
+    envp[k++] = var;
+    envp[k] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        fcntl(sv[1], F_SETFD, 0); // its end stays open across exec
+        execvpe(cmdline[0], cmdline, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        return -1;
+    }
+    peer = sv[0];
+    set_timeouts(peer);
+    int size = HANDOFF_SNDBUF;
+    setsockopt(peer, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    handoff_item ready;
+    if (recv_item(&ready) < 0) {
+        log_error("restart: %s did not come up: %s\n", cmdline[0], strerror(errno));
+        close(peer);
+        peer = -1;
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    free(ready.data);
+    log_info("restart: handing over to pid %d\n", pid);
+    return 0;
+}
+
+int handoff_wait_ack(void) {
+    handoff_item ack;
+    if (recv_item(&ack) < 0)
+        return -1;
+    free(ack.data);
+    return ack.m.type == HANDOFF_ACK ? 0 : -1;
+}
+
+int handoff_receive(void) {
+    if (peer < 0)
+        return 0;
+    int cap = 0;
+    do {
+        if (n_items == cap) {
+            cap = cap ? cap * 2 : 64;
+            handoff_item* grown = (handoff_item*) realloc(items, sizeof(handoff_item) * cap);
+            if (grown == NULL)
+                return -1;
+            items = grown;
+        }
+        if (recv_item(&items[n_items]) < 0)
+            return -1;
+    } while (items[n_items++].m.type != HANDOFF_END);
+    return n_items;
+}
+
+handoff_item* handoff_items(int* n) {
+    *n = n_items;
+    return items;
+}
+
+int handoff_listener(int reactor, enum ROLE role) {
+    for (int i = 0; i < n_items; i++) {
+        handoff_item* it = &items[i];
+        if (it->m.type == HANDOFF_LISTENER && it->m.reactor == reactor && it->m.role == role && it->fd >= 0) {
+            int fd = it->fd;
+            it->fd = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+void handoff_done(void) {
+    if (peer < 0)
+        return;
+    handoff_msg ack = { .type = HANDOFF_ACK };
+    if (handoff_send(&ack, -1, NULL, 0) < 0)
+        log_warn("restart: cannot ack: %s\n", strerror(errno));
+    for (int i = 0; i < n_items; i++) {
+        if (items[i].fd >= 0) // a listener of a reactor we do not have
+            close(items[i].fd);
+        free(items[i].data);
+    }
+    free(items);
+    items = NULL;
+    n_items = 0;
+    close(peer);
+    peer = -1;
+}
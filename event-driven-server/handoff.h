@@ -0,0 +1,87 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "common.h"
+
+// Restart without dropping a client: on SIGUSR2 the server runs its binary
+// again (argv[0], same arguments, so an upgraded binary is picked up) and
+// hands the new process, over a Unix socket pair (SOCK_SEQPACKET, one
+// message each, fds passed as SCM_RIGHTS):
+//     a listener per reactor and port     the same sockets keep accepting,
+//                                         what waits in their backlog is
+//                                         accepted by the new process
+//     every connection                    its socket, the request state
+//                                         (status, booking, deadline), the
+//                                         input not handled yet and the
+//                                         output not sent yet
+//     the end                             client numbering, then the old
+//                                         process waits for the ack
+// The new process finds its end of the pair in HANDOFF_ENV, says it is up
+// before anything is sent (a binary that fails to start leaves the old
+// process serving), takes everything in before opening the journal, and
+// acks once its reactors hold the connections and the seat locks: lock
+// words name their owner's pid, the new process swaps its own in (owner id
+// and lease kept) while the old one is still alive.
+
+#define HANDOFF_ENV "TRAIN_HANDOFF_FD"
+#define HANDOFF_TIMEOUT_MS 10000 // the other process is given up on after this
+
+enum HANDOFF_MSG {
+    HANDOFF_READY,      // new process: up, send
+    HANDOFF_LISTENER,
+    HANDOFF_CONN,
+    HANDOFF_END,
+    HANDOFF_ACK         // new process: serving, the old one may go
+};
+
+typedef struct {
+    enum HANDOFF_MSG type;
+    pid_t pid;              // sender
+    int reactor;            // LISTENER, CONN: reactor of the old process
+    enum ROLE role;
+    // CONN, the bytes follow: input, output, then a watcher's seat map
+    enum STATE status;
+    int client_id;
+    long deadline;          // monotonic ms (the clock is the machine's), 0 if not armed
+    uint64_t lock_owner;    // seat lock word of the request, 0 if none
+    record booking_info;
+    char host[INET_ADDRSTRLEN];
+    uint32_t in_len;
+    uint32_t out_len;
+    uint32_t map_len;
+    int next_client;        // END: client numbers go on from here
+} handoff_msg;
+
+// A message received, data the bytes that followed it
+typedef struct {
+    handoff_msg m;
+    int fd;                 // -1 if none came with it, or once taken
+    char* data;
+} handoff_item;
+
+// Before the command line is parsed: keeps it for handoff_spawn, and in a
+// new process says it is up. -1 on error.
+int handoff_init(int argc, char** argv);
+
+// Old process
+// Starts the new process and waits until it is up, -1 if it did not come up
+int handoff_spawn(void);
+// One message, fd (-1: none) and the n pieces of data after m. 0 on
+// success, -1 with errno set (EMSGSIZE: more than the socket takes).
+// Reactors send at the same time, each message goes whole.
+int handoff_send(handoff_msg* m, int fd, const struct iovec* data, int n);
+// Waits until the new process serves, -1 if it failed
+int handoff_wait_ack(void);
+
+// New process
+// Takes in every message up to HANDOFF_END, 0 if not started by
+// handoff_spawn. Return the number of messages, -1 on error.
+int handoff_receive(void);
+// Received messages in order, NULL if there were none
+handoff_item* handoff_items(int* n);
+// Listener handed over for reactor and role, -1 if none
+int handoff_listener(int reactor, enum ROLE role);
+// Acks, then closes what was not taken and frees the messages
+void handoff_done(void);
+
+#endif
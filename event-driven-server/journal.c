@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "seat_table.h"
+#include "log.h"
+
+static int journal_fd = -1;             // replay and checkpoints
+static __thread int commit_fd = -1;     // per thread, flock is per descriptor
+static __thread journal_record* batch;
+static __thread int batch_len, batch_cap;
+static __thread bool batch_lost;        // out of memory in journal_add
+
+// flock on journal_fd is shared by the threads, so checkpoints take turns
+static pthread_mutex_t checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+// The journal grew past JOURNAL_CHECKPOINT_BYTES: the checkpointer thread
+// syncs and empties it, a reactor only waits for the part under the lock
+static pthread_mutex_t due_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t due_cond = PTHREAD_COND_INITIALIZER;
+static bool checkpoint_due;
+
+// FNV-1a over the fields before check
+static uint32_t checksum(const journal_record* rec) {
+    const unsigned char* p = (const unsigned char*) rec;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < offsetof(journal_record, check); i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static int64_t realtime_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void* checkpointer_main(void* arg) {
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&due_lock);
+        while (!checkpoint_due)
+            pthread_cond_wait(&due_cond, &due_lock);
+        checkpoint_due = false;
+        pthread_mutex_unlock(&due_lock);
+        if (journal_checkpoint(true) < 0)
+            log_warn("journal: checkpoint failed: %s\n", strerror(errno));
+    }
+    return NULL;
+}
+
+int journal_open(void (*apply)(int shift_id, int seat)) {
+    journal_fd = open(JOURNAL_PATH, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal_fd < 0)
+        return -1;
+    if (flock(journal_fd, LOCK_EX) < 0)
+        return -1;
+
+    // A record torn by a crash shifts every record appended after it, so
+    // past a record that does not check out the scan moves on a byte at a
+    // time until the next one that does
+    struct stat st;
+    if (fstat(journal_fd, &st) < 0)
+        return -1;
+    char* bytes = (char*) malloc(st.st_size + 1);
+    if (bytes == NULL || pread(journal_fd, bytes, st.st_size, 0) != st.st_size) {
+        free(bytes);
+        return -1;
+    }
+    int replayed = 0;
+    off_t skipped = 0;
+    journal_record rec;
+    for (off_t off = 0; off + (off_t) sizeof(rec) <= st.st_size; ) {
+        memcpy(&rec, bytes + off, sizeof(rec));
+        int train = rec.check == checksum(&rec) ? catalog_find(rec.shift_id) : -1;
+        if (train < 0 || rec.seat < 1 || rec.seat > trains[train].seats) {
+            off++;
+            skipped++;
+            continue;
+        }
+        apply(rec.shift_id, rec.seat);
+        replayed++;
+        off += sizeof(rec);
+    }
+    free(bytes);
+    flock(journal_fd, LOCK_UN);
+    if (replayed > 0)
+        log_info("journal: replayed %d booking(s)\n", replayed);
+    if (skipped > 0)
+        log_warn("journal: skipped %ld damaged byte(s)\n", (long) skipped);
+    if (journal_checkpoint(true) < 0)
+        return -1;
+    pthread_t checkpointer;
+    if (pthread_create(&checkpointer, NULL, checkpointer_main, NULL) != 0)
+        return -1;
+    pthread_detach(checkpointer);
+    return replayed;
+}
+
+void journal_add(int shift_id, int seat, int client_id) {
+    if (batch_len == batch_cap) {
+        int cap = batch_cap ? batch_cap * 2 : 64;
+        journal_record* grown = (journal_record*) realloc(batch, sizeof(journal_record) * cap);
+        if (grown == NULL) {
+            batch_lost = true; // journal_commit fails the batch
+            return;
+        }
+        batch = grown;
+        batch_cap = cap;
+    }
+    journal_record* rec = &batch[batch_len++];
+    memset(rec, 0, sizeof(*rec));
+    rec->time_ms = realtime_ms();
+    rec->shift_id = shift_id;
+    rec->seat = seat;
+    rec->client_id = client_id;
+    rec->check = checksum(rec);
+}
+
+void journal_drop(int client_id) {
+    int kept = 0;
+    for (int i = 0; i < batch_len; i++)
+        if (batch[i].client_id != client_id)
+            batch[kept++] = batch[i];
+    batch_len = kept;
+}
+
+// Takes a failed batch back out of the journal, written bytes of it ending
+// at the descriptor's offset: its payments are refused. 0 once it is gone
+// for good, -1 if it may still be replayed
+static int undo_commit(size_t written) {
+    off_t end = lseek(commit_fd, 0, SEEK_CUR);
+    off_t start = end - (off_t) written;
+    // exclusive: the other batches are applied, and none is appended meanwhile
+    if (end < 0 || flock(commit_fd, LOCK_EX) < 0)
+        return -1;
+    // a checkpoint may have emptied the journal while the lock was converted
+    struct stat st;
+    char* mine = (char*) malloc(written);
+    if (mine == NULL || fstat(commit_fd, &st) < 0) {
+        free(mine);
+        return -1;
+    }
+    bool there = st.st_size >= end && pread(journal_fd, mine, written, start) == (ssize_t) written
+                 && memcmp(mine, batch, written) == 0;
+    free(mine);
+    if (there) {
+        // batches appended after ours go too, once their seats are on disk
+        if (st.st_size > end && seat_table_sync() < 0)
+            return -1;
+        if (ftruncate(commit_fd, start) < 0)
+            return -1;
+    }
+    return fdatasync(commit_fd);
+}
+
+int journal_commit(void) {
+    int n = batch_len;
+    bool lost = batch_lost;
+    batch_len = 0;
+    batch_lost = false;
+    if (commit_fd < 0)
+        commit_fd = open(JOURNAL_PATH, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (commit_fd < 0 || lost)
+        return -1;
+    // held until journal_release: no checkpoint before the seats are booked
+    if (flock(commit_fd, LOCK_SH) < 0)
+        return -1;
+    // O_APPEND: concurrent batches of other servers do not interleave
+    size_t len = sizeof(journal_record) * n;
+    ssize_t written = write(commit_fd, batch, len);
+    if (written == (ssize_t) len && fdatasync(commit_fd) == 0)
+        return 0;
+    if (written <= 0)
+        return -1; // nothing of it went in
+    int err = errno;
+    if (undo_commit(written) < 0) {
+        log_error("journal: a failed commit may be on disk, its %d payment(s) stand\n", n);
+        return 0;
+    }
+    errno = err;
+    return -1;
+}
+
+void journal_release(void) {
+    if (commit_fd < 0)
+        return;
+    flock(commit_fd, LOCK_UN);
+    if (lseek(commit_fd, 0, SEEK_END) < JOURNAL_CHECKPOINT_BYTES)
+        return;
+    pthread_mutex_lock(&due_lock);
+    checkpoint_due = true;
+    pthread_cond_signal(&due_cond);
+    pthread_mutex_unlock(&due_lock);
+}
+
+int journal_checkpoint(bool wait) {
+    if (journal_fd < 0)
+        return 0;
+    if (wait ? pthread_mutex_lock(&checkpoint_lock) != 0 : pthread_mutex_trylock(&checkpoint_lock) != 0)
+        return wait ? -1 : 0;
+    // commits wait while the lock is held: the train files are written back
+    // first, under the lock only what was booked meanwhile is left
+    if (wait && seat_table_sync() < 0) {
+        pthread_mutex_unlock(&checkpoint_lock);
+        return -1;
+    }
+    int ret = 0;
+    if (flock(journal_fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) < 0) {
+        ret = wait ? -1 : 0;
+    } else {
+        ret = seat_table_sync();
+        if (ret == 0)
+            ret = ftruncate(journal_fd, 0);
+        flock(journal_fd, LOCK_UN);
+    }
+    pthread_mutex_unlock(&checkpoint_lock);
+    return ret;
+}
@@ -0,0 +1,54 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include "common.h"
+
+// Write-ahead journal of paid seats, shared by every write server working
+// on ./csie_trains. A payment is appended and synced before its seats are
+// marked booked in the train files, and payments handled in the same event
+// loop iteration share one write and one fdatasync (group commit).
+//
+// The train files are the snapshot: a checkpoint syncs them and empties the
+// journal. Checkpoints run at startup after replaying what a crashed server
+// left, when the journal grows past JOURNAL_CHECKPOINT_BYTES (on a thread
+// of their own, woken by journal_release) and on SIGTERM (once every
+// reactor has stopped, not in the handler).
+// Between its commit and the end of applying it a thread holds a shared
+// flock on its own descriptor, a checkpoint takes it exclusively, so no
+// record is dropped before its seats reach the train files. A commit waits
+// for a checkpoint holding the lock; the train files are synced before it
+// is taken, so that is one more msync of the seats booked in between.
+
+#define JOURNAL_PATH TRAIN_DIR "/booking.journal"
+#define JOURNAL_CHECKPOINT_BYTES (1 << 20)
+
+typedef struct {
+    int64_t time_ms;        // CLOCK_REALTIME of the payment
+    int32_t shift_id;
+    int32_t seat;
+    int32_t client_id;
+    uint32_t check;         // checksum of the fields above, spots torn writes
+} journal_record;
+
+// Opens (creates) the journal and replays it through apply, then
+// checkpoints. Return the number of records replayed, -1 on error
+int journal_open(void (*apply)(int shift_id, int seat));
+
+// Adds a seat to the calling thread's batch
+void journal_add(int shift_id, int seat, int client_id);
+// Takes a client's seats out of the batch
+void journal_drop(int client_id);
+// Writes and syncs the batch, 0 on success, -1 on error (batch dropped).
+// A batch written in part or not synced is cut off the journal again; if
+// that fails too it may be replayed after a crash, so it counts as
+// committed (0). Either way call journal_release once the batch is applied;
+// it only wakes the checkpointer, never runs a checkpoint itself.
+int journal_commit(void);
+void journal_release(void);
+
+// Syncs the train files and empties the journal, -1 on error. Unless wait
+// it gives up (0) while a commit is under way.
+int journal_checkpoint(bool wait);
+
+#endif
@@ -0,0 +1,593 @@
+// loadgen: load generator for the train booking protocol
+//
+// usage: ./loadgen <read_port> <write_port> [-c connections] [-t threads]
+//                  [-d seconds] [-m mix] [-H hot seats] [-a address] [-j file]
+//
+// Opens many connections at once from a few threads, each with its own
+// epoll, and plays one scenario per connection, always sending the next
+// command as soon as the prompt of the previous answer arrived:
+//     query   read port: asks for random shifts
+//     book    write port: locks random seats of random shifts and pays them
+//     hot     write port: every connection fights for the first H seats of
+//             the lowest shift, locking and cancelling, never paying
+//     idle    connects, reads the banner, then waits for the server to close
+// The mix gives the share of connections per scenario, "query=70,book=20,hot=10"
+// by default. A port of 0 leaves its scenarios out of the default mix.
+//
+// Every answer is timed from the command to the end of its prompt, per
+// transition: banner (connect to first prompt), shift, seat, pay and
+// continue ("seat" after a payment); timeout is connect to the server's
+// ">>> Connection timeout." of an idle connection. The report gives the
+// answers per second and p50/p90/p99/p999 per transition, as text on stdout
+// and as JSON with -j (a file, or - for stdout).
+//
+// Connections are opened again when the server closes them (CONN_TIMEOUT_MS
+// after accept), a command cut by that close is counted, not timed. Booked
+// seats stay booked: run it against a copy of ./csie_trains.
+#include <cstdio>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define ERR_EXIT(a) do { perror(a); exit(1); } while(0)
+
+#define MAX_EVENTS 256
+#define RETRY_NS 100000000L     // wait before connecting again after an error
+#define MAX_MISSES 8            // seats tried in a row without a lock, then exit
+
+enum scenario { QUERY, BOOK, HOT, IDLE, NUM_SCENARIOS };
+static const char* scenario_names[NUM_SCENARIOS] = {"query", "book", "hot", "idle"};
+
+enum transition { T_BANNER, T_SHIFT, T_SEAT, T_PAY, T_CONTINUE, T_TIMEOUT, NUM_TRANSITIONS };
+static const char* transition_names[NUM_TRANSITIONS] = {"banner", "shift", "seat", "pay", "continue", "timeout"};
+
+enum outcome {
+    O_PAID,                     // ">>> Your train booking is successful."
+    O_WON,                      // seat locked for this connection
+    O_HELD,                     // ">>> Locked." (by another client)
+    O_TAKEN,                    // ">>> The seat is booked."
+    O_CANCELLED,                // ">>> You cancel the seat."
+    O_FULL,                     // ">>> The shift is fully booked."
+    O_PAY_FAILED,               // ">>> Payment failed, please try again."
+    O_TIMEOUTS,                 // ">>> Connection timeout."
+    O_CUT,                      // closed while a command was pending
+    O_ERRORS,                   // connect / read / write errors
+    NUM_OUTCOMES
+};
+static const char* outcome_names[NUM_OUTCOMES] = {"paid", "won", "held", "taken", "cancelled", "full",
+                                                  "pay_failed", "timeouts", "cut", "errors"};
+
+// What a connection waits for
+enum conn_state { CONNECTING, WAIT_BANNER, WAIT_SHIFT, WAIT_SEAT, WAIT_PAY, WAIT_CONTINUE, WAIT_CLOSE, WAIT_EXIT };
+
+struct conn {
+    int fd;                     // -1: closed
+    scenario kind;
+    conn_state state;
+    long connect_ns;            // when connect started
+    long sent_ns;               // when the pending command left
+    long retry_ns;              // when to connect again (fd -1)
+    std::string in;             // answer so far
+    int shift_lo, shift_hi;     // shifts named by the prompt
+    int seats;                  // seats of the shift chosen
+    int seat;                   // seat asked for last
+    int misses;                 // seats tried in a row without a lock
+    std::vector<char> paid;     // [seats + 1], seats this connection paid
+};
+
+struct worker {
+    int epfd;
+    std::vector<conn> conns;
+    std::vector<conn*> retry;   // closed after an error, waiting for retry_ns
+    std::mt19937 rng;
+    std::vector<uint32_t> samples[NUM_TRANSITIONS]; // microseconds
+    long outcomes[NUM_OUTCOMES];
+    std::thread thread;
+};
+
+static struct sockaddr_in server_addr;
+static int ports[NUM_SCENARIOS];
+static int hot_seats = 4;
+static long end_ns;
+
+static const char* usage_msg = "usage: %s <read_port> <write_port> [-c connections] [-t threads] [-d seconds]\n"
+                               "       [-m query=70,book=20,hot=10,idle=0] [-H hot seats] [-a address] [-j file]\n";
+
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static bool ends_with(const std::string& s, const char* suffix) {
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+static bool starts_with(const std::string& s, const char* prefix) {
+    return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// "[902001-902005]: " at the end of a prompt
+static bool parse_range(const std::string& s, int* lo, int* hi) {
+    size_t open = s.rfind('[');
+    return open != std::string::npos && sscanf(s.c_str() + open, "[%d-%d]", lo, hi) == 2 && *lo <= *hi;
+}
+
+// -------------------------------------------------------------
+// Connections
+
+static void retry_later(worker* w, conn* c) {
+    w->outcomes[O_ERRORS]++;
+    c->retry_ns = now_ns() + RETRY_NS;
+    w->retry.push_back(c);
+}
+
+static void start_conn(worker* w, conn* c) {
+    c->in.clear();
+    c->misses = 0;
+    c->connect_ns = c->sent_ns = now_ns();
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        retry_later(w, c);
+        return;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct sockaddr_in addr = server_addr;
+    addr.sin_port = htons(ports[c->kind]);
+    struct epoll_event ev;
+    ev.data.ptr = c;
+    if (connect(c->fd, (struct sockaddr*) &addr, sizeof(addr)) == 0) {
+        c->state = WAIT_BANNER;
+        ev.events = EPOLLIN;
+    } else if (errno == EINPROGRESS) {
+        c->state = CONNECTING;
+        ev.events = EPOLLOUT;
+    } else {
+        close(c->fd);
+        c->fd = -1;
+        retry_later(w, c);
+        return;
+    }
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+        ERR_EXIT("epoll_ctl");
+}
+
+// Connects again at once, or after RETRY_NS on error
+static void close_conn(worker* w, conn* c, bool error) {
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    if (error)
+        retry_later(w, c);
+    else
+        start_conn(w, c);
+}
+
+static void send_line(worker* w, conn* c, conn_state next, const char* fmt, ...) __attribute__((format(printf, 4, 5)));
+static void send_line(worker* w, conn* c, conn_state next, const char* fmt, ...) {
+    char line[64];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    c->in.clear();
+    c->state = next;
+    c->sent_ns = now_ns();
+    // a command is far smaller than the socket buffer, short means broken
+    if (write(c->fd, line, len) != len)
+        close_conn(w, c, true);
+}
+
+static void send_shift(worker* w, conn* c) {
+    int shift = c->kind == HOT ? c->shift_lo
+                               : std::uniform_int_distribution<int>(c->shift_lo, c->shift_hi)(w->rng);
+    send_line(w, c, WAIT_SHIFT, "%d\n", shift);
+}
+
+static void send_seat(worker* w, conn* c) {
+    if (c->misses >= MAX_MISSES) {
+        // the shift is (nearly) gone for this connection, start over
+        send_line(w, c, WAIT_EXIT, "exit\n");
+        return;
+    }
+    int last = c->kind == HOT ? std::min(hot_seats, c->seats) : c->seats;
+    std::uniform_int_distribution<int> pick(1, last);
+    int seat = pick(w->rng);
+    // asking for a seat paid on this connection is an invalid operation
+    for (int tries = 0; c->paid[seat] && tries < c->seats; tries++)
+        seat = seat % last + 1;
+    if (c->paid[seat]) {
+        send_line(w, c, WAIT_EXIT, "exit\n");
+        return;
+    }
+    c->seat = seat;
+    send_line(w, c, WAIT_SEAT, "%d\n", seat);
+}
+
+// A complete answer (it ends with a prompt) to the pending command
+static void on_answer(worker* w, conn* c) {
+    // transition timed, per conn_state up to WAIT_CONTINUE
+    static const transition timed[] = {T_BANNER, T_BANNER, T_SHIFT, T_SEAT, T_PAY, T_CONTINUE};
+    if (c->state <= WAIT_CONTINUE)
+        w->samples[timed[c->state]].push_back((now_ns() - c->sent_ns) / 1000);
+
+    const std::string& a = c->in;
+    switch (c->state) {
+    case WAIT_BANNER:
+        if (!parse_range(a, &c->shift_lo, &c->shift_hi)) {
+            close_conn(w, c, true);
+        } else if (c->kind == IDLE) {
+            c->state = WAIT_CLOSE;
+            c->in.clear();
+        } else {
+            send_shift(w, c);
+        }
+        break;
+    case WAIT_SHIFT:
+        if (c->kind == QUERY) {
+            send_shift(w, c);
+        } else if (ends_with(a, "or type \"pay\" to confirm: ")) {
+            int one;
+            if (!parse_range(a, &one, &c->seats)) {
+                close_conn(w, c, true);
+                break;
+            }
+            c->paid.assign(c->seats + 1, 0);
+            send_seat(w, c);
+        } else {
+            // fully booked, the shift prompt again
+            w->outcomes[O_FULL]++;
+            send_shift(w, c);
+        }
+        break;
+    case WAIT_SEAT:
+        if (!starts_with(a, ">>> ")) {
+            // no message: the seat is ours
+            c->misses = 0;
+            if (c->kind == HOT) {
+                w->outcomes[O_WON]++;
+                send_line(w, c, WAIT_SEAT, "%d\n", c->seat); // cancel it
+            } else {
+                w->outcomes[O_WON]++;
+                send_line(w, c, WAIT_PAY, "pay\n");
+            }
+            break;
+        }
+        if (starts_with(a, ">>> You cancel the seat.")) {
+            w->outcomes[O_CANCELLED]++;
+        } else {
+            w->outcomes[starts_with(a, ">>> Locked.") ? O_HELD : O_TAKEN]++;
+            c->misses++;
+        }
+        send_seat(w, c);
+        break;
+    case WAIT_PAY:
+        if (starts_with(a, ">>> Your train booking is successful.")) {
+            w->outcomes[O_PAID]++;
+            c->paid[c->seat] = 1;
+            send_line(w, c, WAIT_CONTINUE, "seat\n");
+        } else if (starts_with(a, ">>> Payment failed")) {
+            w->outcomes[O_PAY_FAILED]++;
+            send_line(w, c, WAIT_PAY, "pay\n");
+        } else {
+            send_seat(w, c);
+        }
+        break;
+    case WAIT_CONTINUE:
+        send_seat(w, c);
+        break;
+    default:
+        close_conn(w, c, true);
+        break;
+    }
+}
+
+// The server closed the connection
+static void on_close(worker* w, conn* c) {
+    long now = now_ns();
+    if (c->in.find(">>> Connection timeout.") != std::string::npos) {
+        w->outcomes[O_TIMEOUTS]++;
+        if (c->state == WAIT_CLOSE)
+            w->samples[T_TIMEOUT].push_back((now - c->connect_ns) / 1000);
+        else
+            w->outcomes[O_CUT]++;
+        close_conn(w, c, false);
+    } else if (c->state == WAIT_EXIT) {
+        close_conn(w, c, false);
+    } else {
+        // invalid operation or the server went away
+        w->outcomes[O_CUT]++;
+        close_conn(w, c, true);
+    }
+}
+
+static void on_event(worker* w, conn* c) {
+    if (c->state == CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            close_conn(w, c, true);
+            return;
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->state = WAIT_BANNER;
+        return;
+    }
+    char buf[4096];
+    for (;;) {
+        ssize_t r = read(c->fd, buf, sizeof(buf));
+        if (r > 0) {
+            c->in.append(buf, r);
+            continue;
+        }
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (r < 0 && errno == EINTR)
+            continue;
+        on_close(w, c);
+        return;
+    }
+    // every prompt ends with ": ", answers to one command come as one
+    if (ends_with(c->in, ": ") && c->state != WAIT_CLOSE)
+        on_answer(w, c);
+}
+
+static void run_worker(worker* w) {
+    for (conn& c : w->conns)
+        start_conn(w, &c);
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        long now = now_ns();
+        if (now >= end_ns)
+            break;
+        for (size_t i = 0; i < w->retry.size();) {
+            conn* c = w->retry[i];
+            if (c->retry_ns <= now) {
+                w->retry[i] = w->retry.back();
+                w->retry.pop_back();
+                start_conn(w, c);
+            } else {
+                i++;
+            }
+        }
+        long wait_ms = (end_ns - now) / 1000000 + 1;
+        int timeout = w->retry.empty() ? (int) std::min(wait_ms, 1000L) : (int) std::min(wait_ms, 10L);
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR)
+            ERR_EXIT("epoll_wait");
+        for (int i = 0; i < n; i++) {
+            conn* c = (conn*) events[i].data.ptr;
+            if (c->fd >= 0)
+                on_event(w, c);
+        }
+    }
+    for (conn& c : w->conns)
+        if (c.fd >= 0)
+            close(c.fd);
+}
+
+// -------------------------------------------------------------
+// Report
+
+struct summary {
+    size_t count;
+    double rate;                // per second
+    uint32_t p50, p90, p99, p999, max;
+};
+
+static uint32_t percentile(const std::vector<uint32_t>& sorted, double p) {
+    // nearest rank
+    size_t rank = (size_t) (p * sorted.size() + 0.999999);
+    return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+static summary summarize(std::vector<uint32_t>& v, double seconds) {
+    summary s = {v.size(), v.size() / seconds, 0, 0, 0, 0, 0};
+    if (v.empty())
+        return s;
+    std::sort(v.begin(), v.end());
+    s.p50 = percentile(v, 0.50);
+    s.p90 = percentile(v, 0.90);
+    s.p99 = percentile(v, 0.99);
+    s.p999 = percentile(v, 0.999);
+    s.max = v.back();
+    return s;
+}
+
+static void write_json(FILE* f, int conns, int threads, double seconds, const int* mix,
+                       const summary* sums, size_t answers, const long* outcomes) {
+    fprintf(f, "{\n  \"connections\": %d,\n  \"threads\": %d,\n  \"seconds\": %.3f,\n  \"mix\": {", conns, threads, seconds);
+    for (int k = 0; k < NUM_SCENARIOS; k++)
+        fprintf(f, "%s\"%s\": %d", k ? ", " : "", scenario_names[k], mix[k]);
+    fprintf(f, "},\n  \"answers\": %zu,\n  \"answers_per_s\": %.1f,\n  \"transitions\": {\n", answers, answers / seconds);
+    for (int t = 0; t < NUM_TRANSITIONS; t++) {
+        const summary& s = sums[t];
+        fprintf(f, "    \"%s\": {\"count\": %zu, \"per_s\": %.1f, \"p50_us\": %u, \"p90_us\": %u, "
+                "\"p99_us\": %u, \"p999_us\": %u, \"max_us\": %u}%s\n",
+                transition_names[t], s.count, s.rate, s.p50, s.p90, s.p99, s.p999, s.max,
+                t + 1 < NUM_TRANSITIONS ? "," : "");
+    }
+    fprintf(f, "  },\n  \"outcomes\": {");
+    for (int o = 0; o < NUM_OUTCOMES; o++)
+        fprintf(f, "%s\"%s\": %ld", o ? ", " : "", outcome_names[o], outcomes[o]);
+    fprintf(f, "}\n}\n");
+}
+
+// "query=70,book=20": share per scenario, the others 0
+static bool parse_mix(const char* arg, int* mix) {
+    std::fill(mix, mix + NUM_SCENARIOS, 0);
+    std::string s(arg);
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t comma = s.find(',', pos);
+        std::string item = s.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        size_t eq = item.find('=');
+        int k = 0;
+        while (k < NUM_SCENARIOS && item.compare(0, eq, scenario_names[k]) != 0)
+            k++;
+        if (eq == std::string::npos || k == NUM_SCENARIOS || (mix[k] = atoi(item.c_str() + eq + 1)) < 0)
+            return false;
+        if (comma == std::string::npos)
+            break;
+        pos = comma + 1;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int num_conns = 100, num_threads = 2;
+    double seconds = 10;
+    int mix[NUM_SCENARIOS] = {70, 20, 10, 0};
+    bool mix_given = false;
+    const char* address = "127.0.0.1";
+    const char* json_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:d:m:H:a:j:")) != -1) {
+        switch (opt) {
+        case 'c': num_conns = atoi(optarg); break;
+        case 't': num_threads = atoi(optarg); break;
+        case 'd': seconds = atof(optarg); break;
+        case 'm':
+            if (!parse_mix(optarg, mix)) {
+                fprintf(stderr, "bad mix \"%s\"\n", optarg);
+                exit(1);
+            }
+            mix_given = true;
+            break;
+        case 'H': hot_seats = atoi(optarg); break;
+        case 'a': address = optarg; break;
+        case 'j': json_path = optarg; break;
+        default:
+            fprintf(stderr, usage_msg, argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2 || num_conns <= 0 || num_threads <= 0 || seconds <= 0 || hot_seats <= 0) {
+        fprintf(stderr, usage_msg, argv[0]);
+        exit(1);
+    }
+    int read_port = atoi(argv[optind]);
+    int write_port = atoi(argv[optind + 1]);
+    ports[QUERY] = read_port;
+    ports[BOOK] = ports[HOT] = write_port;
+    ports[IDLE] = write_port ? write_port : read_port;
+    int total = 0;
+    for (int k = 0; k < NUM_SCENARIOS; k++) {
+        if (ports[k] == 0 && mix[k] > 0) {
+            if (mix_given) {
+                fprintf(stderr, "%s needs a %s port\n", scenario_names[k], k == QUERY ? "read" : "write");
+                exit(1);
+            }
+            mix[k] = 0;
+        }
+        total += mix[k];
+    }
+    if (total == 0) {
+        fprintf(stderr, "nothing to run: the mix is empty\n");
+        exit(1);
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, address, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "bad address %s\n", address);
+        exit(1);
+    }
+
+    // thousands of connections: as many fds as allowed
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<worker> workers(num_threads);
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (workers[i].epfd < 0)
+            ERR_EXIT("epoll_create1");
+        workers[i].rng.seed(i + 1);
+        memset(workers[i].outcomes, 0, sizeof(workers[i].outcomes));
+        workers[i].conns.resize(num_conns / num_threads + (i < num_conns % num_threads));
+    }
+    // connection i plays the scenario its place falls in, spread over threads
+    for (int i = 0; i < num_conns; i++) {
+        int k = 0;
+        for (int sum = mix[0]; k + 1 < NUM_SCENARIOS && (i + 0.5) * total >= (double) sum * num_conns; sum += mix[++k])
+            ;
+        workers[i % num_threads].conns[i / num_threads].kind = (scenario) k;
+    }
+
+    long start = now_ns();
+    end_ns = start + (long) (seconds * 1e9);
+    for (worker& w : workers)
+        w.thread = std::thread(run_worker, &w);
+    for (worker& w : workers)
+        w.thread.join();
+    double elapsed = (now_ns() - start) / 1e9;
+
+    summary sums[NUM_TRANSITIONS];
+    long outcomes[NUM_OUTCOMES] = {0};
+    size_t answers = 0;
+    for (int t = 0; t < NUM_TRANSITIONS; t++) {
+        std::vector<uint32_t> all;
+        for (worker& w : workers)
+            all.insert(all.end(), w.samples[t].begin(), w.samples[t].end());
+        sums[t] = summarize(all, elapsed);
+        if (t != T_TIMEOUT)
+            answers += sums[t].count;
+    }
+    for (worker& w : workers)
+        for (int o = 0; o < NUM_OUTCOMES; o++)
+            outcomes[o] += w.outcomes[o];
+
+    printf("%d connections (", num_conns);
+    for (int k = 0, first = 1; k < NUM_SCENARIOS; k++)
+        if (mix[k]) {
+            printf("%s%s %d%%", first ? "" : ", ", scenario_names[k], mix[k] * 100 / total);
+            first = 0;
+        }
+    printf("), %d threads, %.1f s: %zu answers, %.0f answers/s\n", num_threads, elapsed, answers, answers / elapsed);
+    printf("%-10s %10s %10s %10s %10s %10s %10s %10s\n", "transition", "count", "per s", "p50 us", "p90 us",
+           "p99 us", "p999 us", "max us");
+    for (int t = 0; t < NUM_TRANSITIONS; t++) {
+        const summary& s = sums[t];
+        if (s.count)
+            printf("%-10s %10zu %10.0f %10u %10u %10u %10u %10u\n", transition_names[t], s.count, s.rate,
+                   s.p50, s.p90, s.p99, s.p999, s.max);
+    }
+    printf("outcomes:");
+    for (int o = 0; o < NUM_OUTCOMES; o++)
+        printf(" %s %ld%s", outcome_names[o], outcomes[o], o + 1 < NUM_OUTCOMES ? "," : "\n");
+
+    if (json_path != NULL) {
+        FILE* f = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+        if (f == NULL)
+            ERR_EXIT(json_path);
+        write_json(f, num_conns, num_threads, elapsed, mix, sums, answers, outcomes);
+        if (f != stdout)
+            fclose(f);
+    }
+    return 0;
+}
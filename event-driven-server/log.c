@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "log.h"
+
+#define MASK (LOG_RING_SIZE - 1)
+_Static_assert((LOG_RING_SIZE & MASK) == 0, "LOG_RING_SIZE is a power of two");
+#define BATCH_IOV 64 // pieces per writev
+
+// head and tail count bytes since the start, the offset is & MASK. Each is
+// written by one side only, on its own cache line.
+typedef struct log_ring {
+    _Alignas(64) _Atomic size_t tail;   // producer: end of the lines logged
+    _Atomic unsigned long dropped;      // producer: lines that did not fit
+    _Alignas(64) _Atomic size_t head;   // writer: end of the lines written out
+    unsigned long dropped_seen;         // writer: drops reported so far
+    struct log_ring* next;
+    char data[LOG_RING_SIZE];
+} log_ring;
+
+int log_level = LOG_INFO;
+
+static const char* level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+static __thread log_ring* my_ring;
+static _Atomic(log_ring*) rings;        // every thread's, newest first
+static int log_fd = STDERR_FILENO;
+static atomic_bool running;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t writer;
+
+int log_level_parse(const char* name) {
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++)
+        if (strcasecmp(name, level_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+// The calling thread's ring, registered on its first line
+static log_ring* ring_of_thread(void) {
+    if (my_ring != NULL)
+        return my_ring;
+    log_ring* r = (log_ring*) aligned_alloc(_Alignof(log_ring), sizeof(log_ring));
+    if (r == NULL)
+        return NULL;
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->head, 0);
+    atomic_init(&r->dropped, 0);
+    r->dropped_seen = 0;
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+        ;
+    return my_ring = r;
+}
+
+void log_write(enum LOG_LEVEL level, const char* fmt, ...) {
+    char line[LOG_LINE_MAX];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    size_t len = snprintf(line, sizeof(line), "%ld.%06ld %-5s ", (long) ts.tv_sec, ts.tv_nsec / 1000, level_names[level]);
+    va_list ap;
+    va_start(ap, fmt);
+    len += vsnprintf(line + len, sizeof(line) - len, fmt, ap);
+    va_end(ap);
+    if (len > sizeof(line) - 1)
+        len = sizeof(line) - 1; // cut
+    if (line[len - 1] != '\n') {
+        if (len == sizeof(line) - 1)
+            len--;
+        line[len++] = '\n';
+    }
+
+    log_ring* r;
+    if (!atomic_load_explicit(&running, memory_order_acquire) || (r = ring_of_thread()) == NULL) {
+        if (write(STDERR_FILENO, line, len) < 0) {} // nothing better to do
+        return;
+    }
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (LOG_RING_SIZE - (tail - head) < len) {
+        atomic_store_explicit(&r->dropped, atomic_load_explicit(&r->dropped, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        return;
+    }
+    size_t at = tail & MASK;
+    size_t first = LOG_RING_SIZE - at < len ? LOG_RING_SIZE - at : len;
+    memcpy(r->data + at, line, first);
+    memcpy(r->data, line + first, len - first);
+    atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+}
+
+// Writes every piece, retrying short writes
+static void write_all(struct iovec* iov, int n) {
+    while (n > 0) {
+        ssize_t sent = writev(log_fd, iov, n);
+        if (sent < 0)
+            return; // no log then, nowhere to say so
+        while (n > 0 && (size_t) sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*) iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+}
+
+// One batch: what every ring holds now, in as few writev as it takes.
+// Call with drain_lock held.
+static void drain(void) {
+    struct iovec iov[BATCH_IOV];
+    log_ring* done[BATCH_IOV];
+    size_t ends[BATCH_IOV];
+    char notes[BATCH_IOV][64];
+    int n = 0, rings_in = 0, num_notes = 0;
+    for (log_ring* r = atomic_load(&rings); r != NULL; r = r->next) {
+        if (n + 3 > BATCH_IOV) {
+            write_all(iov, n);
+            for (int i = 0; i < rings_in; i++)
+                atomic_store_explicit(&done[i]->head, ends[i], memory_order_release);
+            n = rings_in = num_notes = 0;
+        }
+        unsigned long dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        if (dropped != r->dropped_seen) {
+            iov[n].iov_base = notes[num_notes];
+            iov[n++].iov_len = snprintf(notes[num_notes++], sizeof(notes[0]), "log: %lu line(s) dropped\n",
+                                        dropped - r->dropped_seen);
+            r->dropped_seen = dropped;
+        }
+        size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (tail == head)
+            continue;
+        // at most two pieces: up to the end of data, then from 0
+        size_t at = head & MASK, len = tail - head;
+        size_t first = LOG_RING_SIZE - at < len ? LOG_RING_SIZE - at : len;
+        iov[n].iov_base = r->data + at;
+        iov[n++].iov_len = first;
+        if (len > first) {
+            iov[n].iov_base = r->data;
+            iov[n++].iov_len = len - first;
+        }
+        done[rings_in] = r;
+        ends[rings_in++] = tail;
+    }
+    write_all(iov, n);
+    for (int i = 0; i < rings_in; i++)
+        atomic_store_explicit(&done[i]->head, ends[i], memory_order_release);
+}
+
+static void* writer_main(void* arg) {
+    (void) arg;
+    struct timespec period = { 0, LOG_FLUSH_MS * 1000000L };
+    for (;;) {
+        nanosleep(&period, NULL);
+        log_flush(true);
+    }
+    return NULL;
+}
+
+void log_flush(bool wait) {
+    if (wait ? pthread_mutex_lock(&drain_lock) != 0 : pthread_mutex_trylock(&drain_lock) != 0)
+        return;
+    drain();
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void flush_at_exit(void) {
+    log_flush(true);
+}
+
+int log_init(const char* path) {
+    if (path != NULL && (log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+        log_fd = STDERR_FILENO;
+        return -1;
+    }
+    // signal handlers run on the server's threads, never on the writer
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&writer, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0)
+        return -1;
+    atexit(flush_at_exit);
+    atomic_store_explicit(&running, true, memory_order_release);
+    return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdbool.h>
+
+// Leveled log. The thread logging formats the line into a ring of its own
+// (one producer, one consumer, no lock, no system call), and a background
+// thread writes every ring out to the log file in batches, so the event
+// loop never waits for the log. A line that does not fit its ring is
+// dropped, and the drop reported with the next batch.
+//
+// Levels below LOG_COMPILED_LEVEL are compiled out
+// (make CFLAGS="-Wall -g -D LOG_COMPILED_LEVEL=LOG_INFO"), the others are
+// filtered at run time by log_level.
+
+enum LOG_LEVEL { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_RING_SIZE (64 * 1024) // bytes per thread, power of two
+#define LOG_FLUSH_MS 20 // how often the rings are written out
+#define LOG_LINE_MAX 512 // longer lines are cut
+
+// Lines below it are not logged, set before the threads start
+extern int log_level;
+
+// Starts the background writer, appending to path (NULL: stderr).
+// 0 on success, -1 on error. Until then lines go to stderr directly.
+int log_init(const char* path);
+// Writes out what was logged so far. Without wait it gives up (signal
+// handler) if the writer is busy with a batch.
+void log_flush(bool wait);
+// "debug", "info", "warn" or "error", -1 for anything else
+int log_level_parse(const char* name);
+
+void log_write(enum LOG_LEVEL level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define LOG(level, ...) do { \
+    if ((level) >= LOG_COMPILED_LEVEL && (level) >= log_level) \
+        log_write((level), __VA_ARGS__); \
+} while (0)
+
+#define log_debug(...) LOG(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) LOG(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) LOG(LOG_WARN, __VA_ARGS__)
+#define log_error(...) LOG(LOG_ERROR, __VA_ARGS__)
+
+#endif
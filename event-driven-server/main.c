@@ -1,17 +1,83 @@
 #include <stdio.h>
+#include <getopt.h>
 #include "server.h"
+#include "log.h"
+#include "handoff.h"
+
+// read_server and write_server serve one role on one port (-D READ_SERVER /
+// -D WRITE_SERVER), train_server serves both from the same reactors.
+// -s <port> serves the metrics on a stats port as well, -l <level> logs
+// from that level on (info by default), -L <file> logs to a file.
+#ifdef READ_SERVER
+#define PORTS 1
+#define USAGE "[port] [threads]"
+#elif defined WRITE_SERVER
+#define PORTS 1
+#define USAGE "[port] [threads]"
+#else
+#define PORTS 2
+#define USAGE "[read_port] [write_port] [threads]"
+#endif
+#define OPTIONS "[-s stats_port] [-l debug|info|warn|error] [-L log_file] "
 
 int main(int argc, char** argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s [port]\n", argv[0]);
+    unsigned short stats_port = 0;
+    const char* log_path = NULL;
+    int opt;
+    // kept as given for a restart (SIGUSR2), getopt reorders argv
+    if (handoff_init(argc, argv) < 0)
+        ERR_EXIT("handoff_init");
+    while ((opt = getopt(argc, argv, "s:l:L:")) != -1) {
+        if (opt == 's') {
+            stats_port = (unsigned short) atoi(optarg);
+        } else if (opt == 'l' && log_level_parse(optarg) >= 0) {
+            log_level = log_level_parse(optarg);
+        } else if (opt == 'L') {
+            log_path = optarg;
+        } else {
+            fprintf(stderr, "usage: %s " OPTIONS USAGE "\n", argv[0]);
+            exit(1);
+        }
+    }
+    // the ports and threads, as if there were no options
+    char* prog = argv[0];
+    argc -= optind - 1;
+    argv += optind - 1;
+    argv[0] = prog;
+    if (argc != PORTS + 1 && argc != PORTS + 2) {
+        fprintf(stderr, "usage: %s " OPTIONS USAGE "\n", argv[0]);
+        exit(1);
+    }
+    int threads = argc == PORTS + 2 ? atoi(argv[PORTS + 1]) : 1;
+    if (threads < 1) {
+        fprintf(stderr, "threads should be at least 1\n");
         exit(1);
     }
+#ifdef READ_SERVER
+    unsigned short read_port = (unsigned short) atoi(argv[1]), write_port = 0;
+#elif defined WRITE_SERVER
+    unsigned short read_port = 0, write_port = (unsigned short) atoi(argv[1]);
+#else
+    unsigned short read_port = (unsigned short) atoi(argv[1]), write_port = (unsigned short) atoi(argv[2]);
+#endif
 
-    init_db();
-    init_server((unsigned short) atoi(argv[1]));
-    fprintf(stderr, "\n[pid: %d] starting on %.80s, port %d, fd %d, maxfd %d...\n", getpid(), svr.hostname, svr.port, svr.listen_fd, maxfd);
+    if (log_init(log_path) < 0)
+        ERR_EXIT(log_path ? log_path : "log_init");
+    // started by a restart: the old process's sockets before the journal
+    int handed = handoff_receive();
+    if (handed < 0)
+        ERR_EXIT("handoff_receive");
+    if (handed > 0)
+        log_info("[pid: %d] taking over from pid %d\n", getpid(), getppid());
+    init_db(write_port != 0);
+    init_server(read_port, write_port, stats_port, threads);
+    log_info("[pid: %d] starting on %.80s, port %d, fd %d, maxfd %d...\n", getpid(), svr.hostname, svr.port, svr.listen_fd, maxfd);
+    if (read_port && write_port)
+        log_info("queries on port %d, bookings on port %d\n", read_port, write_port);
+    if (stats_port)
+        log_info("metrics on port %d\n", stats_port);
 
     run_server(); // Start the event loop
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+
+__thread metrics_shard* metrics_self;
+static metrics_shard* shards;
+static int num_shards;
+
+static const char* hist_states[NUM_HISTS] = {"shift", "seat", "payment", "commit"};
+
+int metrics_init(int n) {
+    shards = (metrics_shard*) aligned_alloc(_Alignof(metrics_shard), sizeof(metrics_shard) * n);
+    if (shards == NULL)
+        return -1;
+    memset(shards, 0, sizeof(metrics_shard) * n);
+    num_shards = n;
+    return 0;
+}
+
+void metrics_attach(int shard) {
+    metrics_self = &shards[shard];
+}
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_observe(enum metric_hist h, uint64_t ns) {
+    // bucket i holds (2^(i-1), 2^i] us
+    uint64_t us = (ns + 999) / 1000;
+    int i = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (i > HIST_BUCKETS - 1)
+        i = HIST_BUCKETS - 1;
+    metrics_add_to(&metrics_self->buckets[h][i], 1);
+    metrics_add_to(&metrics_self->sum_ns[h], ns);
+}
+
+static uint64_t counter(enum metric_counter c) {
+    uint64_t n = 0;
+    for (int i = 0; i < num_shards; i++)
+        n += atomic_load_explicit(&shards[i].counters[c], memory_order_relaxed);
+    return n;
+}
+
+static int append(outq* q, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static int append(outq* q, const char* fmt, ...) {
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    return outq_append(q, line, len);
+}
+
+static int family(outq* q, const char* name, const char* type, const char* help) {
+    return append(q, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+int metrics_write(outq* q) {
+    static const struct {
+        const char* name;
+        const char* help;
+        enum metric_counter c;
+    } plain[] = {
+        {"train_connections_closed_total", "Connections closed.", M_CLOSED},
+        {"train_connections_timed_out_total", "Connections closed at their deadline.", M_TIMED_OUT},
+        {"train_invalid_operations_total", "Connections closed on an invalid operation.", M_INVALID},
+        {"train_seats_paid_total", "Seats booked and paid.", M_SEATS_PAID},
+        {"train_journal_commits_total", "Journal group commits.", M_COMMITS},
+        {"train_journal_commit_failures_total", "Journal commits that failed, their payments were refused.", M_COMMIT_FAILED},
+    };
+    int err = 0;
+    uint64_t accepted[3];
+    for (int r = 0; r < 3; r++)
+        accepted[r] = counter(M_ACCEPTED_READER + r);
+    err |= family(q, "train_connections_accepted_total", "counter", "Connections accepted, per port.");
+    err |= append(q, "train_connections_accepted_total{role=\"reader\"} %lu\n", accepted[0]);
+    err |= append(q, "train_connections_accepted_total{role=\"writer\"} %lu\n", accepted[1]);
+    err |= append(q, "train_connections_accepted_total{role=\"stats\"} %lu\n", accepted[2]);
+    err |= family(q, "train_connections_shed_total", "counter", "Connections turned away busy.");
+    err |= append(q, "train_connections_shed_total{reason=\"full\"} %lu\n", counter(M_SHED_FULL));
+    err |= append(q, "train_connections_shed_total{reason=\"rate\"} %lu\n", counter(M_SHED_RATE));
+    err |= family(q, "train_connections_open", "gauge", "Connections open, this one included.");
+    err |= append(q, "train_connections_open %lu\n", accepted[0] + accepted[1] + accepted[2] - counter(M_CLOSED));
+    for (size_t i = 0; i < sizeof(plain) / sizeof(plain[0]); i++) {
+        err |= family(q, plain[i].name, "counter", plain[i].help);
+        err |= append(q, "%s %lu\n", plain[i].name, counter(plain[i].c));
+    }
+    err |= family(q, "train_seat_conflicts_total", "counter", "Seats asked for that another client locked or booked.");
+    err |= append(q, "train_seat_conflicts_total{reason=\"locked\"} %lu\n", counter(M_SEAT_LOCKED));
+    err |= append(q, "train_seat_conflicts_total{reason=\"booked\"} %lu\n", counter(M_SEAT_BOOKED));
+    err |= append(q, "train_seat_conflicts_total{reason=\"group\"} %lu\n", counter(M_SEATS_TAKEN));
+
+    // per state: the commands are the observations of its histogram
+    uint64_t buckets[NUM_HISTS][HIST_BUCKETS] = {{0}}, sum_ns[NUM_HISTS] = {0}, count[NUM_HISTS] = {0};
+    for (int i = 0; i < num_shards; i++) {
+        for (int h = 0; h < NUM_HISTS; h++) {
+            for (int b = 0; b < HIST_BUCKETS; b++)
+                buckets[h][b] += atomic_load_explicit(&shards[i].buckets[h][b], memory_order_relaxed);
+            sum_ns[h] += atomic_load_explicit(&shards[i].sum_ns[h], memory_order_relaxed);
+        }
+    }
+    for (int h = 0; h < NUM_HISTS; h++)
+        for (int b = 0; b < HIST_BUCKETS; b++)
+            count[h] += buckets[h][b];
+    err |= family(q, "train_commands_total", "counter", "Commands handled, per state they came in.");
+    for (int h = 0; h < NUM_HISTS; h++)
+        err |= append(q, "train_commands_total{state=\"%s\"} %lu\n", hist_states[h], count[h]);
+    err |= family(q, "train_request_duration_seconds", "histogram", "From a command to its answer, per state it came in.");
+    for (int h = 0; h < NUM_HISTS; h++) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b < HIST_BUCKETS - 1; b++) {
+            cumulative += buckets[h][b];
+            err |= append(q, "train_request_duration_seconds_bucket{state=\"%s\",le=\"%g\"} %lu\n",
+                          hist_states[h], (double) (1UL << b) / 1e6, cumulative);
+        }
+        err |= append(q, "train_request_duration_seconds_bucket{state=\"%s\",le=\"+Inf\"} %lu\n", hist_states[h], count[h]);
+        err |= append(q, "train_request_duration_seconds_sum{state=\"%s\"} %.9f\n", hist_states[h], sum_ns[h] / 1e9);
+        err |= append(q, "train_request_duration_seconds_count{state=\"%s\"} %lu\n", hist_states[h], count[h]);
+    }
+    return err ? -1 : 0;
+}
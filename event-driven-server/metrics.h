@@ -0,0 +1,74 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "outq.h"
+
+// Counters and latency histograms of the server. Every reactor thread
+// writes its own shard (one writer: a relaxed load and store, no locked
+// instruction), metrics_write sums the shards as they are and renders them
+// in the Prometheus text format for the stats port.
+
+enum metric_counter {
+    M_ACCEPTED_READER,          // accepted per role, M_ACCEPTED_READER + role
+    M_ACCEPTED_WRITER,
+    M_ACCEPTED_STATS,
+    M_CLOSED,
+    M_SHED_FULL,                // turned away: MAX_CONNS open, or out of fds
+    M_SHED_RATE,                // turned away: the address opens them too fast
+    M_TIMED_OUT,
+    M_INVALID,                  // invalid operations
+    M_SEAT_LOCKED,              // ">>> Locked."
+    M_SEAT_BOOKED,              // ">>> The seat is booked."
+    M_SEATS_TAKEN,              // "seats ..." refused, some of them taken
+    M_SEATS_PAID,
+    M_COMMITS,                  // journal group commits
+    M_COMMIT_FAILED,
+    NUM_COUNTERS
+};
+
+// Latency of a command, from its line to its answer, per state it came in
+enum metric_hist {
+    H_SHIFT,
+    H_SEAT,
+    H_PAYMENT,
+    H_COMMIT,                   // "pay", the answer waits for the journal
+    NUM_HISTS
+};
+
+// Buckets: up to 1 us, 2 us, 4 us ... 2^20 us (about 1 s), then +Inf
+#define HIST_BUCKETS 22
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t counters[NUM_COUNTERS];
+    _Atomic uint64_t buckets[NUM_HISTS][HIST_BUCKETS];
+    _Atomic uint64_t sum_ns[NUM_HISTS];
+} metrics_shard;
+
+extern __thread metrics_shard* metrics_self;
+
+// One shard per thread that counts, 0 on success, -1 out of memory
+int metrics_init(int shards);
+// The calling thread counts into shard
+void metrics_attach(int shard);
+
+static inline void metrics_add_to(_Atomic uint64_t* p, uint64_t n) {
+    atomic_store_explicit(p, atomic_load_explicit(p, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metrics_inc(enum metric_counter c) {
+    metrics_add_to(&metrics_self->counters[c], 1);
+}
+
+static inline void metrics_add(enum metric_counter c, uint64_t n) {
+    metrics_add_to(&metrics_self->counters[c], n);
+}
+
+uint64_t metrics_now_ns(void); // CLOCK_MONOTONIC
+void metrics_observe(enum metric_hist h, uint64_t ns);
+
+// Appends every metric to q, 0 on success, -1 out of memory
+int metrics_write(outq* q);
+
+#endif
@@ -0,0 +1,95 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "outq.h"
+
+
+void outq_init(outq* q) {
+    q->head = q->tail = NULL;
+    q->len = 0;
+}
+
+void outq_free(outq* q) {
+    outq_chunk* c = q->head;
+    while (c != NULL) {
+        outq_chunk* next = c->next;
+        free(c);
+        c = next;
+    }
+    outq_init(q);
+}
+
+int outq_append(outq* q, const char* data, size_t len) {
+    while (len > 0) {
+        outq_chunk* c = q->tail;
+        if (c == NULL || c->end == OUTQ_CHUNK) {
+            c = (outq_chunk*) malloc(sizeof(outq_chunk));
+            if (c == NULL)
+                return -1;
+            c->next = NULL;
+            c->start = c->end = 0;
+            if (q->tail == NULL)
+                q->head = c;
+            else
+                q->tail->next = c;
+            q->tail = c;
+        }
+        size_t n = OUTQ_CHUNK - c->end;
+        if (n > len)
+            n = len;
+        memcpy(c->data + c->end, data, n);
+        c->end += n;
+        q->len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int outq_puts(outq* q, const char* s) {
+    return outq_append(q, s, strlen(s));
+}
+
+int outq_iov(const outq* q, struct iovec* iov, int max) {
+    int n = 0;
+    for (outq_chunk* c = q->head; c != NULL && n < max && c->end > c->start; c = c->next) {
+        iov[n].iov_base = c->data + c->start;
+        iov[n].iov_len = c->end - c->start;
+        n++;
+    }
+    return n;
+}
+
+void outq_consume(outq* q, size_t sent) {
+    q->len -= sent;
+    // drop the chunks sent, keep the last one for reuse
+    while (sent > 0) {
+        outq_chunk* c = q->head;
+        size_t left = c->end - c->start;
+        if (sent < left) {
+            c->start += sent;
+            break;
+        }
+        sent -= left;
+        c->start = c->end = 0;
+        if (c->next != NULL) {
+            q->head = c->next;
+            free(c);
+        }
+    }
+}
+
+int outq_flush(outq* q, int fd) {
+    while (q->len > 0) {
+        struct iovec iov[OUTQ_IOV];
+        ssize_t sent = writev(fd, iov, outq_iov(q, iov, OUTQ_IOV));
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        outq_consume(q, sent);
+    }
+    return 0;
+}
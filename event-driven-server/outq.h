@@ -0,0 +1,47 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Output queued for a non-blocking socket: a chain of fixed-size chunks
+// that outq_flush hands to writev, so a response made of several pieces
+// (message, booking info, prompt) leaves in one system call, and whatever
+// the socket does not take now stays queued for the next EV_WRITE.
+// A drained queue keeps its first chunk, so a steady client does not
+// allocate.
+
+#define OUTQ_CHUNK 1024
+#define OUTQ_IOV 16 // chunks per writev
+
+typedef struct outq_chunk {
+    struct outq_chunk* next;
+    size_t start;           // first byte not sent yet
+    size_t end;             // end of the bytes queued
+    char data[OUTQ_CHUNK];
+} outq_chunk;
+
+typedef struct {
+    outq_chunk* head;
+    outq_chunk* tail;
+    size_t len;             // bytes queued
+} outq;
+
+void outq_init(outq* q);
+void outq_free(outq* q);
+
+// 0 on success, -1 out of memory
+int outq_append(outq* q, const char* data, size_t len);
+int outq_puts(outq* q, const char* s);
+
+// Writes as much as the socket takes
+// Return 0 when drained, 1 if bytes are left (EAGAIN), -1 on error
+int outq_flush(outq* q, int fd);
+
+// For sends outq_flush does not make (io_uring): the first chunks queued,
+// at most max, then drop sent bytes once they are gone. Chunks stay put
+// until consumed, appending does not move them.
+int outq_iov(const outq* q, struct iovec* iov, int max);
+void outq_consume(outq* q, size_t sent);
+
+#endif
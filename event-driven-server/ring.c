@@ -0,0 +1,88 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "ring.h"
+
+#define MASK (RING_SIZE - 1)
+_Static_assert((RING_SIZE & MASK) == 0, "RING_SIZE is a power of two");
+
+void ring_init(ring* r) {
+    r->head = 0;
+    r->len = 0;
+}
+
+ssize_t ring_read(ring* r, int fd) {
+    // the free space is at most two pieces: up to the end, then from 0
+    struct iovec iov[2];
+    size_t tail = (r->head + r->len) & MASK;
+    size_t space = RING_SIZE - r->len;
+    size_t first = RING_SIZE - tail < space ? RING_SIZE - tail : space;
+    iov[0].iov_base = r->data + tail;
+    iov[0].iov_len = first;
+    iov[1].iov_base = r->data;
+    iov[1].iov_len = space - first;
+    ssize_t n = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+    if (n > 0)
+        r->len += n;
+    return n;
+}
+
+size_t ring_put(ring* r, const char* data, size_t len) {
+    if (len > RING_SIZE - r->len)
+        len = RING_SIZE - r->len;
+    size_t tail = (r->head + r->len) & MASK;
+    size_t first = RING_SIZE - tail < len ? RING_SIZE - tail : len;
+    memcpy(r->data + tail, data, first);
+    memcpy(r->data, data + first, len - first);
+    r->len += len;
+    return len;
+}
+
+size_t ring_copy(const ring* r, char* out) {
+    size_t first = RING_SIZE - r->head < r->len ? RING_SIZE - r->head : r->len;
+    memcpy(out, r->data + r->head, first);
+    memcpy(out + first, r->data, r->len - first);
+    return r->len;
+}
+
+bool ring_starts_with(const ring* r, const char* prefix, size_t len) {
+    if (r->len < len)
+        return false;
+    for (size_t i = 0; i < len; i++)
+        if (r->data[(r->head + i) & MASK] != prefix[i])
+            return false;
+    return true;
+}
+
+// Offset of the first '\n' from head, -1 if none
+static long find_newline(const ring* r) {
+    size_t first = RING_SIZE - r->head < r->len ? RING_SIZE - r->head : r->len;
+    const char* p = memchr(r->data + r->head, '\n', first);
+    if (p != NULL)
+        return p - (r->data + r->head);
+    p = memchr(r->data, '\n', r->len - first);
+    if (p != NULL)
+        return first + (p - r->data);
+    return -1;
+}
+
+int ring_getline(ring* r, char* line, size_t size) {
+    long nl = find_newline(r);
+    if (nl < 0)
+        return -1;
+    size_t len = nl;
+    size_t consumed = len + 1;
+    if (len > 0 && r->data[(r->head + len - 1) & MASK] == '\r')
+        len--;
+    int ret = -2;
+    if (len < size) {
+        size_t first = RING_SIZE - r->head < len ? RING_SIZE - r->head : len;
+        memcpy(line, r->data + r->head, first);
+        memcpy(line + first, r->data, len - first);
+        line[len] = '\0';
+        ret = (int) len;
+    }
+    r->head = (r->head + consumed) & MASK;
+    r->len -= consumed;
+    return ret;
+}
@@ -0,0 +1,38 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Input of a connection: bytes read but not consumed yet, in a fixed ring.
+// Partial lines stay until the rest arrives, and every complete line of a
+// read can be taken out before going back to the event loop.
+
+#define RING_SIZE 1024 // power of two, longest line the ring can hold - 1
+
+typedef struct {
+    size_t head;            // first byte not consumed, in [0, RING_SIZE)
+    size_t len;             // bytes held
+    char data[RING_SIZE];
+} ring;
+
+void ring_init(ring* r);
+static inline bool ring_full(const ring* r) { return r->len == RING_SIZE; }
+static inline size_t ring_space(const ring* r) { return RING_SIZE - r->len; }
+
+// One read(2) into the free space, returns what read returned
+ssize_t ring_read(ring* r, int fd);
+// Copies in what fits of data, returns the bytes taken
+size_t ring_put(ring* r, const char* data, size_t len);
+// Copies the bytes held to out (RING_SIZE bytes), returns their number
+size_t ring_copy(const ring* r, char* out);
+// Whether the bytes held start with prefix
+bool ring_starts_with(const ring* r, const char* prefix, size_t len);
+
+// Takes out the first complete line, without its "\n" or "\r\n", as a C
+// string. Return its length, -1 if no line is complete, -2 if it does not
+// fit in size (the line is dropped).
+int ring_getline(ring* r, char* line, size_t size);
+
+#endif
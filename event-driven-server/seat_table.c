@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "seat_table.h"
+#include "business_logic.h"
+#include "timer.h"
+#include "bitset.h"
+#include "log.h"
+
+// The shared segment, sized by the catalog:
+//     lock words      one per seat, train t from trains[t].lock_base
+//     leases          one per seat, next to the lock words: owner id << 32 |
+//                     lease expiry. Written after the lock word is taken,
+//                     so a lease whose id is not the word's is not out yet
+//                     and the lock counts as live.
+//     locked bits     one per seat, telling which words are in use so that a
+//                     train's locks are found a word at a time; train t from
+//                     trains[t].bits_base. A hint kept in step with the
+//                     word, the word decides.
+//     versions        one per train, bumped after every change of its words
+//     owner ids       one counter, handing out the low half of lock words
+static _Atomic uint64_t* lock_words;
+static _Atomic uint64_t* leases;
+static _Atomic uint64_t* lock_bits;
+static _Atomic uint64_t* versions;
+static _Atomic uint32_t* owner_ids;
+static size_t segment_size;
+
+static char* _Atomic* seat_map;     // mapped train files, NULL until used
+static bool map_writable;
+static uint32_t self_pid;
+
+// "d d d d\n": 8 bytes of a train file hold 4 seats, a train whose seats
+// are not a multiple of 4 ends with a shorter line
+#define LINE_PATTERN 0x0A30203020302030ULL  // "0 0 0 0\n" read as a little endian word
+#define DIGIT_BITS 0x0001000100010001ULL    // low bit of the 4 digits ('0' / '1')
+#define GATHER 0x0001000200040008ULL        // moves those 4 bits to bits 48..51
+
+// spread[n]: bit i of n moved to the low bit of byte 2i (a digit position)
+static uint64_t spread[16];
+
+// Owner id of a lock word while its seat is being written as booked, never
+// handed out. Its lease is nobody's, so lockers wait unless the process died.
+#define BOOKING_ID UINT32_MAX
+
+static inline _Atomic uint64_t* lock_of(int train, int seat) {
+    return &lock_words[trains[train].lock_base + seat - 1];
+}
+
+static inline _Atomic uint64_t* lease_of(int train, int seat) {
+    return &leases[trains[train].lock_base + seat - 1];
+}
+
+static inline _Atomic uint64_t* lock_bits_of(int train, int seat) {
+    return &lock_bits[trains[train].bits_base + (seat - 1) / 64];
+}
+
+static inline int words_of(int train) {
+    return BITSET_WORDS(trains[train].seats);
+}
+
+static inline uint64_t lock_bit(int seat) {
+    return (uint64_t) 1 << ((seat - 1) % 64);
+}
+
+static inline bool booked(int train, int seat) {
+    return ((volatile char*) seat_map[train])[(seat-1) * 2] == '1';
+}
+
+// Lease expiry compared on 32 bits (wraps after ~49 days)
+static inline bool lease_expired(uint32_t until, uint32_t now) {
+    return (int32_t) (until - now) <= 0;
+}
+
+// Lease of the lock held with word, false if its owner has not written it yet
+static inline bool lock_lease(int train, int seat, uint64_t word, uint32_t* until) {
+    uint64_t lease = atomic_load_explicit(lease_of(train, seat), memory_order_acquire);
+    if ((uint32_t) (lease >> 32) != (uint32_t) word)
+        return false;
+    *until = (uint32_t) lease;
+    return true;
+}
+
+static inline bool lock_expired(int train, int seat, uint64_t word, uint32_t now) {
+    uint32_t until;
+    return lock_lease(train, seat, word, &until) && lease_expired(until, now);
+}
+
+static inline void bump_version(int train) {
+    atomic_fetch_add_explicit(&versions[train], 1, memory_order_release);
+}
+
+static bool owner_gone(uint64_t word) {
+    pid_t pid = (pid_t) (word >> 32);
+    return kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+int seat_table_init(bool writable) {
+    seat_map = (char* _Atomic*) calloc(num_trains, sizeof(*seat_map));
+    if (seat_map == NULL)
+        return -1;
+    map_writable = writable;
+
+    // Lock words, one segment per train directory, catalog and layout
+    struct stat st;
+    char name[NAME_MAX];
+    if (stat(TRAIN_DIR, &st) < 0)
+        return -1;
+    snprintf(name, sizeof(name), "/csie_trains.%lu.%lu.%08x.2", (unsigned long) st.st_dev, (unsigned long) st.st_ino,
+             catalog_hash());
+    const train_info* last = &trains[num_trains - 1];
+    size_t n_words = last->lock_base + last->seats;
+    size_t n_bits = last->bits_base + BITSET_WORDS(last->seats);
+    segment_size = sizeof(uint64_t) * (2 * n_words + n_bits + num_trains + 1);
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return -1;
+    // zero filled when created, every process sets the same size
+    if (ftruncate(fd, segment_size) < 0) {
+        close(fd);
+        return -1;
+    }
+    void* segment = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED)
+        return -1;
+    lock_words = (_Atomic uint64_t*) segment;
+    leases = lock_words + n_words;
+    lock_bits = leases + n_words;
+    versions = lock_bits + n_bits;
+    owner_ids = (_Atomic uint32_t*) (versions + num_trains);
+    self_pid = (uint32_t) getpid();
+
+    for (int n = 0; n < 16; n++) {
+        spread[n] = 0;
+        for (int i = 0; i < 4; i++)
+            if (n & (1 << i))
+                spread[n] |= (uint64_t) 1 << (16 * i);
+    }
+    return 0;
+}
+
+int seat_table_open(int train) {
+    if (atomic_load_explicit(&seat_map[train], memory_order_acquire) != NULL)
+        return 0;
+    char path[PATH_MAX];
+    struct stat st;
+    int seats = trains[train].seats;
+    snprintf(path, sizeof(path), "%s/train_%d", TRAIN_DIR, trains[train].shift_id);
+    int fd = open(path, map_writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < seats * 2) {
+        log_error("%s is shorter than %d seats\n", path, seats);
+        close(fd);
+        return -1;
+    }
+    // the mapping does not need the fd
+    char* map = (char*) mmap(NULL, seats * 2, map_writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                             MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    char* expected = NULL;
+    if (!atomic_compare_exchange_strong(&seat_map[train], &expected, map))
+        munmap(map, seats * 2); // another thread was first
+    return 0;
+}
+
+// Bits of the train file, 4 seats per 8-byte load (x86 is little endian)
+void seat_booked_bits(int train, uint64_t* booked) {
+    const char* map = seat_map[train];
+    int seats = trains[train].seats;
+    memset(booked, 0, sizeof(uint64_t) * SEAT_WORDS);
+    int g = 0;
+    for (; g < seats / 4; g++) {
+        uint64_t line;
+        memcpy(&line, map + g * 8, 8);
+        uint64_t nibble = ((line & DIGIT_BITS) * GATHER) >> 48 & 0xF;
+        booked[g / 16] |= nibble << (4 * (g % 16));
+    }
+    for (int i = g * 4; i < seats; i++)
+        if (map[i * 2] == '1')
+            bit_set(booked, i);
+}
+
+// Seats whose lock is held and its lease still running, *expires is set to
+// the earliest of their leases (0 if none)
+static void live_locks(int train, uint64_t* locked, uint32_t* expires) {
+    uint32_t now = 0, until;
+    *expires = 0;
+    memset(locked, 0, sizeof(uint64_t) * SEAT_WORDS);
+    for (int w = 0; w < words_of(train); w++) {
+        uint64_t bits = atomic_load_explicit(&lock_bits[trains[train].bits_base + w], memory_order_acquire);
+        locked[w] = bits;
+        // only locked seats cost a look at their word (and one clock read)
+        while (bits) {
+            int seat = w * 64 + __builtin_ctzll(bits) + 1;
+            bits &= bits - 1;
+            uint64_t word = atomic_load_explicit(lock_of(train, seat), memory_order_acquire);
+            if (word != 0 && now == 0)
+                now = (uint32_t) monotonic_ms();
+            if (word == 0)
+                locked[w] &= ~lock_bit(seat);
+            else if (!lock_lease(train, seat, word, &until))
+                continue; // just taken, the version moves once its lease is out
+            else if (lease_expired(until, now))
+                locked[w] &= ~lock_bit(seat);
+            else if (*expires == 0 || lease_expired(until, *expires))
+                *expires = until;
+        }
+    }
+}
+
+void seat_locked_bits(int train, uint64_t* locked) {
+    uint32_t expires;
+    live_locks(train, locked, &expires);
+}
+
+void seat_render(int train, char* buf, seat_snapshot* snap) {
+    uint64_t booked[SEAT_WORDS], locked[SEAT_WORDS];
+    uint32_t expires;
+    // version first: a change made while rendering leaves it behind
+    uint64_t version = atomic_load_explicit(&versions[train], memory_order_acquire);
+    int seats = trains[train].seats;
+    seat_booked_bits(train, booked);
+    live_locks(train, locked, &expires);
+    int g = 0;
+    for (; g < seats / 4; g++) {
+        int shift = 4 * (g % 16);
+        unsigned b = (booked[g / 16] >> shift) & 0xF;
+        unsigned l = (locked[g / 16] >> shift) & 0xF & ~b;
+        // '0' free, '1' booked, '2' locked
+        uint64_t line = LINE_PATTERN + spread[b] + 2 * spread[l];
+        memcpy(buf + g * 8, &line, 8);
+    }
+    for (int i = g * 4; i < seats; i++) {
+        buf[i * 2] = bit_test(booked, i) ? '1' : bit_test(locked, i) ? '2' : '0';
+        buf[i * 2 + 1] = i == seats - 1 ? '\n' : ' ';
+    }
+    if (snap != NULL) {
+        snap->version = version;
+        memcpy(snap->booked, booked, sizeof(booked));
+        snap->expires = expires;
+    }
+}
+
+bool seat_snapshot_current(int train, const seat_snapshot* snap) {
+    uint64_t booked[SEAT_WORDS];
+    if (atomic_load_explicit(&versions[train], memory_order_acquire) != snap->version)
+        return false;
+    if (snap->expires != 0 && lease_expired(snap->expires, (uint32_t) monotonic_ms()))
+        return false;
+    seat_booked_bits(train, booked);
+    return memcmp(booked, snap->booked, sizeof(booked)) == 0;
+}
+
+int seat_find_free_run(int train, int k) {
+    uint64_t free_bits[SEAT_WORDS], locked[SEAT_WORDS], scratch[SEAT_WORDS];
+    int seats = trains[train].seats;
+    int words = words_of(train);
+    if (k < 1 || k > seats)
+        return -1;
+    seat_booked_bits(train, free_bits);
+    seat_locked_bits(train, locked);
+    for (int w = 0; w < words; w++)
+        free_bits[w] = ~(free_bits[w] | locked[w]);
+    if (seats % 64)
+        free_bits[words - 1] &= ((uint64_t) 1 << (seats % 64)) - 1;
+    int first = bitset_find_run(free_bits, words, k, scratch);
+    return first < 0 ? -1 : first + 1;
+}
+
+int seat_state(int train, int seat) {
+    if (booked(train, seat))
+        return SEAT_BOOKED;
+    uint64_t word = atomic_load_explicit(lock_of(train, seat), memory_order_acquire);
+    if (word == 0)
+        return SEAT_FREE;
+    // only locked seats cost a clock read
+    return lock_expired(train, seat, word, (uint32_t) monotonic_ms()) ? SEAT_FREE : SEAT_LOCKED;
+}
+
+bool seat_fully_booked(int train) {
+    uint64_t booked[SEAT_WORDS];
+    seat_booked_bits(train, booked);
+    return bitset_count(booked, SEAT_WORDS) == trains[train].seats;
+}
+
+uint64_t seat_lock_owner(void) {
+    uint32_t id;
+    // 0 would make a free word once the pid is 0 too
+    while ((id = atomic_fetch_add_explicit(owner_ids, 1, memory_order_relaxed)) == 0 || id == BOOKING_ID)
+        ;
+    return ((uint64_t) self_pid << 32) | id;
+}
+
+int seat_try_lock(int train, int seat, uint64_t owner, long lease_until) {
+    if (booked(train, seat))
+        return SEAT_BOOKED;
+
+    _Atomic uint64_t* lock = lock_of(train, seat);
+    uint64_t expected = 0;
+    while (!atomic_compare_exchange_strong(lock, &expected, owner)) {
+        if (expected == owner)
+            return SEAT_FREE; // already ours
+        // take over a lock whose lease ran out or whose process died
+        if (!lock_expired(train, seat, expected, (uint32_t) monotonic_ms()) && !owner_gone(expected))
+            return SEAT_LOCKED;
+        log_warn("reclaiming seat %d of train %d from pid %u\n", seat, trains[train].shift_id,
+                 (unsigned) (expected >> 32));
+    }
+    atomic_store_explicit(lease_of(train, seat), (owner << 32) | (uint32_t) lease_until, memory_order_release);
+    atomic_fetch_or(lock_bits_of(train, seat), lock_bit(seat));
+    bump_version(train);
+    // A payer may have booked the seat between our check and the CAS
+    // (payers write the seat before releasing the lock), look again
+    if (booked(train, seat)) {
+        seat_unlock(train, seat, owner);
+        return SEAT_BOOKED;
+    }
+    return SEAT_FREE;
+}
+
+int seat_try_lock_all(int train, const uint64_t* seats, uint64_t owner, long lease_until, uint64_t* taken) {
+    uint64_t locked[SEAT_WORDS];
+    // a look at the bitsets first tells every seat that is taken already
+    seat_booked_bits(train, taken);
+    seat_locked_bits(train, locked);
+    for (int w = 0; w < SEAT_WORDS; w++)
+        taken[w] = (taken[w] | locked[w]) & seats[w];
+    int n = bitset_count(taken, SEAT_WORDS);
+    if (n > 0)
+        return n;
+
+    // then the compare-and-swaps, undone if somebody got in between
+    for (int i = bitset_next(seats, SEAT_WORDS, 0); i >= 0; i = bitset_next(seats, SEAT_WORDS, i+1)) {
+        if (seat_try_lock(train, i+1, owner, lease_until) == SEAT_FREE)
+            continue;
+        for (int j = bitset_next(seats, SEAT_WORDS, 0); j < i; j = bitset_next(seats, SEAT_WORDS, j+1))
+            seat_unlock(train, j+1, owner);
+        bit_set(taken, i);
+        return 1;
+    }
+    return 0;
+}
+
+void seat_unlock(int train, int seat, uint64_t owner) {
+    uint64_t expected = owner;
+    if (!atomic_compare_exchange_strong(lock_of(train, seat), &expected, 0))
+        return;
+    atomic_fetch_and(lock_bits_of(train, seat), ~lock_bit(seat));
+    // somebody locked it between the CAS and clearing the bit, put it back
+    if (atomic_load(lock_of(train, seat)) != 0)
+        atomic_fetch_or(lock_bits_of(train, seat), lock_bit(seat));
+    bump_version(train);
+}
+
+uint64_t seat_adopted(uint64_t owner) {
+    return ((uint64_t) self_pid << 32) | (uint32_t) owner;
+}
+
+bool seat_adopt(int train, int seat, uint64_t owner) {
+    // same owner id, so the lease stays; the version too: nothing shown changes
+    uint64_t expected = owner;
+    return atomic_compare_exchange_strong(lock_of(train, seat), &expected, seat_adopted(owner));
+}
+
+bool seat_book(int train, int seat, uint64_t owner) {
+    // the word turns to booking first, so no lease running out lets a
+    // locker in while the seat is written; lockers look again after their CAS
+    uint64_t expected = owner;
+    uint64_t booking = (owner & ~(uint64_t) UINT32_MAX) | BOOKING_ID;
+    if (!atomic_compare_exchange_strong(lock_of(train, seat), &expected, booking))
+        return false;
+    ((volatile char*) seat_map[train])[(seat-1) * 2] = '1';
+    seat_unlock(train, seat, booking);
+    return true;
+}
+
+void seat_mark_booked(int train, int seat) {
+    ((volatile char*) seat_map[train])[(seat-1) * 2] = '1';
+    bump_version(train);
+}
+
+int seat_table_sync(void) {
+    for (int i = 0; i < num_trains; i++) {
+        char* map = atomic_load(&seat_map[i]);
+        if (map != NULL && msync(map, trains[i].seats * 2, MS_SYNC) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+void seat_release_all(void) {
+    if (versions == NULL)
+        return;
+    // locked bits first, only the seats in use are looked at
+    for (int train = 0; train < num_trains; train++) {
+        for (int w = 0; w < words_of(train); w++) {
+            uint64_t bits = atomic_load(&lock_bits[trains[train].bits_base + w]);
+            while (bits) {
+                int seat = w * 64 + __builtin_ctzll(bits) + 1;
+                bits &= bits - 1;
+                uint64_t word = atomic_load(lock_of(train, seat));
+                if (word != 0 && (uint32_t) (word >> 32) == self_pid)
+                    seat_unlock(train, seat, word);
+            }
+        }
+    }
+}
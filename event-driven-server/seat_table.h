@@ -0,0 +1,89 @@
+#ifndef SEAT_TABLE_H
+#define SEAT_TABLE_H
+
+#include <stdint.h>
+#include "common.h"
+
+// Seat state shared by every read and write server working on ./csie_trains.
+//
+// Booked seats are the train files themselves, mapped MAP_SHARED: seat i is
+// the digit at offset (i-1)*2, gathered into bitsets 4 seats per load.
+// Locks (seats chosen but not paid yet) are 64-bit words in a shared memory
+// segment named after the train directory:
+//     owner pid << 32 | owner id
+// 0 means free. The segment hands out one id per connection, so no two
+// holders share a word. A seat's lease (CLOCK_MONOTONIC ms, low 32 bits)
+// sits in a word of its own, tagged with the owner id. Locking and
+// unlocking are compare-and-swaps, so neither a query nor a booking makes a
+// system call. A lock whose lease ran out, or whose owner process is gone,
+// can be taken over, unless it is being booked: booking swaps the word to a
+// reserved id first and holds it until the seat is written.
+//
+// Segment and train files are sized by the catalog. A train file is mapped
+// the first time its train is opened; the fd is closed right away.
+//
+// train is an index in trains[] (catalog_find), seat is 1-based.
+
+// Seat states as shown by the read server
+#define SEAT_FREE 0
+#define SEAT_BOOKED 1
+#define SEAT_LOCKED 2
+
+// Attaches the lock segment of the catalog loaded, -1 on error
+int seat_table_init(bool writable);
+// Maps the train file (once), -1 on error. Required before the calls below
+int seat_table_open(int train);
+
+int seat_state(int train, int seat);        // SEAT_FREE / SEAT_BOOKED / SEAT_LOCKED
+bool seat_fully_booked(int train);
+
+// Bitsets of SEAT_WORDS words, seat n is bit n-1
+void seat_booked_bits(int train, uint64_t* booked);
+void seat_locked_bits(int train, uint64_t* locked);
+
+// What a rendered seat map depends on. version counts lock changes (lock,
+// unlock, book) on the train, booked catches edits made to the train file
+// by anything else, and a shown lock turns free at expires.
+typedef struct {
+    uint64_t version;
+    uint64_t booked[SEAT_WORDS];
+    uint32_t expires;   // earliest lease among the locked seats shown, 0 if none
+} seat_snapshot;
+
+// Seat map as sent by the read server ("0 1 2 0\n..."), seats * 2 bytes,
+// and what it was rendered from if snap is not NULL
+void seat_render(int train, char* buf, seat_snapshot* snap);
+// Whether a map rendered from snap would still be rendered the same
+bool seat_snapshot_current(int train, const seat_snapshot* snap);
+// First seat of the first k adjacent seats neither booked nor locked, -1 if none
+int seat_find_free_run(int train, int k);
+
+// Lock word of a new owner in this process, unique among all processes
+uint64_t seat_lock_owner(void);
+// Return SEAT_FREE once locked by owner, with a lease ending at lease_until
+// (monotonic ms), SEAT_BOOKED or SEAT_LOCKED otherwise
+int seat_try_lock(int train, int seat, uint64_t owner, long lease_until);
+// Locks every seat of the bitset seats for owner, or none of them: return 0
+// once all are locked, otherwise the number of seats found booked or locked
+// by somebody else, set in taken
+int seat_try_lock_all(int train, const uint64_t* seats, uint64_t owner, long lease_until, uint64_t* taken);
+// Releases the lock if owner still holds it
+void seat_unlock(int train, int seat, uint64_t owner);
+// Lock word of owner (of another process) once adopted by this one
+uint64_t seat_adopted(uint64_t owner);
+// Takes over the lock owner holds on the seat as seat_adopted(owner), lease
+// unchanged (restart handoff), false if owner does not hold it
+bool seat_adopt(int train, int seat, uint64_t owner);
+// Marks a seat locked by owner as booked and releases the lock, false if
+// owner does not hold it (its lease ran out and it was taken)
+bool seat_book(int train, int seat, uint64_t owner);
+
+// Marks a seat booked without a lock (journal replay)
+void seat_mark_booked(int train, int seat);
+// Writes the train files back to disk, 0 on success
+int seat_table_sync(void);
+
+// Drops every lock held by this process
+void seat_release_all(void);
+
+#endif
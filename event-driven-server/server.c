@@ -1,265 +1,1132 @@
+#define _GNU_SOURCE // accept4
 #include <stdio.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 #include "server.h"
 #include "business_logic.h"
+#ifdef USE_IO_URING
+#include "uring.h"
+#else
+#include "event_loop.h"
+#endif
+#include "timer.h"
+#include "seat_table.h"
+#include "journal.h"
+#include "metrics.h"
+#include "log.h"
+#include "slab.h"
+#include "watch.h"
+#include "handoff.h"
+#include "admit.h"
 
 // Global variable
 server svr;
 int maxfd;
-request* requestP = NULL;  // point to a list of requests
-struct pollfd *fds;
 
-static nfds_t nfd; // number of fds to poll (including listen_fd)
-static int num_conn = 1; // server's current number of connections
-static const char* file_prefix = "./csie_trains/train_";
+// One event loop per thread. Every reactor has its own listener on each
+// port served (SO_REUSEPORT), the kernel spreads new connections among them,
+// and a connection stays on the reactor that accepted it: its request comes
+// from the reactor's pool and is only touched by that thread. The event
+// loop hands the request back with each event, no table is indexed by fd.
+// Queries and bookings may share a process, a connection speaks the
+// protocol of the port it came in on. The stats port, if any, is served by
+// reactor 0 alone.
+//
+// A connection accepted is turned away with busy_msg when MAX_CONNS are
+// open or its address has no token left (admit.h, ADMIT_RATE and
+// ADMIT_BURST shared among the reactors: SO_REUSEPORT spreads an address's
+// connections over them). The stats port is always served.
+//
+// Built with -D USE_IO_URING, a reactor drives its connections through an
+// io_uring of its own instead: a multishot accept per listener, a recv from
+// the reactor's buffer ring while the client may send, and the queued
+// output as a chain of linked sends. The kernel gets all of an iteration's
+// requests in the io_uring_enter that waits for the next completions.
+typedef struct {
+    int id;
+    request* listener[3]; // per role, NULL if the role is not served here
+    slab_pool conns;    // requests of the connections (and listeners)
+    request* clients;   // the connections, linked through conn_next / conn_pprev
+    admit_table admit;  // token buckets of the client addresses
+    char buf[MAX_MSG_LEN]; // request.buf of them all
+#ifdef USE_IO_URING
+    uring ring;
+    uring_bufs bufs;    // a buffer is only held while its bytes are copied out
+    request* stalled;   // their requests are queued again after the next wait
+#else
+    event_loop* loop;
+#endif
+    timer_heap timers;  // connection deadlines
+    long now;           // monotonic ms, read once per loop iteration
+    long next_watch;    // when the watched trains are checked next
+    request** waiting;  // COMMIT requests, in the journal batch of the thread
+    int n_waiting;
+    int cap_waiting;
+    pthread_t thread;
+} reactor;
+
+static reactor* reactors;
+static int num_reactors;
+static __thread reactor* self; // reactor of the calling thread
+static atomic_int num_conn = 1; // server's current number of connections
+static atomic_int open_conns;   // connections of every reactor
+static int max_conns;           // MAX_CONNS, or fewer for the fd limit
+static int spare_fd = -1;       // given up to turn a connection away when out of fds
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
 static const char* exit_msg = ">>> Client exit.\n";
 static const char* invalid_op_msg = ">>> Invalid operation.\n";
 static const char* timeout_msg = ">>> Connection timeout.\n";
+static const char* busy_msg = ">>> Server busy, please try again later.\n";
+
+static void init_request(request* reqP) {
+    memset(reqP, 0, sizeof(request));
+    reqP->conn_fd = -1;
+    reqP->client_id = -1;
+    reqP->status = INIT;
+    timer_node_init(&reqP->timer); // not armed
+    ring_init(&reqP->in);
+    outq_init(&reqP->out);
+
+    reqP->booking_info.shift_id = -1;
+    reqP->booking_info.train = -1;
+}
 
-static int accept_conn(void) {
-    // update requestP[conn_fd]
-    // 1. host
+static request* new_conn(enum ROLE role, int conn_fd, const struct sockaddr_in* cliaddr) {
+    // new request from the reactor's pool
+    // 1. host (if known)
     // 2. conn_fd
     // 3. client_id
-    struct sockaddr_in cliaddr;
-    size_t clilen;
-    int conn_fd;  // fd for a new connection with client
-
-    clilen = sizeof(cliaddr);
-    // server listen from svr.listen_fd and get a new connection with client (conn_fd)
-    conn_fd = accept(svr.listen_fd, (struct sockaddr*)&cliaddr, (socklen_t*)&clilen);
-    if (conn_fd < 0) {
-        if (errno == EINTR || errno == EAGAIN) return -1;  // try again
-        if (errno == ENFILE) {
-            (void) fprintf(stderr, "out of file descriptor table ... (maxfd %d)\n", maxfd);
-                return -1;
+    // 4. role, that of the listener
+    // 5. its place in the reactor's list
+    request* reqP = (request*) slab_alloc(&self->conns);
+    if (reqP == NULL) {
+        log_warn("out of memory for a connection, closing fd %d\n", conn_fd);
+        close(conn_fd);
+        return NULL;
+    }
+
+    metrics_inc(M_ACCEPTED_READER + role);
+    atomic_fetch_add(&open_conns, 1);
+    init_request(reqP);
+    reqP->conn_fd = conn_fd;
+    reqP->buf = self->buf;
+    if (cliaddr != NULL)
+        inet_ntop(AF_INET, &cliaddr->sin_addr, reqP->host, sizeof(reqP->host));
+    log_debug("getting a new request... fd %d from %s\n", conn_fd, reqP->host);
+    reqP->client_id = (svr.port * 1000) + atomic_fetch_add(&num_conn, 1);    // This should be unique for the same machine.
+    // Current time +5 sec is the deadline, the clock read again: a batch of
+    // accepts takes a while and each connection counts from its own
+    self->now = monotonic_ms();
+    timer_arm(&self->timers, &reqP->timer, self->now + CONN_TIMEOUT_MS);
+    reqP->role = role;
+    reqP->conn_next = self->clients;
+    if (self->clients != NULL)
+        self->clients->conn_pprev = &reqP->conn_next;
+    self->clients = reqP;
+    reqP->conn_pprev = &self->clients;
+    return reqP;
+}
+
+// A connection not served: told so if its socket takes it right away, then
+// closed
+static void turn_away(int conn_fd, enum metric_counter why) {
+    metrics_inc(why);
+    send(conn_fd, busy_msg, strlen(busy_msg), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(conn_fd);
+}
+
+// Whether a connection just accepted is served, turned away if not
+static bool admit(request* listener, int conn_fd, const struct sockaddr_in* cliaddr) {
+    if (listener->role == STATS)
+        return true;
+    if (atomic_load(&open_conns) >= max_conns) {
+        turn_away(conn_fd, M_SHED_FULL);
+        return false;
+    }
+    if (cliaddr != NULL && !admit_take(&self->admit, cliaddr->sin_addr.s_addr, self->now)) {
+        log_debug("too many connections from %s\n", inet_ntoa(cliaddr->sin_addr));
+        turn_away(conn_fd, M_SHED_RATE);
+        return false;
+    }
+    return true;
+}
+
+// Out of fds: the connection waiting stays in the backlog and the
+// listener ready, so the spare fd is given up to take it and turn it away
+// (the listener is ours alone, accept does not block)
+static void shed_one(request* listener) {
+    pthread_mutex_lock(&spare_lock);
+    if (spare_fd >= 0) {
+        close(spare_fd);
+        int conn_fd = accept4(listener->conn_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn_fd >= 0)
+            turn_away(conn_fd, M_SHED_FULL);
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    pthread_mutex_unlock(&spare_lock);
+    log_warn("out of file descriptors (maxfd %d), turning connections away\n", maxfd);
+}
+
+
+// A payment leaves the journal batch with its client: it was never
+// answered and its seats are unlocked below
+static void drop_waiting(request* reqP) {
+    for (int i = self->n_waiting - 1; i >= 0; i--) {
+        if (self->waiting[i] == reqP) {
+            self->waiting[i] = NULL;
+            journal_drop(reqP->client_id);
+            return;
         }
-        ERR_EXIT("accept");
-    }
-    
-    requestP[conn_fd].conn_fd = conn_fd;
-    strcpy(requestP[conn_fd].host, inet_ntoa(cliaddr.sin_addr));
-    fprintf(stderr, "getting a new request... fd %d from %s\n", conn_fd, requestP[conn_fd].host);
-    requestP[conn_fd].client_id = (svr.port * 1000) + num_conn;    // This should be unique for the same machine.
-    num_conn++;
-    // Get current time and +5 sec to set the deadline
-    if(gettimeofday(&requestP[conn_fd].deadline, NULL) < 0) {
-        fprintf(stderr, "cannot gettimeofday\n");
-        return -1;
     }
-    requestP[conn_fd].deadline.tv_sec += 5;
+}
 
-    // Already init_request but make sure again
-    requestP[conn_fd].status = INIT;
-    memset(requestP[conn_fd].buf, 0, MAX_MSG_LEN);
-    requestP[conn_fd].buf_len = 0;
-    return conn_fd;
+#ifdef USE_IO_URING
+static void unstall(request* reqP) {
+    if (reqP->stalled_pprev == NULL)
+        return;
+    *reqP->stalled_pprev = reqP->stalled_next;
+    if (reqP->stalled_next != NULL)
+        reqP->stalled_next->stalled_pprev = reqP->stalled_pprev;
+    reqP->stalled_pprev = NULL;
 }
+#endif
 
-static void init_request(request* reqP) {
-    reqP->conn_fd = -1;
-    reqP->client_id = -1;
-    reqP->buf_len = 0;
-    reqP->status = INIT;
-    reqP->deadline.tv_sec = -1; // Mark as unitialized
-    reqP->deadline.tv_usec = -1;
+static void free_conn(request* reqP) {
+#ifdef USE_IO_URING
+    unstall(reqP);
+#endif
+    atomic_fetch_sub(&open_conns, 1);
+    *reqP->conn_pprev = reqP->conn_next;
+    if (reqP->conn_next != NULL)
+        reqP->conn_next->conn_pprev = reqP->conn_pprev;
+    outq_free(&reqP->out);
+    close(reqP->conn_fd);
+    slab_free(&self->conns, reqP);
+}
 
-    reqP->booking_info.num_of_chosen_seats = 0;
-    reqP->booking_info.train_fd = -1;
-    reqP->booking_info.shift_id = -1;
-    for (int i = 0; i < SEAT_NUM; i++)
-        reqP->booking_info.seat_stat[i] = DEFAULT;
+#ifdef USE_IO_URING
+// The output left if the socket takes it right away, then the shutdown:
+// the requests still under way complete, the last one frees the request
+static void shut_conn(request* reqP) {
+    if (reqP->out.len > 0) {
+        struct iovec iov[OUTQ_IOV];
+        struct msghdr mh = { .msg_iov = iov, .msg_iovlen = outq_iov(&reqP->out, iov, OUTQ_IOV) };
+        sendmsg(reqP->conn_fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    timer_cancel(&self->timers, &reqP->timer);
+    shutdown(reqP->conn_fd, SHUT_RDWR);
+    if (reqP->inflight == 0)
+        free_conn(reqP);
 }
+#endif
 
-// clear request structure in requestP
-static void clear_request(request* reqP) {
-    memset(reqP, 0, sizeof(request));
-    init_request(reqP);
+// Unregisters and closes the connection, msg (if any) is the last words,
+// sent along with the queued output if the socket takes them right away
+static void close_conn(request* reqP, const char* msg) {
+    metrics_inc(M_CLOSED);
+    if (reqP->status == COMMIT)
+        drop_waiting(reqP);
+    watch_remove(reqP);
+    unlock_unpaid_seat(reqP);
+    timer_cancel(&self->timers, &reqP->timer);
+#ifdef USE_IO_URING
+    // the kernel has the buffers of the requests under way, the request
+    // is only freed once they complete
+    reqP->status = CLOSED;
+    if (msg != NULL)
+        outq_puts(&reqP->out, msg);
+    // a chain being sent (still queued maybe) goes first, SEND_GRACE_MS
+    // at most: at the deadline the connection is shut down
+    if (reqP->sending > 0)
+        timer_arm(&self->timers, &reqP->timer, self->now + SEND_GRACE_MS);
+    else
+        shut_conn(reqP);
+#else
+    if (msg != NULL && outq_puts(&reqP->out, msg) == 0)
+        outq_flush(&reqP->out, reqP->conn_fd);
+    ev_del(self->loop, reqP->conn_fd);
+    free_conn(reqP);
+#endif
 }
 
-static void getfilepath(char* filepath, int extension) {
-    char fp[FILE_LEN*2];
-    
-    memset(filepath, 0, FILE_LEN);
-    sprintf(fp, "%s%d", file_prefix, extension);
-    strcpy(filepath, fp);
+static bool closing(request* reqP) {
+    return reqP->status == INVALID || reqP->status == EXIT;
+}
+
+#ifdef USE_IO_URING
+// What a completion is for, in the low bits of its user data (requests
+// are cache line aligned)
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_MASK 3
+
+static uint64_t op_data(request* reqP, int op) {
+    return (uint64_t) (uintptr_t) reqP | op;
 }
 
-int get_client_timeout(int conn_fd) {
-    struct timeval now;
-    if(gettimeofday(&now, NULL) < 0) {
-        fprintf(stderr, "cannot gettimeofday\n");
-        // TODO: should handle error
+// A request could not be queued: EBUSY when the submission queue is still
+// full after handing it to the kernel (or completions overflowed), EAGAIN
+// when the kernel is short of memory. Both pass once completions are
+// reaped, so the request is queued again after the next wait; anything
+// else is fatal.
+static void stall(request* reqP, const char* what) {
+    if (errno != EBUSY && errno != EAGAIN)
+        ERR_EXIT(what);
+    if (reqP->stalled_pprev != NULL)
+        return;
+    reqP->stalled_next = self->stalled;
+    if (self->stalled != NULL)
+        self->stalled->stalled_pprev = &reqP->stalled_next;
+    self->stalled = reqP;
+    reqP->stalled_pprev = &self->stalled;
+}
+
+// Sends the queued output, one linked send per chunk, once the last chain
+// is done, and keeps a recv queued unless the client is being closed,
+// waits for a commit or has OUTQ_LIMIT bytes waiting (it has to read its
+// answers before sending more). A closing connection is closed once
+// drained.
+static void flush_conn(request* reqP) {
+    if (reqP->sending == 0 && reqP->out.len > 0) {
+        struct iovec iov[OUTQ_IOV];
+        int n = outq_iov(&reqP->out, iov, OUTQ_IOV);
+        if (uring_send_chain(&self->ring, reqP->conn_fd, iov, n, op_data(reqP, OP_SEND)) < 0) {
+            stall(reqP, "io_uring send");
+            return;
+        }
+        reqP->sending = n;
+        reqP->inflight += n;
+    } else if (reqP->sending == 0 && closing(reqP)) {
+        close_conn(reqP, NULL);
+        return;
     }
-    long deadline_millisecond = (requestP[conn_fd].deadline.tv_sec * 1000) + (requestP[conn_fd].deadline.tv_usec / 1000);
-    long now_millisecond = (now.tv_sec * 1000) + (now.tv_usec / 1000);
-    int timeout = deadline_millisecond - now_millisecond;
-    return timeout;
+    if (reqP->receiving || closing(reqP) || reqP->status == COMMIT || reqP->out.len >= OUTQ_LIMIT)
+        return;
+    if (ring_full(&reqP->in)) { // a line longer than any command
+        log_debug("bad request from %s\n", reqP->host);
+        metrics_inc(M_INVALID);
+        close_conn(reqP, invalid_op_msg);
+        return;
+    }
+    // no more than the input ring takes
+    if (uring_recv(&self->ring, reqP->conn_fd, &self->bufs, ring_space(&reqP->in), op_data(reqP, OP_RECV)) < 0) {
+        stall(reqP, "io_uring recv");
+        return;
+    }
+    reqP->receiving = true;
+    reqP->inflight++;
+}
+#else
+// Sends the queued output and sets what to wait for: EV_WRITE while output
+// is left, EV_READ unless the client is being closed or has OUTQ_LIMIT bytes
+// waiting (it has to read its answers before sending more). A closing
+// connection is closed once drained.
+static void flush_conn(request* reqP) {
+    int conn_fd = reqP->conn_fd;
+    int ret = outq_flush(&reqP->out, conn_fd);
+    if (ret < 0) {
+        log_debug("write error, closing fd %d\n", conn_fd);
+        close_conn(reqP, NULL);
+        return;
+    }
+    if (ret == 0 && closing(reqP)) {
+        close_conn(reqP, NULL);
+        return;
+    }
+    int events = ret > 0 ? EV_WRITE : 0;
+    if (!closing(reqP) && reqP->status != COMMIT && reqP->out.len < OUTQ_LIMIT)
+        events |= EV_READ;
+    // no system call while the interest stays the same
+    if (events != reqP->events) {
+        ev_mod(self->loop, conn_fd, events, reqP);
+        reqP->events = events;
+    }
+}
+#endif
+
+// Queues the answer to the last command (or the banner of a new
+// connection, or the parting message)
+static void queue_response(request* reqP) {
+    if (reqP->status == INVALID) {
+        log_debug("invalid operation, closing fd %d\n", reqP->conn_fd);
+        metrics_inc(M_INVALID);
+        outq_puts(&reqP->out, invalid_op_msg);
+    } else if (reqP->status == EXIT) {
+        log_debug("fd: %d closed, bye bye!\n", reqP->conn_fd);
+        outq_puts(&reqP->out, exit_msg);
+    } else {
+        response_client_request(reqP);
+    }
+}
+
+static void wait_commit(request* reqP) {
+    if (self->n_waiting == self->cap_waiting) {
+        int cap = self->cap_waiting ? self->cap_waiting * 2 : 64;
+        request** grown = (request**) realloc(self->waiting, sizeof(request*) * cap);
+        if (grown == NULL)
+            ERR_EXIT("out of memory queueing a payment");
+        self->waiting = grown;
+        self->cap_waiting = cap;
+    }
+    self->waiting[self->n_waiting++] = reqP;
 }
 
-static int calculate_timeout() {
-    // return timeout in millisecond (10^-6)
-    int num_of_clients = 0;
-    int conn_fd;
-    int min_timeout = INT_MAX;
-    for(int i = 0; i < nfd; i++) {
-        conn_fd = fds[i].fd;
-        if(conn_fd == -1 || conn_fd == svr.listen_fd) // fd is cleared or server listenfd (should not timeout)
+// Answers the buffered commands up to a payment, which is answered after
+// the journal commit, then sends the answers together
+static void serve_commands(request* reqP) {
+    while (!closing(reqP) && reqP->status != COMMIT) {
+        enum STATE state = reqP->status;
+        uint64_t start = metrics_now_ns();
+        if (!process_client_request(reqP))
+            break;
+        if (reqP->status == COMMIT) {
+            reqP->cmd_ns = start;
+            wait_commit(reqP);
             continue;
-        num_of_clients++;
-        int timeout = get_client_timeout(conn_fd);
-        if(timeout < 0) { // Some fd has passed deadline, should be cleared immediately
-            min_timeout = 0;
-        } else {
-            min_timeout = (timeout < min_timeout) ? timeout : min_timeout;
         }
+        if (reqP->status == WATCH && state == SHIFT) // a watcher stays until it leaves
+            timer_cancel(&self->timers, &reqP->timer);
+        queue_response(reqP);
+        metrics_observe(state == SEAT ? H_SEAT : state == PAYMENT ? H_PAYMENT : H_SHIFT, metrics_now_ns() - start);
     }
-    if(num_of_clients == 0)
-        return -1; // wait indefinitely
-    return min_timeout;
+    flush_conn(reqP);
 }
 
-static void clean_expired_client() {
-    int conn_fd;
-    for(int i = 0; i < nfd; i++) {
-        conn_fd = fds[i].fd;
-        if(conn_fd == -1 || conn_fd == svr.listen_fd) // fd is cleared or server listenfd (should not timeout)
+// Stats port: one request, answered with every metric, then the connection
+// closes. An HTTP request (a scraper, curl) is answered over HTTP/1.0 once
+// its header is read, any other line in plain text.
+static void serve_stats(request* reqP) {
+    char line[256];
+    int len;
+    while (!closing(reqP) && (len = ring_getline(&reqP->in, line, sizeof(line))) != -1) {
+        if (reqP->status == INIT && len > 0 && strstr(line, " HTTP/") != NULL) {
+            reqP->status = HEADER;
+            continue;
+        }
+        if (reqP->status == HEADER && len != 0) // header field, or too long
             continue;
-        int timeout = get_client_timeout(conn_fd);
-        if(timeout <= 0) { // bye bye
-            fprintf(stderr, "connection timeout, closing fd %d\n", requestP[conn_fd].conn_fd);
-            unlock_unpaid_seat(&requestP[conn_fd]);
-            write(requestP[conn_fd].conn_fd, timeout_msg, strlen(timeout_msg));
-            close(requestP[conn_fd].conn_fd);
-            clear_request(&requestP[conn_fd]);
-            fds[i].fd = -1; // TODO3: fd collection
+        if (reqP->status == HEADER)
+            outq_puts(&reqP->out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+        if (metrics_write(&reqP->out) < 0) {
+            close_conn(reqP, NULL);
+            return;
         }
+        reqP->status = EXIT; // closed once sent
     }
+    flush_conn(reqP);
 }
 
-void init_db(void) {
-    char filename[FILE_LEN];
+// ret: what handle_read (or handle_input) returned. Every complete command
+// that came in is answered before the answers are sent together, so a
+// client may send several commands at once.
+static void serve_received(request* reqP, int ret) {
+    if (ret > 0) {
+        if (reqP->role == STATS)
+            serve_stats(reqP);
+        else
+            serve_commands(reqP);
+        return;
+    }
+    if (reqP->role == STATS) {
+        close_conn(reqP, NULL);
+        return;
+    }
+    log_debug(ret < 0 ? "bad request from %s\n" : "client %s is gone\n", reqP->host);
+    if (ret < 0)
+        metrics_inc(M_INVALID);
+    close_conn(reqP, ret < 0 ? invalid_op_msg : NULL);
+}
 
-    for (int i = TRAIN_ID_START, j = 0; i <= TRAIN_ID_END; i++, j++) {
-        getfilepath(filename, i);
-#ifdef READ_SERVER
-        trains[j].file_fd = open(filename, O_RDONLY);
-#elif defined WRITE_SERVER
-        trains[j].file_fd = open(filename, O_RDWR);
-#else
-        trains[j].file_fd = -1;
-#endif
-        if (trains[j].file_fd < 0) {
-            ERR_EXIT("open");
+// Welcome banner, a stats client asks first
+static void greet(request* conn) {
+    if (conn->role != STATS)
+        queue_response(conn);
+    flush_conn(conn);
+}
+
+// Group commit: the payments of one loop iteration share a write and an
+// fdatasync, then each is booked and answered, and the client's next
+// commands are served (a payment among them waits for the next commit)
+static void commit_payments(void) {
+    int n = self->n_waiting;
+    bool committed = journal_commit() == 0;
+    if (!committed)
+        log_error("journal_commit: %s\n", strerror(errno));
+    metrics_inc(committed ? M_COMMITS : M_COMMIT_FAILED);
+    log_debug("journal: %d payment(s) in one commit\n", n);
+    // each answer is queued right away, request.buf is the reactor's
+    for (int i = 0; i < n; i++) {
+        request* reqP = self->waiting[i];
+        if (reqP == NULL)
+            continue;
+        finish_commit(reqP, committed);
+        queue_response(reqP);
+        metrics_observe(H_COMMIT, metrics_now_ns() - reqP->cmd_ns);
+    }
+    journal_release();
+
+    for (int i = 0; i < n; i++)
+        if (self->waiting[i] != NULL)
+            serve_commands(self->waiting[i]);
+    self->n_waiting -= n;
+    memmove(self->waiting, self->waiting + n, sizeof(request*) * self->n_waiting);
+}
+
+// A watcher with seat changes queued, or dropped for falling behind
+static void push_changes(request* reqP) {
+    if (reqP->status == INVALID)
+        close_conn(reqP, NULL);
+    else
+        flush_conn(reqP);
+}
+
+// Only the expired connections are visited
+static void clean_expired_client() {
+    timer_node* node;
+    while((node = timer_pop_expired(&self->timers, self->now)) != NULL) { // bye bye
+        request* reqP = timer_owner(node, request, timer);
+#ifdef USE_IO_URING
+        if (reqP->status == CLOSED) { // its sends did not go out in time
+            shutdown(reqP->conn_fd, SHUT_RDWR);
+            continue;
         }
+#endif
+        log_debug("connection timeout, closing fd %d\n", reqP->conn_fd);
+        metrics_inc(M_TIMED_OUT);
+        close_conn(reqP, timeout_msg);
     }
 }
 
-void init_server(unsigned short port) {
-    // Initialize server
-    // Input: port number
-    // Result: 
-    // 1. server svr
-    // 2. requestP is init with length maxfd, and went through init_request
-    struct sockaddr_in servaddr;
-    int tmp;
+static void replay_booking(int shift_id, int seat) {
+    int train = catalog_find(shift_id);
+    if (seat_table_open(train) == 0)
+        seat_mark_booked(train, seat);
+}
 
-    gethostname(svr.hostname, sizeof(svr.hostname));
-    svr.port = port;
+void init_db(bool writable) {
+    // train files are mapped when their shift is first asked for
+    if (catalog_load(CATALOG_PATH) < 0) {
+        log_error("cannot load the catalog\n");
+        exit(1);
+    }
+    init_prompts();
+    if (seat_table_init(writable) < 0)
+        ERR_EXIT("seat_table_init");
+    // bookings a crashed server committed but did not write back
+    if (writable && journal_open(replay_booking) < 0)
+        ERR_EXIT("journal_open");
+}
 
-    svr.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (svr.listen_fd < 0) ERR_EXIT("socket");
+static int bind_port(unsigned short port) {
+    struct sockaddr_in servaddr;
+    int tmp;
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) ERR_EXIT("socket");
 
     bzero(&servaddr, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
     servaddr.sin_port = htons(port);
     tmp = 1;
-    if (setsockopt(svr.listen_fd, SOL_SOCKET, SO_REUSEADDR, (void*)&tmp, sizeof(tmp)) < 0) {
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (void*)&tmp, sizeof(tmp)) < 0) {
+        ERR_EXIT("setsockopt");
+    }
+    // every reactor binds its own listener to the port
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (void*)&tmp, sizeof(tmp)) < 0) {
         ERR_EXIT("setsockopt");
     }
-    if (bind(svr.listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+    if (bind(listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
         ERR_EXIT("bind");
     }
-    if (listen(svr.listen_fd, 1024) < 0) {
+    if (listen(listen_fd, 1024) < 0) {
         ERR_EXIT("listen");
     }
+    return listen_fd;
+}
+
+static request* open_listener(reactor* r, unsigned short port, enum ROLE role) {
+    // restart: the old process's listener, its backlog included
+    int listen_fd = handoff_listener(r->id, role);
+    if (listen_fd < 0)
+        listen_fd = bind_port(port);
+#ifndef USE_IO_URING
+    // accepted from until EAGAIN (io_uring would hand EAGAIN back to us)
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+#endif
+    request* listener = (request*) slab_alloc(&r->conns);
+    if (listener == NULL)
+        ERR_EXIT("out of memory allocating a listener");
+    init_request(listener);
+    listener->conn_fd = listen_fd;
+    listener->status = LISTEN;
+    listener->role = role;
+    return listener;
+}
+
+// SIGTERM and SIGINT: the handler only wakes the reactors through stop_fd,
+// what comes before dying runs on a reactor thread, see stop_reactor
+static atomic_int stop_signal;  // the signal received, 0 if none
+static int stop_fd = -1;        // eventfd in every event loop, readable once a stop is asked
+static atomic_int reactors_stopped;
+
+static void request_stop(int sig) {
+    int saved = errno;
+    uint64_t one = 1;
+    atomic_store(&stop_signal, sig);
+    write(stop_fd, &one, sizeof(one)); // left readable: wakes every reactor
+    errno = saved;
+}
+
+// Once no payment of the reactor waits for a commit: every reactor stops,
+// the last one hands the seat locks back (they live in shared memory and
+// outlast the process) so that the seats are free right away, leaves the
+// train files synced and the journal empty, then dies of the signal.
+static void stop_reactor(void) {
+    if (atomic_fetch_add(&reactors_stopped, 1) + 1 < num_reactors)
+        for (;;)
+            pause(); // the last reactor ends the process
+    int sig = atomic_load(&stop_signal);
+    seat_release_all();
+    if (journal_checkpoint(true) < 0)
+        log_error("journal: checkpoint failed: %s\n", strerror(errno));
+    log_flush(true);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
 
-    // Get file descripter table size and initialize request table
+#ifndef USE_IO_URING
+static atomic_bool restart_requested;
+static int restart_fd = -1;     // eventfd in every event loop, readable once a restart is asked
+static pthread_mutex_t restart_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool handing_off;        // the new process is up, under restart_lock
+static atomic_int reactors_done; // reactors done handing over (old) or adopting (new)
+
+static void request_restart(int sig) {
+    (void) sig;
+    int saved = errno;
+    uint64_t one = 1;
+    atomic_store(&restart_requested, true);
+    write(restart_fd, &one, sizeof(one)); // wakes every reactor
+    errno = saved;
+}
+
+// A connection to the new process, along with what its request holds. It
+// is closed here once sent, its seats stay locked for the new process.
+static void send_conn(request* reqP) {
+    char in[RING_SIZE];
+    handoff_msg m = {
+        .type = HANDOFF_CONN,
+        .reactor = self->id,
+        .role = reqP->role,
+        .status = reqP->status,
+        .client_id = reqP->client_id,
+        .deadline = reqP->timer.index >= 0 ? reqP->timer.deadline : 0,
+        .lock_owner = reqP->lock_owner,
+        .booking_info = reqP->booking_info,
+        .out_len = reqP->out.len,
+    };
+    memcpy(m.host, reqP->host, sizeof(m.host));
+    // input, output chunks, a watcher's map
+    int max = reqP->out.len / OUTQ_CHUNK + 2;
+    struct iovec* iov = (struct iovec*) malloc(sizeof(struct iovec) * (max + 2));
+    int ret = -1;
+    if (iov != NULL) {
+        m.in_len = ring_copy(&reqP->in, in);
+        iov[0].iov_base = in;
+        iov[0].iov_len = m.in_len;
+        int n = 1 + outq_iov(&reqP->out, iov + 1, max);
+        if (reqP->status == WATCH) {
+            m.map_len = trains[reqP->booking_info.train].seats * 2;
+            iov[n].iov_base = (void*) watch_map(reqP);
+            iov[n++].iov_len = m.map_len;
+        }
+        ret = handoff_send(&m, reqP->conn_fd, iov, n);
+        free(iov);
+    }
+    if (ret < 0) {
+        log_warn("restart: cannot hand over fd %d: %s\n", reqP->conn_fd, strerror(errno));
+        close_conn(reqP, NULL);
+        return;
+    }
+    watch_remove(reqP);
+    timer_cancel(&self->timers, &reqP->timer);
+    free_conn(reqP);
+}
+
+// Restart (SIGUSR2), once no payment of the reactor waits for a commit:
+// the first reactor here starts the new process, each one hands over its
+// listeners and connections and stops, the last one waits for the ack and
+// exits. A new process that does not come up leaves everybody serving.
+static void hand_over(void) {
+    pthread_mutex_lock(&restart_lock);
+    if (!atomic_load(&restart_requested)) { // given up meanwhile
+        pthread_mutex_unlock(&restart_lock);
+        return;
+    }
+    if (!handing_off && handoff_spawn() < 0) {
+        uint64_t n;
+        read(restart_fd, &n, sizeof(n));
+        atomic_store(&restart_requested, false);
+        pthread_mutex_unlock(&restart_lock);
+        return;
+    }
+    handing_off = true;
+    pthread_mutex_unlock(&restart_lock);
+
+    for (int role = READER; role <= STATS; role++) {
+        handoff_msg m = { .type = HANDOFF_LISTENER, .reactor = self->id, .role = role };
+        if (self->listener[role] != NULL && handoff_send(&m, self->listener[role]->conn_fd, NULL, 0) < 0)
+            log_warn("restart: cannot hand over a listener: %s\n", strerror(errno));
+    }
+    int n = 0;
+    request* next;
+    for (request* reqP = self->clients; reqP != NULL; reqP = next, n++) {
+        next = reqP->conn_next;
+        send_conn(reqP);
+    }
+    log_info("restart: reactor %d handed over %d connection(s)\n", self->id, n);
+    if (atomic_fetch_add(&reactors_done, 1) + 1 < num_reactors)
+        for (;;)
+            pause(); // the last reactor ends the process
+
+    handoff_msg end = { .type = HANDOFF_END, .next_client = atomic_load(&num_conn) };
+    if (handoff_send(&end, -1, NULL, 0) < 0 || handoff_wait_ack() < 0) {
+        log_error("restart: the new process failed, connections handed over are lost\n");
+        seat_release_all();
+        log_flush(true);
+        exit(1);
+    }
+    log_info("restart: the new process serves, exiting\n");
+    log_flush(true);
+    exit(0);
+}
+
+// A connection handed over by the old process
+static void adopt_conn(handoff_item* it) {
+    const handoff_msg* m = &it->m;
+    request* reqP = new_conn(m->role, it->fd, NULL);
+    it->fd = -1;
+    if (reqP == NULL)
+        return;
+    reqP->status = m->status;
+    reqP->client_id = m->client_id;
+    reqP->booking_info = m->booking_info;
+    memcpy(reqP->host, m->host, sizeof(reqP->host));
+    timer_cancel(&self->timers, &reqP->timer);
+    if (m->deadline != 0) // the lock words' leases go by it
+        timer_arm(&self->timers, &reqP->timer, m->deadline);
+    ring_put(&reqP->in, it->data, m->in_len);
+    if (ev_add(self->loop, reqP->conn_fd, EV_READ, reqP) < 0)
+        ERR_EXIT("ev_add");
+    reqP->events = EV_READ;
+
+    int train = reqP->booking_info.train;
+    if (outq_append(&reqP->out, it->data + m->in_len, m->out_len) < 0 ||
+        (train >= 0 && seat_table_open(train) < 0) ||
+        (m->status == WATCH && watch_resume(reqP, train, it->data + m->in_len + m->out_len) < 0)) {
+        log_warn("restart: cannot take over client %d\n", reqP->client_id);
+        close_conn(reqP, NULL);
+        return;
+    }
+    if (reqP->role == WRITER)
+        adopt_chosen_seats(reqP, m->lock_owner);
+    serve_received(reqP, 1); // commands that came in whole, then the output
+}
+
+// The connections of the old process's reactors this one stands for, the
+// last reactor done acks
+static void adopt_conns(void) {
+    int n;
+    handoff_item* items = handoff_items(&n);
+    int adopted = 0;
+    for (int i = 0; i < n; i++) {
+        if (items[i].m.type == HANDOFF_CONN && items[i].m.reactor % num_reactors == self->id) {
+            adopt_conn(&items[i]);
+            adopted++;
+        }
+    }
+    if (n > 0)
+        log_info("restart: reactor %d took over %d connection(s)\n", self->id, adopted);
+    if (atomic_fetch_add(&reactors_done, 1) + 1 == num_reactors) {
+        handoff_done();
+        atomic_store(&reactors_done, 0); // counts again for our own restart
+    }
+}
+#endif
+
+void init_server(unsigned short read_port, unsigned short write_port, unsigned short stats_port, int threads) {
+    // Initialize server
+    // Input: port numbers (0: role not served), number of reactor threads
+    // Result: 
+    // 1. server svr
+    // 2. one listener per port, event loop, timer heap and request pool
+    //    per reactor; requests are allocated as connections come
+    unsigned short ports[3] = { [READER] = read_port, [WRITER] = write_port, [STATS] = stats_port };
+    gethostname(svr.hostname, sizeof(svr.hostname));
+    svr.port = read_port ? read_port : write_port;
+    stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stop_fd < 0)
+        ERR_EXIT("eventfd");
+    signal(SIGTERM, request_stop);
+    signal(SIGINT, request_stop);
+    // a client gone while we write is reported by write (EPIPE)
+    signal(SIGPIPE, SIG_IGN);
+#ifdef USE_IO_URING
+    signal(SIGUSR2, SIG_IGN); // no restart handoff with io_uring
+#else
+    restart_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (restart_fd < 0)
+        ERR_EXIT("eventfd");
+    signal(SIGUSR2, request_restart);
+#endif
+
+    // Get file descripter table size, only a bound: nothing is sized by it
     maxfd = getdtablesize();
-    requestP = (request*) malloc(sizeof(request) * maxfd);
-    if (requestP == NULL) {
-        ERR_EXIT("out of memory allocating all requests");
+    max_conns = maxfd - FD_RESERVE < MAX_CONNS ? maxfd - FD_RESERVE : MAX_CONNS;
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if (metrics_init(threads) < 0)
+        ERR_EXIT("out of memory allocating metrics");
+    num_reactors = threads;
+    reactors = (reactor*) calloc(threads, sizeof(reactor));
+    if (reactors == NULL) {
+        ERR_EXIT("out of memory allocating reactors");
     }
-    for (int i = 0; i < maxfd; i++) {
-        init_request(&requestP[i]);
+    for (int i = 0; i < threads; i++) {
+        reactor* r = &reactors[i];
+        r->id = i;
+#ifndef USE_IO_URING
+        r->loop = ev_create(maxfd);
+        if (r->loop == NULL)
+            ERR_EXIT("ev_create");
+        if (ev_add(r->loop, restart_fd, EV_READ, NULL) < 0 || ev_add(r->loop, stop_fd, EV_READ, NULL) < 0)
+            ERR_EXIT("ev_add");
+#endif
+        if (timer_heap_init(&r->timers, 64) < 0)
+            ERR_EXIT("timer_heap_init");
+        slab_pool_init(&r->conns, sizeof(request));
+        if (admit_init(&r->admit, (double) ADMIT_RATE / threads, (double) ADMIT_BURST / threads) < 0)
+            ERR_EXIT("out of memory allocating admission buckets");
+        for (int role = READER; role <= STATS; role++) {
+            r->listener[role] = NULL;
+            if (ports[role] == 0 || (role == STATS && i > 0))
+                continue;
+            r->listener[role] = open_listener(r, ports[role], role);
+#ifndef USE_IO_URING
+            // listen_fd should be only read from
+            if (ev_add(r->loop, r->listener[role]->conn_fd, EV_READ, r->listener[role]) < 0)
+                ERR_EXIT("ev_add");
+#endif
+        }
     }
-    requestP[svr.listen_fd].conn_fd = svr.listen_fd;
-    strcpy(requestP[svr.listen_fd].host, svr.hostname);
+    svr.listen_fd = reactors[0].listener[read_port ? READER : WRITER]->conn_fd;
+    // restart: client numbers go on from the old process's (its last message)
+    int n;
+    handoff_item* items = handoff_items(&n);
+    if (n > 0)
+        atomic_store(&num_conn, items[n - 1].m.next_client);
 
     return;
 }
 
-void run_server(void) {
+#ifdef USE_IO_URING
+static void arm_accept(request* listener) {
+    if (uring_accept_multishot(&self->ring, listener->conn_fd, op_data(listener, OP_ACCEPT)) < 0)
+        stall(listener, "io_uring accept");
+}
 
-    fds = (struct pollfd *) malloc(sizeof(struct pollfd) * (maxfd+1)); // TODO: optimized
-    nfd = 1; 
-    fds[0].fd = svr.listen_fd;
-    fds[0].events = POLLIN; // svr.listen_fd should be only read from
+// Queues again what found the ring full, in the room the completions left
+static void retry_stalled(void) {
+    request* list = self->stalled;
+    // a request that finds it full again goes back on self->stalled
+    self->stalled = NULL;
+    if (list != NULL)
+        list->stalled_pprev = &list;
+    while (list != NULL) {
+        request* reqP = list;
+        unstall(reqP);
+        if (reqP->status == LISTEN)
+            arm_accept(reqP);
+        else if (reqP->status != CLOSED)
+            flush_conn(reqP);
+    }
+}
 
-    while (1) {
-        int timeout = calculate_timeout();
-        fprintf(stderr, "Timeout: %d\n", timeout);
-        // poll should return either
-        // 1. Some fds are ready
-        // 2. Some fds are expired and should be cleaned up
-        int ready = poll(fds, nfd, timeout);
-        if(ready == -1)
-            ERR_EXIT("poll");
-        for(nfds_t i = 0; i < nfd; i++) {
-            int conn_fd = fds[i].fd;
-            if(fds[i].revents == POLLIN) {
-                if(conn_fd == svr.listen_fd) {
-                    int new_fd = accept_conn();
-                    if (new_fd < 0)
-                        ERR_EXIT("cannot get new connection\n");
-                    fds[nfd].fd = new_fd;
-                    fds[nfd].events = POLLOUT; // POLLOUT newly added fd
-                    nfd++;
-                } else {
-                    process_client_request(conn_fd);
-                    fds[i].events = POLLOUT;
-                }
-            }
-            if(fds[i].revents == POLLOUT) {
-                // closing connection
-                if(requestP[conn_fd].status == INVALID) {
-                    fprintf(stderr, "invalid operation, closing fd %d\n", requestP[conn_fd].conn_fd);
-                    write(requestP[conn_fd].conn_fd, invalid_op_msg, strlen(invalid_op_msg));
-                    unlock_unpaid_seat(&requestP[conn_fd]);
-                    close(requestP[conn_fd].conn_fd);
-                    clear_request(&requestP[conn_fd]);
-                    fds[i].fd = -1; // TODO3: fd collection
-                } else if(requestP[conn_fd].status == EXIT) {
-                    fprintf(stderr, "fd: %d closed, bye bye!\n", requestP[conn_fd].conn_fd);
-                    write(requestP[conn_fd].conn_fd, exit_msg, strlen(exit_msg));
-                    unlock_unpaid_seat(&requestP[conn_fd]);
-                    close(requestP[conn_fd].conn_fd);
-                    clear_request(&requestP[conn_fd]);
-                    fds[i].fd = -1; // TODO3: fd collection
-                } else {
-                    response_client_request(conn_fd);
-                    fds[i].events = POLLIN;
-                }
+static void accept_completed(request* listener, const struct io_uring_cqe* cqe) {
+    if (cqe->res >= 0) {
+        // the address, for the rate limit (one buffer would not do for
+        // the completions of a multishot accept)
+        struct sockaddr_in cliaddr;
+        socklen_t clilen = sizeof(cliaddr);
+        bool named = getpeername(cqe->res, (struct sockaddr*)&cliaddr, &clilen) == 0;
+        if (admit(listener, cqe->res, named ? &cliaddr : NULL)) {
+            request* conn = new_conn(listener->role, cqe->res, named ? &cliaddr : NULL);
+            if (conn != NULL)
+                greet(conn);
+        }
+    } else if (cqe->res == -EMFILE || cqe->res == -ENFILE || cqe->res == -ENOBUFS || cqe->res == -ENOMEM) {
+        shed_one(listener);
+    } else if (cqe->res != -ECONNABORTED && cqe->res != -EINTR) {
+        log_warn("accept: %s\n", strerror(-cqe->res));
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) // the kernel stopped accepting
+        arm_accept(listener);
+}
+
+static void recv_completed(request* reqP, const struct io_uring_cqe* cqe) {
+    if (cqe->res == -ENOBUFS) { // every buffer taken, queued again
+        flush_conn(reqP);
+        return;
+    }
+    if (cqe->res < 0) {
+        log_debug("connection error, closing fd %d\n", reqP->conn_fd);
+        close_conn(reqP, NULL);
+        return;
+    }
+    int ret = 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        ret = handle_input(reqP, uring_buf(&self->bufs, cqe), cqe->res);
+        uring_buf_recycle(&self->bufs, cqe);
+    }
+    serve_received(reqP, ret);
+}
+
+static void send_completed(request* reqP, int res) {
+    if (res > 0) {
+        outq_consume(&reqP->out, res);
+    } else if (res != -ECANCELED) { // an earlier send of the chain failed
+        log_debug("write error, closing fd %d\n", reqP->conn_fd);
+        close_conn(reqP, NULL);
+        return;
+    }
+    if (reqP->sending == 0) // the rest, if a send came up short
+        flush_conn(reqP);
+}
+
+static void handle_completion(const struct io_uring_cqe* cqe) {
+    request* reqP = (request*) (uintptr_t) (cqe->user_data & ~(uint64_t) OP_MASK);
+    int op = cqe->user_data & OP_MASK;
+    if (reqP == NULL) // stop_fd readable, see stop_reactor
+        return;
+    if (op == OP_ACCEPT) {
+        accept_completed(reqP, cqe);
+        return;
+    }
+    reqP->inflight--;
+    if (op == OP_RECV)
+        reqP->receiving = false;
+    else
+        reqP->sending--;
+    if (reqP->status == CLOSED) {
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+            uring_buf_recycle(&self->bufs, cqe);
+        if (op == OP_SEND && cqe->res > 0)
+            outq_consume(&reqP->out, cqe->res);
+        if (op == OP_SEND && reqP->sending == 0) // the chain closing waited for
+            shut_conn(reqP);
+        else if (reqP->inflight == 0)
+            free_conn(reqP);
+        return;
+    }
+    if (op == OP_RECV)
+        recv_completed(reqP, cqe);
+    else
+        send_completed(reqP, cqe->res);
+}
+
+static void start_reactor(void) {
+    // set up by the thread that submits to it
+    if (uring_init(&self->ring, URING_ENTRIES) < 0)
+        ERR_EXIT("io_uring_setup");
+    if (uring_bufs_init(&self->ring, &self->bufs, 0, URING_BUFS, RING_SIZE) < 0)
+        ERR_EXIT("io_uring buffer ring");
+    for (int role = READER; role <= STATS; role++)
+        if (self->listener[role] != NULL)
+            arm_accept(self->listener[role]);
+    if (uring_poll(&self->ring, stop_fd, op_data(NULL, 0)) < 0)
+        ERR_EXIT("io_uring poll");
+}
+
+// Submits what was queued, waits for completions and handles them
+// Return -1 on error
+static int serve_events(int timeout) {
+    if (uring_wait(&self->ring, timeout) < 0)
+        return -1;
+    self->now = monotonic_ms();
+    struct io_uring_cqe* cqe;
+    while ((cqe = uring_peek(&self->ring)) != NULL) {
+        struct io_uring_cqe done = *cqe;
+        uring_seen(&self->ring);
+        handle_completion(&done);
+    }
+    retry_stalled();
+    return 0;
+}
+#else
+// Accepts until the backlog is empty, MAX_EVENTS at most so that a storm
+// of new connections does not keep the reactor from its clients. An error
+// never ends the server: the backlog is left for the next wakeup.
+static void accept_conns(request* listener) {
+    for (int i = 0; i < MAX_EVENTS; i++) {
+        struct sockaddr_in cliaddr;
+        socklen_t clilen = sizeof(cliaddr);
+        int conn_fd = accept4(listener->conn_fd, (struct sockaddr*)&cliaddr, &clilen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (conn_fd < 0) {
+            switch (errno) {
+            case EAGAIN:
+                return;
+            // gone already, or a network error pending on it (accept(2))
+            case EINTR: case ECONNABORTED: case EPROTO: case ENETDOWN: case ENOPROTOOPT:
+            case EHOSTDOWN: case ENONET: case EHOSTUNREACH: case EOPNOTSUPP: case ENETUNREACH:
+                continue;
+            case EMFILE: case ENFILE: case ENOBUFS: case ENOMEM:
+                shed_one(listener);
+                return;
+            default:
+                log_error("accept: %s\n", strerror(errno));
+                return;
             }
         }
+        if (!admit(listener, conn_fd, &cliaddr))
+            continue;
+        request* conn = new_conn(listener->role, conn_fd, &cliaddr);
+        if (conn == NULL)
+            continue;
+        if (ev_add(self->loop, conn->conn_fd, EV_READ, conn) < 0) {
+            log_warn("ev_add: %s, closing fd %d\n", strerror(errno), conn->conn_fd);
+            close_conn(conn, NULL);
+            continue;
+        }
+        conn->events = EV_READ;
+        greet(conn);
+    }
+}
+
+static void start_reactor(void) {
+}
 
+// Waits for ready fds and serves them, return -1 on error
+static int serve_events(int timeout) {
+    ev_event events[MAX_EVENTS];
+    // ev_wait should return either
+    // 1. Some fds are ready
+    // 2. Some fds are expired and should be cleaned up
+    int ready = ev_wait(self->loop, events, MAX_EVENTS, timeout);
+    if(ready == -1)
+        return -1;
+    self->now = monotonic_ms();
+    // one event per fd: a request closed (and freed) while handling
+    // its event has no other event in the batch
+    for(int i = 0; i < ready; i++) {
+        request* reqP = (request*) events[i].data;
+        if (reqP == NULL) // restart_fd or stop_fd, see hand_over and stop_reactor
+            continue;
+        int conn_fd = reqP->conn_fd;
+        if(reqP->status == LISTEN) {
+            accept_conns(reqP);
+            continue;
+        }
+        if(events[i].events & EV_ERROR) {
+            log_debug("connection error, closing fd %d\n", conn_fd);
+            close_conn(reqP, NULL);
+            continue;
+        }
+        // A command is answered right away, EV_WRITE only comes up
+        // while a client does not take its answers as fast as they come
+        if(events[i].events & EV_READ) {
+            log_debug("Handle [POLLIN] for conn_fd: %d\n", conn_fd);
+            serve_received(reqP, handle_read(reqP));
+        }
+        else if(events[i].events & EV_WRITE) {
+            flush_conn(reqP);
+        }
+    }
+    return 0;
+}
+#endif
+
+static void* reactor_main(void* arg) {
+    self = (reactor*) arg;
+    metrics_attach(self->id);
+    start_reactor();
+
+    self->now = monotonic_ms();
+#ifndef USE_IO_URING
+    adopt_conns();
+#endif
+    while (1) {
+        // return timeout in millisecond, -1 (wait indefinitely) without clients
+        int timeout = timer_next_timeout(&self->timers, self->now);
+        if (watch_active()) {
+            int due = self->next_watch > self->now ? self->next_watch - self->now : 0;
+            if (timeout < 0 || timeout > due)
+                timeout = due;
+        }
+        if (self->n_waiting > 0) // payments queued while answering the last batch
+            timeout = 0;
+#ifdef USE_IO_URING
+        if (self->stalled != NULL && (timeout < 0 || timeout > URING_RETRY_MS))
+            timeout = URING_RETRY_MS;
+#endif
+        log_debug("Timeout: %d\n", timeout);
+        if (serve_events(timeout) < 0)
+            ERR_EXIT("serve_events");
+
+        if (self->n_waiting > 0)
+            commit_payments();
         clean_expired_client();
+        // one render per changed train, whatever the number of watchers
+        if (watch_active() && self->now >= self->next_watch) {
+            watch_poll(push_changes);
+            self->next_watch = self->now + WATCH_POLL_MS;
+        }
+#ifndef USE_IO_URING
+        if (atomic_load(&restart_requested) && self->n_waiting == 0)
+            hand_over();
+#endif
+        if (atomic_load(&stop_signal) && self->n_waiting == 0)
+            stop_reactor();
 
     }
 
-    free(requestP);
-    free(fds);
-    close(svr.listen_fd);
-    for (int i = 0;i < TRAIN_NUM; i++)
-        close(trains[i].file_fd);
-}
\ No newline at end of file
+    return NULL;
+}
+
+void run_server(void) {
+#ifdef USE_IO_URING
+    log_info("event loop backend: io_uring, %d reactor(s)\n", num_reactors);
+#else
+    log_info("event loop backend: %s, %d reactor(s)\n", ev_backend(), num_reactors);
+#endif
+#ifdef USE_IO_URING
+    handoff_done(); // connections handed over by an epoll build are not taken, closed
+#endif
+    // reactor 0 runs on the main thread
+    for (int i = 1; i < num_reactors; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, reactor_main, &reactors[i]) != 0)
+            ERR_EXIT("pthread_create");
+    }
+    reactor_main(&reactors[0]);
+
+    for (int i = 1; i < num_reactors; i++)
+        pthread_join(reactors[i].thread, NULL);
+    for (int i = 0; i < num_reactors; i++) {
+#ifdef USE_IO_URING
+        uring_free(&reactors[i].ring);
+        uring_bufs_free(&reactors[i].bufs);
+#else
+        ev_destroy(reactors[i].loop);
+#endif
+        timer_heap_free(&reactors[i].timers);
+        admit_free(&reactors[i].admit);
+        free(reactors[i].waiting);
+        for (int role = READER; role <= STATS; role++)
+            if (reactors[i].listener[role] != NULL)
+                close(reactors[i].listener[role]->conn_fd);
+        slab_pool_destroy(&reactors[i].conns);
+    }
+    free(reactors);
+}
@@ -3,16 +3,32 @@
 
 #include "common.h"
 #define ERR_EXIT(a) do { perror(a); exit(1); } while(0)
+#define MAX_EVENTS 256 // events handled per wakeup
+#define CONN_TIMEOUT_MS 5000 // a connection is closed 5 sec after accept
+#define LEASE_GRACE_MS 1000 // seat locks outlive their connection by this much
+#define OUTQ_LIMIT 65536 // a client with this much output queued is not read from
+#define SEND_GRACE_MS 1000 // io_uring: sends under way at close have this long to go out
+#define URING_ENTRIES 4096 // io_uring submission queue of a reactor
+#define URING_RETRY_MS 1 // io_uring: longest wait while requests found the ring full
+#ifndef MAX_CONNS
+#define MAX_CONNS 10000 // open at once (fewer if the fd limit is lower), more are turned away
+#endif
+#ifndef ADMIT_RATE
+#define ADMIT_RATE 200 // new connections per second a client address may open
+#endif
+#ifndef ADMIT_BURST
+#define ADMIT_BURST 1000 // ... and at once
+#endif
+#define FD_RESERVE 64 // fds kept out of MAX_CONNS for listeners, journal, log, ...
+#define URING_BUFS 256 // recv buffers of a reactor (RING_SIZE bytes), power of two
 
 // Global variables
 extern server svr;
 extern int maxfd;
-extern request* requestP;
-extern struct pollfd *fds;
 
 // Interface
-void init_db(void);
-void init_server(unsigned short port);
+void init_db(bool writable);
+void init_server(unsigned short read_port, unsigned short write_port, unsigned short stats_port, int threads);
 void run_server(void);
 
 #endif
@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "slab.h"
+
+#define CACHE_LINE 64
+_Static_assert((SLAB_SIZE & (SLAB_SIZE - 1)) == 0, "SLAB_SIZE is a power of two");
+
+// Block header, the objects follow from the next cache line
+struct slab {
+    slab* prev;
+    slab* next;
+    void* free;             // freed objects, linked through their first word
+    int fresh;              // objects never handed out start here
+    int used;
+};
+
+#define FIRST_OBJ ((sizeof(slab) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+
+static slab* slab_of(void* obj) {
+    return (slab*) ((uintptr_t) obj & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+static void unlink_slab(slab** list, slab* s) {
+    if (s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        *list = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+}
+
+static void push_slab(slab** list, slab* s) {
+    s->prev = NULL;
+    s->next = *list;
+    if (*list != NULL)
+        (*list)->prev = s;
+    *list = s;
+}
+
+void slab_pool_init(slab_pool* pool, size_t obj_size) {
+    pool->obj_size = (obj_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    pool->per_slab = (SLAB_SIZE - FIRST_OBJ) / pool->obj_size;
+    pool->partial = pool->full = pool->empty = NULL;
+    pool->in_use = 0;
+    pool->slabs = 0;
+}
+
+static void free_list(slab* s) {
+    while (s != NULL) {
+        slab* next = s->next;
+        free(s);
+        s = next;
+    }
+}
+
+void slab_pool_destroy(slab_pool* pool) {
+    free_list(pool->partial);
+    free_list(pool->full);
+    free(pool->empty);
+    slab_pool_init(pool, pool->obj_size);
+}
+
+void* slab_alloc(slab_pool* pool) {
+    slab* s = pool->partial;
+    if (s == NULL) {
+        if (pool->per_slab < 1)
+            return NULL; // larger than a block
+        if ((s = pool->empty) != NULL) {
+            pool->empty = NULL;
+        } else {
+            if ((s = (slab*) aligned_alloc(SLAB_SIZE, SLAB_SIZE)) == NULL)
+                return NULL;
+            s->free = NULL;
+            s->fresh = 0;
+            s->used = 0;
+            pool->slabs++;
+        }
+        push_slab(&pool->partial, s);
+    }
+    void* obj;
+    if (s->free != NULL) {
+        obj = s->free;
+        s->free = *(void**) obj;
+    } else {
+        obj = (char*) s + FIRST_OBJ + (size_t) s->fresh++ * pool->obj_size;
+    }
+    if (++s->used == pool->per_slab) {
+        unlink_slab(&pool->partial, s);
+        push_slab(&pool->full, s);
+    }
+    pool->in_use++;
+    return obj;
+}
+
+void slab_free(slab_pool* pool, void* obj) {
+    slab* s = slab_of(obj);
+    *(void**) obj = s->free;
+    s->free = obj;
+    pool->in_use--;
+    if (s->used-- == pool->per_slab) {
+        unlink_slab(&pool->full, s);
+        push_slab(&pool->partial, s);
+    }
+    if (s->used > 0)
+        return;
+    unlink_slab(&pool->partial, s);
+    if (pool->empty == NULL) {
+        pool->empty = s;
+    } else {
+        free(s);
+        pool->slabs--;
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+// Pool of fixed-size objects (connections) carved out of SLAB_SIZE blocks.
+// A block is allocated when every object in use is taken and given back
+// once all of its objects are free again (one empty block is kept to absorb
+// churn), so the memory follows the live objects. An object finds its
+// block by masking its address. Not thread-safe: one pool per reactor.
+
+#define SLAB_SIZE (64 * 1024) // power of two
+
+typedef struct slab slab;
+
+typedef struct {
+    size_t obj_size;        // rounded up to a cache line
+    int per_slab;
+    slab* partial;          // blocks with free objects, allocated from first
+    slab* full;
+    slab* empty;            // at most one block with no object in use
+    size_t in_use;          // objects handed out
+    size_t slabs;           // blocks held
+} slab_pool;
+
+void slab_pool_init(slab_pool* pool, size_t obj_size);
+// Frees every block, objects still in use included
+void slab_pool_destroy(slab_pool* pool);
+
+// Uninitialized object, NULL out of memory
+void* slab_alloc(slab_pool* pool);
+void slab_free(slab_pool* pool, void* obj);
+
+#endif
@@ -0,0 +1,107 @@
+// Journal replay past damaged records
+//
+// usage: ./test_journal
+//
+// Works on a train directory of its own under /tmp, one shift of 8 seats.
+// Writes a journal with a torn record (a crash in the middle of a write),
+// a damaged one and one for a seat the shift does not have between good
+// ones, and checks that every good record is replayed and the journal is
+// emptied. Then a commit cut short by the file size limit has to leave
+// nothing behind. Exits 1 if any check failed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "seat_table.h"
+#include "catalog.h"
+#include "checks.h"
+
+#define SHIFT 902002
+
+static int applied[16];
+static int n_applied;
+
+static void apply(int shift_id, int seat) {
+    CHECK(shift_id == SHIFT);
+    if (n_applied < 16)
+        applied[n_applied] = seat;
+    n_applied++;
+}
+
+// A record as journal_add makes it (same checksum)
+static journal_record make_record(int seat) {
+    journal_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.time_ms = 1700000000000LL + seat;
+    rec.shift_id = SHIFT;
+    rec.seat = seat;
+    rec.client_id = seat;
+    const unsigned char* p = (const unsigned char*) &rec;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < offsetof(journal_record, check); i++)
+        h = (h ^ p[i]) * 16777619u;
+    rec.check = h;
+    return rec;
+}
+
+int main(void) {
+    char dir[] = "/tmp/test_journal.XXXXXX";
+    char path[PATH_MAX];
+    if (mkdtemp(dir) == NULL || chdir(dir) < 0 || mkdir(TRAIN_DIR, 0755) < 0) {
+        perror(dir);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/train_%d", TRAIN_DIR, SHIFT);
+    write_file(path, "0 0 0 0\n0 0 0 0\n");
+    write_file(CATALOG_PATH, "902002 8\n");
+    if (catalog_load(CATALOG_PATH) < 0 || seat_table_init(true) < 0) {
+        perror("seat table");
+        return 1;
+    }
+
+    journal_record good[4] = { make_record(5), make_record(6), make_record(7), make_record(8) };
+    journal_record damaged = make_record(2), no_seat = make_record(9);
+    damaged.seat = 3; // checksum no longer matches
+    FILE* f = fopen(JOURNAL_PATH, "w");
+    fwrite(&good[0], sizeof(journal_record), 1, f);
+    fwrite(&good[1], 10, 1, f); // torn: every record after it is off by 10 bytes
+    fwrite(&good[2], sizeof(journal_record), 1, f);
+    fwrite(&damaged, sizeof(journal_record), 1, f);
+    fwrite(&no_seat, sizeof(journal_record), 1, f);
+    fwrite(&good[3], sizeof(journal_record), 1, f);
+    CHECK(fclose(f) == 0);
+
+    CHECK(journal_open(apply) == 3);
+    CHECK(n_applied == 3 && applied[0] == 5 && applied[1] == 7 && applied[2] == 8);
+    struct stat st;
+    CHECK(stat(JOURNAL_PATH, &st) == 0 && st.st_size == 0); // checkpointed
+
+    // room for 2 records and a bit: the write of 3 stops in the middle of one
+    struct rlimit unlimited, limit = { 2 * sizeof(journal_record) + 10, RLIM_INFINITY };
+    getrlimit(RLIMIT_FSIZE, &unlimited);
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &limit);
+    for (int seat = 1; seat <= 3; seat++)
+        journal_add(SHIFT, seat, seat);
+    CHECK(journal_commit() < 0);
+    journal_release();
+    CHECK(stat(JOURNAL_PATH, &st) == 0 && st.st_size == 0);
+    setrlimit(RLIMIT_FSIZE, &unlimited);
+    journal_add(SHIFT, 4, 4);
+    CHECK(journal_commit() == 0);
+    journal_release();
+    CHECK(stat(JOURNAL_PATH, &st) == 0 && st.st_size == sizeof(journal_record));
+
+    seat_release_all();
+    unlink(JOURNAL_PATH);
+    unlink(CATALOG_PATH);
+    unlink(path);
+    rmdir(TRAIN_DIR);
+    chdir("/");
+    rmdir(dir);
+    if (!failed)
+        printf("journal: ok\n");
+    return failed;
+}
@@ -0,0 +1,109 @@
+// Seat lock ownership between connections of one process
+//
+// usage: ./test_seat_table
+//
+// Works on a train directory of its own under /tmp, one shift of 8 seats,
+// and removes it (lock segment included) when done. Exits 1 if any
+// check failed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "seat_table.h"
+#include "catalog.h"
+#include "timer.h"
+#include "bitset.h"
+#include "checks.h"
+
+#define SHIFT 902001
+
+// The lock segments of the train directory, whatever their catalog
+static void unlink_segments(void) {
+    struct stat st;
+    char prefix[NAME_MAX];
+    if (stat(TRAIN_DIR, &st) < 0)
+        return;
+    int len = snprintf(prefix, sizeof(prefix), "csie_trains.%lu.%lu.", (unsigned long) st.st_dev,
+                       (unsigned long) st.st_ino);
+    DIR* d = opendir("/dev/shm");
+    struct dirent* e;
+    while (d != NULL && (e = readdir(d)) != NULL) {
+        char name[NAME_MAX + 2];
+        if (strncmp(e->d_name, prefix, len) != 0)
+            continue;
+        snprintf(name, sizeof(name), "/%s", e->d_name);
+        shm_unlink(name);
+    }
+    if (d != NULL)
+        closedir(d);
+}
+
+int main(void) {
+    char dir[] = "/tmp/test_seat_table.XXXXXX";
+    char path[PATH_MAX];
+    if (mkdtemp(dir) == NULL || chdir(dir) < 0 || mkdir(TRAIN_DIR, 0755) < 0) {
+        perror(dir);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/train_%d", TRAIN_DIR, SHIFT);
+    write_file(path, "0 0 0 0\n0 0 0 0\n");
+    write_file(CATALOG_PATH, "902001 8\n");
+    if (catalog_load(CATALOG_PATH) < 0 || seat_table_init(true) < 0 || seat_table_open(0) < 0) {
+        perror("seat table");
+        return 1;
+    }
+
+    // two connections accepted in the same millisecond: same deadline,
+    // hence the same lease, and still two owners
+    uint64_t a = seat_lock_owner(), b = seat_lock_owner();
+    long lease = monotonic_ms() + 5000;
+    CHECK(a != b);
+    CHECK(seat_try_lock(0, 7, a, lease) == SEAT_FREE);
+    CHECK(seat_try_lock(0, 7, a, lease) == SEAT_FREE); // already ours
+    CHECK(seat_try_lock(0, 7, b, lease) == SEAT_LOCKED);
+    CHECK(seat_state(0, 7) == SEAT_LOCKED);
+    uint64_t want[SEAT_WORDS] = {0}, taken[SEAT_WORDS];
+    bit_set(want, 6);
+    bit_set(want, 7);
+    CHECK(seat_try_lock_all(0, want, b, lease, taken) == 1 && bit_test(taken, 6) && !bit_test(taken, 7));
+    CHECK(seat_state(0, 8) == SEAT_FREE); // nothing of a failed all-or-none is kept
+    seat_unlock(0, 7, b); // not b's, stays locked
+    CHECK(seat_state(0, 7) == SEAT_LOCKED);
+    CHECK(!seat_book(0, 7, b));
+    CHECK(seat_state(0, 7) == SEAT_LOCKED);
+    CHECK(seat_book(0, 7, a));
+    CHECK(seat_state(0, 7) == SEAT_BOOKED);
+    CHECK(seat_try_lock(0, 7, b, lease) == SEAT_BOOKED);
+
+    // a lease that ran out is taken over, the old owner cannot book
+    uint64_t c = seat_lock_owner();
+    CHECK(seat_try_lock(0, 3, c, monotonic_ms() - 1) == SEAT_FREE);
+    CHECK(seat_state(0, 3) == SEAT_FREE);
+    CHECK(seat_try_lock(0, 3, b, lease) == SEAT_FREE);
+    CHECK(!seat_book(0, 3, c));
+    CHECK(seat_try_lock(0, 3, c, lease) == SEAT_LOCKED);
+    CHECK(seat_book(0, 3, b));
+
+    // a restart hands the owner over: the old word is gone, the lease stays
+    uint64_t old = (uint64_t) (getpid() + 1) << 32 | (uint32_t) seat_lock_owner();
+    CHECK(seat_try_lock(0, 1, old, lease) == SEAT_FREE);
+    CHECK(seat_adopt(0, 1, old));
+    CHECK(!seat_adopt(0, 1, old));
+    CHECK(!seat_book(0, 1, old));
+    CHECK(seat_state(0, 1) == SEAT_LOCKED);
+    CHECK(seat_try_lock(0, 1, b, lease) == SEAT_LOCKED);
+    seat_unlock(0, 1, seat_adopted(old));
+    CHECK(seat_state(0, 1) == SEAT_FREE);
+
+    seat_release_all();
+    unlink_segments();
+    unlink(CATALOG_PATH);
+    unlink(path);
+    rmdir(TRAIN_DIR);
+    chdir("/");
+    rmdir(dir);
+    if (!failed)
+        printf("seat table: ok\n");
+    return failed;
+}
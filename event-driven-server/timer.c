@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include "timer.h"
+
+static void place(timer_heap* heap, int i, timer_node* node) {
+    heap->nodes[i] = node;
+    node->index = i;
+}
+
+static void sift_up(timer_heap* heap, int i) {
+    timer_node* node = heap->nodes[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap->nodes[parent]->deadline <= node->deadline)
+            break;
+        place(heap, i, heap->nodes[parent]);
+        i = parent;
+    }
+    place(heap, i, node);
+}
+
+static void sift_down(timer_heap* heap, int i) {
+    timer_node* node = heap->nodes[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= heap->size)
+            break;
+        if (child + 1 < heap->size && heap->nodes[child + 1]->deadline < heap->nodes[child]->deadline)
+            child++;
+        if (node->deadline <= heap->nodes[child]->deadline)
+            break;
+        place(heap, i, heap->nodes[child]);
+        i = child;
+    }
+    place(heap, i, node);
+}
+
+int timer_heap_init(timer_heap* heap, int cap) {
+    heap->nodes = (timer_node**) malloc(sizeof(timer_node*) * cap);
+    heap->size = 0;
+    heap->cap = cap;
+    return heap->nodes == NULL ? -1 : 0;
+}
+
+void timer_heap_free(timer_heap* heap) {
+    free(heap->nodes);
+    heap->nodes = NULL;
+    heap->size = heap->cap = 0;
+}
+
+void timer_node_init(timer_node* node) {
+    node->deadline = -1;
+    node->index = -1;
+}
+
+void timer_arm(timer_heap* heap, timer_node* node, long deadline) {
+    if (node->index < 0) {
+        if (heap->size == heap->cap) {
+            int cap = heap->cap ? heap->cap * 2 : 64;
+            timer_node** nodes = (timer_node**) realloc(heap->nodes, sizeof(timer_node*) * cap);
+            if (nodes == NULL)
+                abort();
+            heap->nodes = nodes;
+            heap->cap = cap;
+        }
+        node->deadline = deadline;
+        place(heap, heap->size++, node);
+        sift_up(heap, node->index);
+        return;
+    }
+    long old = node->deadline;
+    node->deadline = deadline;
+    if (deadline < old)
+        sift_up(heap, node->index);
+    else
+        sift_down(heap, node->index);
+}
+
+void timer_cancel(timer_heap* heap, timer_node* node) {
+    int i = node->index;
+    if (i < 0)
+        return;
+    node->index = -1;
+    timer_node* last = heap->nodes[--heap->size];
+    if (last == node)
+        return;
+    // the last node fills the hole and moves whichever way it belongs
+    place(heap, i, last);
+    sift_down(heap, i);
+    if (last->index == i)
+        sift_up(heap, i);
+}
+
+timer_node* timer_peek(const timer_heap* heap) {
+    return heap->size > 0 ? heap->nodes[0] : NULL;
+}
+
+timer_node* timer_pop_expired(timer_heap* heap, long now) {
+    timer_node* node = timer_peek(heap);
+    if (node == NULL || node->deadline > now)
+        return NULL;
+    timer_cancel(heap, node);
+    return node;
+}
+
+int timer_next_timeout(const timer_heap* heap, long now) {
+    timer_node* node = timer_peek(heap);
+    if (node == NULL)
+        return -1;
+    long timeout = node->deadline - now;
+    if (timeout < 0)
+        return 0;
+    return timeout > INT_MAX ? INT_MAX : (int) timeout;
+}
+
+long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,41 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+
+// Indexed binary min-heap of deadlines. Nodes are embedded in the owner
+// (request.timer) and remember their heap slot, so arm / cancel / re-arm
+// are O(log n) without searching, and expiry only touches expired nodes.
+// Times are CLOCK_MONOTONIC milliseconds.
+
+typedef struct {
+    long deadline;      // ms, meaningful while armed
+    int index;          // slot in the heap, -1 when not armed
+} timer_node;
+
+typedef struct {
+    timer_node** nodes;
+    int size;
+    int cap;
+} timer_heap;
+
+// Owner of an embedded node, e.g. timer_owner(node, request, timer)
+#define timer_owner(node, type, member) ((type*)((char*)(node) - offsetof(type, member)))
+
+int timer_heap_init(timer_heap* heap, int cap); // 0 on success, -1 out of memory
+void timer_heap_free(timer_heap* heap);
+
+void timer_node_init(timer_node* node);
+// Arms (or moves) node to fire at deadline
+void timer_arm(timer_heap* heap, timer_node* node, long deadline);
+void timer_cancel(timer_heap* heap, timer_node* node);
+// Earliest node, NULL if the heap is empty
+timer_node* timer_peek(const timer_heap* heap);
+// Removes and returns the earliest node whose deadline <= now, NULL if none
+timer_node* timer_pop_expired(timer_heap* heap, long now);
+// Milliseconds until the earliest deadline (0 if already due), -1 if empty
+int timer_next_timeout(const timer_heap* heap, long now);
+
+long monotonic_ms(void);
+
+#endif
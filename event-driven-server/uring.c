@@ -0,0 +1,229 @@
+#ifdef USE_IO_URING
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params* p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void* arg, size_t size) {
+    return (int) syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, size);
+}
+
+static int sys_register(int fd, unsigned op, void* arg, unsigned n) {
+    return (int) syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+int uring_init(uring* u, unsigned entries) {
+    struct io_uring_params p;
+    memset(u, 0, sizeof(uring));
+    memset(&p, 0, sizeof(p));
+    // completions posted while the thread waits for them, not by interrupts
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    if ((u->fd = sys_setup(entries, &p)) < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        u->fd = sys_setup(entries, &p);
+    }
+    if (u->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(u->fd);
+        errno = ENOSYS; // kernel older than 5.11
+        return -1;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    u->ring_map = mmap(NULL, u->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring_map == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*) mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        munmap(u->ring_map, u->ring_len);
+        close(u->fd);
+        return -1;
+    }
+    char* ring = (char*) u->ring_map;
+    u->sq_head = (unsigned*) (ring + p.sq_off.head);
+    u->sq_tail = (unsigned*) (ring + p.sq_off.tail);
+    u->sq_mask = *(unsigned*) (ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_array = (unsigned*) (ring + p.sq_off.array);
+    // slot i of the array always names SQE i
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        u->sq_array[i] = i;
+    u->cq_head = (unsigned*) (ring + p.cq_off.head);
+    u->cq_tail = (unsigned*) (ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned*) (ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*) (ring + p.cq_off.cqes);
+    return 0;
+}
+
+void uring_free(uring* u) {
+    munmap(u->sqes, u->sqes_len);
+    munmap(u->ring_map, u->ring_len);
+    close(u->fd);
+}
+
+static int submit(uring* u, unsigned wait, unsigned flags, void* arg, size_t size) {
+    int ret = sys_enter(u->fd, u->queued, wait, flags, arg, size);
+    if (ret < 0)
+        return -1;
+    u->queued -= (unsigned) ret < u->queued ? (unsigned) ret : u->queued;
+    return 0;
+}
+
+static unsigned room(uring* u) {
+    return u->sq_entries - (*u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE));
+}
+
+// Makes room for n SQEs, handing what is queued over if needed
+static int reserve(uring* u, unsigned n) {
+    if (room(u) >= n)
+        return 0;
+    if (submit(u, 0, 0, NULL, 0) < 0 && errno != EINTR)
+        return -1;
+    if (room(u) < n) {
+        errno = EBUSY;
+        return -1;
+    }
+    return 0;
+}
+
+// Zeroed SQE, published to the kernel at the next io_uring_enter
+static struct io_uring_sqe* get_sqe(uring* u) {
+    if (reserve(u, 1) < 0)
+        return NULL;
+    unsigned tail = *u->sq_tail;
+    struct io_uring_sqe* sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return sqe;
+}
+
+int uring_accept_multishot(uring* u, int fd, uint64_t user_data) {
+    struct io_uring_sqe* sqe = get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_poll(uring* u, int fd, uint64_t user_data) {
+    struct io_uring_sqe* sqe = get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_recv(uring* u, int fd, uring_bufs* b, unsigned len, uint64_t user_data) {
+    struct io_uring_sqe* sqe = get_sqe(u);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = len < b->size ? len : b->size;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = b->bgid;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int uring_send_chain(uring* u, int fd, const struct iovec* iov, int n, uint64_t user_data) {
+    if (n > (int) u->sq_entries || reserve(u, n) < 0)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        struct io_uring_sqe* sqe = get_sqe(u);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) iov[i].iov_base;
+        sqe->len = iov[i].iov_len;
+        // retried until all is sent: a short send would cut the chain
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->flags = i < n - 1 ? IOSQE_IO_LINK : 0;
+        sqe->user_data = user_data;
+    }
+    return 0;
+}
+
+int uring_wait(uring* u, int timeout) {
+    struct __kernel_timespec ts = { timeout / 1000, (timeout % 1000) * 1000000LL };
+    struct io_uring_getevents_arg arg = {
+        .sigmask = 0,
+        .sigmask_sz = _NSIG / 8,
+        .ts = timeout < 0 ? 0 : (uint64_t) (uintptr_t) &ts,
+    };
+    unsigned wait = timeout == 0 ? 0 : 1;
+    if (submit(u, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0)
+        return errno == ETIME || errno == EINTR || errno == EBUSY ? 0 : -1;
+    return 0;
+}
+
+int uring_bufs_init(uring* u, uring_bufs* b, unsigned short bgid, unsigned entries, size_t size) {
+    memset(b, 0, sizeof(uring_bufs));
+    b->map_len = entries * (sizeof(struct io_uring_buf) + size);
+    void* map = mmap(NULL, b->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    // the ring of buffer descriptors, page aligned, then the buffers
+    b->br = (struct io_uring_buf_ring*) map;
+    b->data = (char*) map + entries * sizeof(struct io_uring_buf);
+    b->size = size;
+    b->entries = entries;
+    b->bgid = bgid;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) b->br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(map, b->map_len);
+        return -1;
+    }
+    for (unsigned i = 0; i < entries; i++) {
+        struct io_uring_buf* buf = &b->br->bufs[i];
+        buf->addr = (uint64_t) (uintptr_t) (b->data + i * size);
+        buf->len = size;
+        buf->bid = i;
+    }
+    b->tail = entries;
+    __atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void uring_bufs_free(uring_bufs* b) {
+    munmap(b->br, b->map_len);
+}
+
+void uring_buf_recycle(uring_bufs* b, const struct io_uring_cqe* cqe) {
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    // the descriptor slot is free: the kernel took the one it overlays
+    struct io_uring_buf* buf = &b->br->bufs[b->tail & (b->entries - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (b->data + bid * b->size);
+    buf->len = b->size;
+    buf->bid = bid;
+    __atomic_store_n(&b->br->tail, ++b->tail, __ATOMIC_RELEASE);
+}
+#endif
@@ -0,0 +1,89 @@
+#ifndef URING_H
+#define URING_H
+
+// Just enough io_uring for the server's io_uring backend (-D USE_IO_URING),
+// straight over the kernel interface: a submission queue filled here and
+// handed to the kernel by uring_wait along with the wait, a completion queue
+// read in place, and provided buffer rings the kernel picks receive buffers
+// from. One ring per thread, nothing is locked.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+    int fd;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned queued;            // SQEs filled since the last io_uring_enter
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    void* ring_map;             // SQ and CQ rings, one mapping
+    size_t ring_len;
+    size_t sqes_len;
+} uring;
+
+// Receive buffers, entries of size bytes each (entries: power of two)
+typedef struct {
+    struct io_uring_buf_ring* br;
+    char* data;
+    size_t map_len;
+    size_t size;
+    unsigned entries;
+    unsigned short bgid;        // buffer group id, given to uring_recv
+    unsigned short tail;
+} uring_bufs;
+
+// Return 0 on success, -1 with errno set. Call from the thread that
+// submits, the ring is set up for a single issuer when the kernel can.
+int uring_init(uring* u, unsigned entries);
+void uring_free(uring* u);
+
+// Queue a request (user_data comes back in its completions), return -1
+// with errno set if the queue is full and cannot be submitted
+int uring_accept_multishot(uring* u, int fd, uint64_t user_data);
+// Completes once fd is readable (one shot)
+int uring_poll(uring* u, int fd, uint64_t user_data);
+// At most len bytes into a buffer of the group, len > 0
+int uring_recv(uring* u, int fd, uring_bufs* b, unsigned len, uint64_t user_data);
+// One send per piece, linked: each starts once the previous one is done,
+// and the rest are cancelled (-ECANCELED) if one fails or comes up short.
+// A chain is never split between two submissions.
+int uring_send_chain(uring* u, int fd, const struct iovec* iov, int n, uint64_t user_data);
+
+// Submits what is queued and waits at most timeout milliseconds (-1:
+// forever, 0: not at all) for a completion. Return 0 (timeout and EINTR
+// included), -1 on error.
+int uring_wait(uring* u, int timeout);
+
+// Next completion, NULL if none; uring_seen hands its slot back
+static inline struct io_uring_cqe* uring_peek(uring* u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & u->cq_mask];
+}
+
+static inline void uring_seen(uring* u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_bufs_init(uring* u, uring_bufs* b, unsigned short bgid, unsigned entries, size_t size);
+// After uring_free, which drops the registration
+void uring_bufs_free(uring_bufs* b);
+// Buffer a receive completed into, its id from the completion's flags
+static inline char* uring_buf(uring_bufs* b, const struct io_uring_cqe* cqe) {
+    return b->data + (cqe->flags >> IORING_CQE_BUFFER_SHIFT) * b->size;
+}
+// Gives a buffer back to the kernel once its bytes are copied out
+void uring_buf_recycle(uring_bufs* b, const struct io_uring_cqe* cqe);
+
+#endif
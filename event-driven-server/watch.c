@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include "server.h"
+#include "seat_table.h"
+#include "watch.h"
+
+static const char* state_names[] = { [SEAT_FREE] = "free", [SEAT_BOOKED] = "booked", [SEAT_LOCKED] = "locked" };
+
+// Watchers of a train on this thread
+typedef struct {
+    request* first;         // linked through watch_next / watch_pprev
+    seat_snapshot snap;     // what map was rendered from
+    char* map;              // as the watchers have it, seats * 2 bytes
+} watch_set;
+
+static __thread watch_set* sets;   // [num_trains], once a train is watched
+static __thread int num_watching;  // watchers of the thread
+
+static void link_watcher(request* rq, int train) {
+    watch_set* s = &sets[train];
+    rq->booking_info.train = train;
+    rq->booking_info.shift_id = trains[train].shift_id;
+    rq->watch_next = s->first;
+    if (s->first != NULL)
+        s->first->watch_pprev = &rq->watch_next;
+    s->first = rq;
+    rq->watch_pprev = &s->first;
+    num_watching++;
+}
+
+int watch_add(request* rq, int train) {
+    if (sets == NULL && (sets = calloc(num_trains, sizeof(watch_set))) == NULL)
+        return -1;
+    watch_set* s = &sets[train];
+    if (s->map == NULL) {
+        if ((s->map = malloc(trains[train].seats * 2)) == NULL)
+            return -1;
+        seat_render(train, s->map, &s->snap);
+    }
+    // no newer map for it alone: the next poll sends everybody the changes.
+    // Queued as the changes are, whatever the size of the train
+    char banner[64];
+    int len = snprintf(banner, sizeof(banner), ">>> Watching shift %d, changes follow.\n", trains[train].shift_id);
+    if (outq_append(&rq->out, banner, len) < 0 || outq_append(&rq->out, s->map, trains[train].seats * 2) < 0)
+        return -1;
+    rq->buf_len = 0;
+    link_watcher(rq, train);
+    return 0;
+}
+
+int watch_resume(request* rq, int train, const char* map) {
+    if (sets == NULL && (sets = calloc(num_trains, sizeof(watch_set))) == NULL)
+        return -1;
+    watch_set* s = &sets[train];
+    if (s->map == NULL) {
+        if ((s->map = malloc(trains[train].seats * 2)) == NULL)
+            return -1;
+        memcpy(s->map, map, trains[train].seats * 2);
+        // never current: the next poll diffs the seats with map
+        memset(&s->snap, 0, sizeof(s->snap));
+        s->snap.version = UINT64_MAX;
+    }
+    link_watcher(rq, train);
+    return 0;
+}
+
+const char* watch_map(const request* rq) {
+    return sets[rq->booking_info.train].map;
+}
+
+void watch_remove(request* rq) {
+    if (rq->watch_pprev == NULL)
+        return;
+    *rq->watch_pprev = rq->watch_next;
+    if (rq->watch_next != NULL)
+        rq->watch_next->watch_pprev = rq->watch_pprev;
+    rq->watch_next = NULL;
+    rq->watch_pprev = NULL;
+    num_watching--;
+}
+
+bool watch_active(void) {
+    return num_watching > 0;
+}
+
+// "seat N <state>" for every seat shown differently, into out
+static size_t diff_maps(int train, const char* from, const char* to, char* out, size_t size) {
+    size_t len = 0;
+    for (int i = 0; i < trains[train].seats; i++) {
+        if (from[i * 2] == to[i * 2])
+            continue;
+        len += snprintf(out + len, size - len, "seat %d %s\n", i + 1, state_names[to[i * 2] - '0']);
+        if (len >= size)
+            return size; // cannot happen with MAX_SEATS lines
+    }
+    return len;
+}
+
+void watch_poll(void (*push)(request* rq)) {
+    char map[MAX_SEATS * 2];
+    char diff[MAX_SEATS * 20]; // "seat 1024 locked\n" per seat at most
+    for (int t = 0; sets != NULL && t < num_trains; t++) {
+        watch_set* s = &sets[t];
+        if (s->first == NULL || seat_snapshot_current(t, &s->snap))
+            continue;
+        seat_render(t, map, &s->snap);
+        size_t len = diff_maps(t, s->map, map, diff, sizeof(diff));
+        memcpy(s->map, map, trains[t].seats * 2);
+        if (len == 0) // locked and freed again since the last poll
+            continue;
+        request* next;
+        for (request* rq = s->first; rq != NULL; rq = next) {
+            next = rq->watch_next; // push may close rq
+            if (rq->out.len >= OUTQ_LIMIT || outq_append(&rq->out, diff, len) < 0) {
+                watch_remove(rq); // too far behind to follow
+                rq->status = INVALID;
+            }
+            push(rq);
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "common.h"
+
+// Seat map subscriptions of the read server:
+//     watch <shift>
+// answers with the seat map, then pushes a line per seat whose state
+// changed, "seat 5 booked" (or locked, free), until the client leaves.
+//
+// Each reactor thread lists the watchers of a train along with the map last
+// sent to them. watch_poll checks the train against the lock segment's
+// change sequence (the version writers bump, see seat_snapshot) and on a
+// change renders the map once, diffs it with the last one and queues the
+// same lines to every watcher. A watcher that lets OUTQ_LIMIT bytes pile up
+// is dropped.
+
+#define WATCH_POLL_MS 20 // how often watched trains are checked
+
+// Subscribes rq to train (rq->booking_info.train), the seat map as the other
+// watchers have it is queued to rq. -1 out of memory.
+int watch_add(request* rq, int train);
+// Restart handoff: the map the watchers of rq's train were sent (seats * 2
+// bytes), and watch_add for a watcher handed over with that map, -1 out of
+// memory. The first watcher resumed sets the thread's map of the train.
+const char* watch_map(const request* rq);
+int watch_resume(request* rq, int train, const char* map);
+// Unsubscribes rq, if it watches a train
+void watch_remove(request* rq);
+// Whether the calling thread has watchers
+bool watch_active(void);
+// Queues the changes of the watched trains, push is called for every
+// watcher with output queued (or dropped: status INVALID)
+void watch_poll(void (*push)(request* rq));
+
+#endif
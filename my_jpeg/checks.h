@@ -0,0 +1,30 @@
+// Shared by the *_test.cpp checks: CHECK reports a failed condition and
+// goes on, main returns failed
+#ifndef CHECKS_H
+#define CHECKS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static int failed;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failed = 1; \
+        } \
+    } while (0)
+
+// Replaces the file with bytes, exits if it cannot
+static inline void write_file(const std::string& path, const std::vector<uint8_t>& bytes) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (f == NULL || fwrite(bytes.data(), 1, bytes.size(), f) != bytes.size() || fclose(f) != 0) {
+        perror(path.c_str());
+        exit(1);
+    }
+}
+
+#endif
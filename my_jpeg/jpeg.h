@@ -0,0 +1,791 @@
+#ifndef JPEG_H
+#define JPEG_H
+
+#include <iostream>
+#include <cstdint>
+#include <iomanip>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include "qdbmp.h"
+#include "upsample.h"
+
+// Define markers
+const uint16_t SOI = 0xffd8;
+const uint16_t APP0 = 0xffe0;
+const uint16_t DQT = 0xffdb;
+const uint16_t SOF0 = 0xffc0;
+const uint16_t DHT = 0xffc4;
+const uint16_t SOS = 0xffda;
+const uint16_t EOI = 0xffd9;
+const uint16_t COM = 0xfffe;
+
+// Marker mapping
+static const std::map<uint16_t, std::string> marker_mapping = {
+    {SOI, "Start of Image"},
+    {APP0, "APP0"},
+    {DQT, "Define Quantization Table"},
+    {SOF0, "Start of Frame: Baseline"},
+    {DHT, "Define Huffman Table"},
+    {SOS, "Start of Scan"},
+    {EOI, "End of Image"},
+    {COM, "COM"}
+};
+
+typedef struct Component {
+    // uint8_t id; dirty: use 0:Y, 1:Cb, 2:Cr
+    uint8_t hor_sr;
+    uint8_t ver_sr;
+    uint8_t quan_table_id;
+    uint8_t hf_table_ac_id;
+    uint8_t hf_table_dc_id;
+}Component;
+
+// Frames above this many pixels are turned down (setMaxPixels)
+#define JPEG_MAX_PIXELS (1 << 28)
+
+// Decoded samples of one component, stored row by row (level shifted to 0..255)
+struct Plane {
+    int width;
+    int height;
+    std::vector<uint8_t> samples;
+
+    uint8_t* row(int y) { return &samples[static_cast<size_t>(y) * width]; }
+};
+
+class JPEG {
+public:
+    // verbose: dump every segment to stdout (the decode service turns this off)
+    JPEG(const std::string& filename, bool fancy_upsampling = true, bool verbose = true)
+        : log_(verbose ? std::cout.rdbuf() : nullptr) {
+        // opens file and read all bytes into data vector
+        std::ifstream file(filename, std::ios::binary);
+        if (file.is_open()) {
+            file.seekg(0, std::ios::end);
+            data.resize(file.tellg());
+            file.seekg(0, std::ios::beg);
+            file.read(reinterpret_cast<char*>(&data[0]), data.size());
+            file.close();
+        }
+        init(fancy_upsampling);
+    }
+
+    // Decodes a JPEG file already in memory
+    JPEG(const std::vector<uint8_t>& bytes, bool fancy_upsampling = true, bool verbose = true)
+        : log_(verbose ? std::cout.rdbuf() : nullptr), data(bytes) {
+        init(fancy_upsampling);
+    }
+
+    // Decodes the whole image into planes_, returns false for files this
+    // decoder cannot handle (only baseline 1 or 3 component images)
+    bool decode() {
+        coefficients_only_ = false;
+        return decodeSegments();
+    }
+
+    // Entropy decodes only: keeps the quantized coefficients of every block
+    // (zigzag order, absolute DC) in coefficients() and skips IDCT/output.
+    // Blocks are stored in scan order, for each MCU: component, then the
+    // ver_sr x hor_sr blocks of that component row by row.
+    bool decodeCoefficients() {
+        coefficients_only_ = true;
+        return decodeSegments();
+    }
+
+    // Decoding fails on a frame header declaring more than n pixels
+    void setMaxPixels(uint64_t n) { max_pixels_ = n; }
+
+    // Image size as declared in the frame header
+    int width() const { return image_width_; }
+    int height() const { return image_height_; }
+    // Decoded size (whole MCUs), what writeBMP() outputs
+    int outputWidth() const { return output_width_; }
+    int outputHeight() const { return output_height_; }
+    // 1: grayscale rows, 3: BGR rows
+    int channels() const { return num_of_components_ == 1 ? 1 : 3; }
+
+    // Fills `out` with row y at full resolution (outputWidth() pixels)
+    void readRow(int y, uint8_t* out) {
+        if(num_of_components_ == 1) {
+            memcpy(out, planes_[0].row(y), output_width_);
+            return;
+        }
+        const uint8_t* ycc[3];
+        row_buf_.resize(3 * output_width_);
+        for(int comp = 0; comp < 3; comp++)
+            ycc[comp] = upsampleRow(comp, y, &row_buf_[comp * output_width_]);
+        ycc_to_bgr_row(ycc[0], ycc[1], ycc[2], out, output_width_);
+    }
+
+    // Filled by decodeCoefficients()
+    const std::vector<int16_t>& coefficients() const { return coefs_; }
+    const std::vector<Component>& frameComponents() const { return components; }
+    const std::vector<uint8_t>& bytes() const { return data; }
+
+    void writeBMP(const char* filename) {
+        if(num_of_components_ == 1)
+            writeGrayBMP(filename);
+        else
+            writeColorBMP(filename);
+    }
+
+private:
+    std::ostream log_;
+    size_t offset_;
+    std::vector<uint8_t> data;
+    // SOF
+    uint16_t image_height_;
+    uint16_t image_width_;
+    uint8_t num_of_components_;
+    uint8_t max_hor_sr_;
+    uint8_t max_ver_sr_;
+    std::vector<Component> components;
+    uint64_t max_pixels_;
+
+    // DHT
+    // level, value, symbol
+    // TODO: better data structure, smaller data field
+    std::map<std::pair<uint32_t, uint32_t>, uint32_t> huffTable_[2][2]; // [AC][id], baseline ids 0..1
+    uint16_t quantTable_[4][8][8];
+    double mcu_[3][4][4][8][8]; // idct requires double data type for accuracy
+
+    // Entropy decoder state
+    int dc_[3];
+    uint8_t bit_buf_;
+    size_t byte_index_;
+    uint8_t bit_index_;
+    bool corrupt_; // ran out of scan data or hit an unknown code
+    bool coefficients_only_;
+    std::vector<int16_t> coefs_;
+
+    // Upsampling
+    bool fancy_upsampling_;
+    std::vector<Plane> planes_;
+    std::vector<uint8_t> row_buf_;
+    int output_width_;
+    int output_height_;
+
+    static std::string markerName(uint16_t marker) {
+        auto it = marker_mapping.find(marker);
+        return it == marker_mapping.end() ? "" : it->second;
+    }
+
+    // Length field of the segment at offset_, 0 if it does not fit in the data
+    uint16_t segmentLength() const {
+        if(offset_ + 2 > data.size())
+            return 0;
+        uint16_t length = (data[offset_] << 8) | data[offset_ + 1];
+        return length >= 2 && offset_ + length <= data.size() ? length : 0;
+    }
+
+    // -------------------------------------------------------------
+    // Store quantTable_; false on a table the segment does not hold
+    bool decodeDQT(void) {
+        uint16_t length = segmentLength();
+        log_ << "Section length: " << length << std::endl;
+        if(length == 0)
+            return false;
+        length -= 2;
+        offset_ += 2;
+        while(length) {
+            uint8_t table_info = data[offset_++];
+            uint8_t table_id = table_info & 0x0f;
+            uint8_t precision = table_info >> 4;
+            int bytes = precision + 1; // per entry
+            log_ << "--------------" << std::endl;
+            log_ << "Table info: " << static_cast<int>(table_id) << std::endl;
+            if(table_id > 3 || precision > 1 || length < 1 + 64 * bytes)
+                return false;
+
+            // read quantization table
+            for(int i = 0; i < 8; i++) {
+                for(int j = 0; j < 8; j++) {
+                    this->quantTable_[table_id][i][j] = precision ? (data[offset_] << 8) | data[offset_ + 1] : data[offset_];
+                    offset_ += bytes;
+                    log_ << std::setw(3) << static_cast<int>(quantTable_[table_id][i][j]) << " ";
+                }
+                log_ << std::endl;
+            }
+            length -= 1 + 64 * bytes; // table_info + entries
+        }
+        return true;
+    }
+
+    // -------------------------------------------------------------
+    // Store image_height_, image_width_, num_of_components_, max_hor_sr_, max_ver_sr
+    // components: {hor_sr, ver_sr, quan_table_id}
+    // false on a second frame header or a component mcu_ cannot hold
+    bool decodeSOF(void) {
+        uint16_t length = segmentLength();
+        log_ << "Section length: " << length << std::endl;
+        if(length < 8 || !components.empty())
+            return false;
+        offset_ += 2;
+        uint8_t precision = data[offset_++];
+        if(precision != 8)
+            log_ << "Precision may not be supported by most software" << std::endl;
+        this->image_height_ = (data[offset_] << 8) | data[offset_ + 1];
+        offset_ += 2;
+        this->image_width_ = (data[offset_] << 8) | data[offset_ + 1];
+        offset_ += 2;
+        this->num_of_components_ = data[offset_++];
+        log_ << "Precision: " << static_cast<int>(precision) << std::endl;
+        log_ << "Image height: " << image_height_ << std::endl;
+        log_ << "Image width: " << image_width_ << std::endl;
+        log_ << "Num of components: " << static_cast<int>(num_of_components_) << std::endl;
+        if(num_of_components_ == 0 || num_of_components_ > 3 || length != 8 + 3 * num_of_components_)
+            return false;
+        if(static_cast<uint64_t>(image_width_) * image_height_ > max_pixels_)
+            return false; // the planes would not fit
+
+        uint8_t component_id, sampling_factor, quan_table_id;
+        uint8_t ver_sr, hor_sr; // horizontal and vertical sampling rate
+        Component c;
+        for(int i = 0; i < num_of_components_; i++){
+            component_id = data[offset_++];
+            sampling_factor = data[offset_++];
+            ver_sr = sampling_factor & 0x0f;
+            hor_sr = sampling_factor >> 4;
+            quan_table_id = data[offset_++];
+            if(hor_sr < 1 || hor_sr > 4 || ver_sr < 1 || ver_sr > 4 || quan_table_id > 3)
+                return false;
+            this->max_hor_sr_ = std::max(hor_sr, this->max_hor_sr_);
+            this->max_ver_sr_ = std::max(ver_sr, this->max_ver_sr_);
+            // c.id = component_id;
+            c.hor_sr = hor_sr;
+            c.ver_sr = ver_sr;
+            c.quan_table_id = quan_table_id;
+            this->components.push_back(c);
+            log_ << "Component: " << static_cast<int>(component_id) 
+                      << " Sampling factor(hor*ver): " << static_cast<int>(hor_sr) << " * " 
+                      << static_cast<int>(ver_sr)
+                      << " Qantization Table ID: " << static_cast<int>(quan_table_id) << std::endl;
+        }
+        // A single component scan is non-interleaved: one block per MCU,
+        // whatever sampling factor the frame header declares.
+        if(num_of_components_ == 1) {
+            this->components[0].hor_sr = this->components[0].ver_sr = 1;
+            this->max_hor_sr_ = this->max_ver_sr_ = 1;
+        }
+        // upsampling goes by whole factors
+        for(const Component& comp : components)
+            if(max_hor_sr_ % comp.hor_sr != 0 || max_ver_sr_ % comp.ver_sr != 0)
+                return false;
+        return true;
+    }
+
+    // -------------------------------------------------------------
+    // Store huffTable_; false on a table the segment does not hold
+    bool decodeDHT(void) {
+        uint16_t length = segmentLength();
+        log_ << "Section length: " << length << std::endl;
+        if(length == 0)
+            return false;
+        length -= 2;
+        offset_ += 2;
+        while(length) {
+            if(length < 17)
+                return false;
+            uint8_t table_info = data[offset_++];
+            uint8_t table_id = table_info & 0x0f; // get lower four bits
+            uint8_t table_class = table_info >> 4; // get higher four bits
+            bool ac_table = table_class;
+            log_ << "--------------" << std::endl;
+            log_ << "Table info: " << (ac_table?"AC":"DC") << static_cast<int>(table_id) << std::endl;
+            if(table_class > 1 || table_id > 1)
+                return false;
+
+            // Reading Huffman table (16 bytes)
+            int number = 0; // number of symbols
+            std::vector<uint8_t> huffman_table(16);
+            for(int i = 0; i < 16; i++) {
+                huffman_table[i] = data[offset_++];
+                number += huffman_table[i];
+            }
+            if(length < 17 + number)
+                return false;
+
+            // <level, codeword>
+            std::vector<std::pair<uint8_t, uint32_t>> vector_of_pair = createHuffCode(huffman_table); 
+
+            // Reading source symbols based on count in Huffman table
+            std::vector<uint8_t> symbols;
+            for(int i = 0; i < number; i++) {
+                symbols.push_back(data[offset_ + i]);
+                this->huffTable_[ac_table][table_id][vector_of_pair[i]] = data[offset_ + i];
+            }
+            offset_ += number;
+            // outputs:
+            log_ << "Symbol table: ";
+            for(uint8_t symbol : symbols) {
+                log_ << (int)symbol << " ";
+            }
+            log_ << std::endl;
+            length -= (1 + 16 + number);
+        }
+        return true;
+    }
+
+    // -------------------------------------------------------------
+    // Store components: {hf_table_ac_id, hf_table_dc_id}
+    // false unless the scan holds every component of the frame
+    bool decodeSOS(void) {
+        uint16_t length = segmentLength();
+        log_ << "Section length: " << length << std::endl; 
+        if(length != 6 + 2 * num_of_components_ || data[offset_ + 2] != num_of_components_)
+            return false;
+        offset_ += 2;
+        offset_++; // skip num_of_components
+        uint8_t component_id, hf_table_id, hf_table_dc, hf_table_ac;
+        for(int i = 0; i < num_of_components_; i++) {
+            component_id = data[offset_++];
+            hf_table_id = data[offset_++];
+            hf_table_ac = hf_table_id & 0x0f;
+            hf_table_dc = hf_table_id >> 4;
+            if(hf_table_ac > 1 || hf_table_dc > 1)
+                return false;
+            // scan components follow frame order, ids are not always 1..3 (e.g. 'R','G','B')
+            this->components[i].hf_table_ac_id = hf_table_ac;
+            this->components[i].hf_table_dc_id = hf_table_dc;
+            log_ << "Component: " << static_cast<int>(component_id) 
+                      << " Huffman Table ID: " 
+                      << "DC - " << static_cast<int>(hf_table_dc) 
+                      << " AC - " << static_cast<int>(hf_table_ac)
+                      << std::endl;
+        }
+        offset_ += 3; // skip 0x003F00 will not be used in baseline
+        return true;
+    }
+
+    void init(bool fancy_upsampling) {
+        offset_ = 0;
+        max_hor_sr_ = 0;
+        max_ver_sr_ = 0;
+        fancy_upsampling_ = fancy_upsampling;
+        num_of_components_ = 0;
+        max_pixels_ = JPEG_MAX_PIXELS;
+        memset(mcu_, 0, sizeof(mcu_));
+        memset(dc_, 0, sizeof(dc_));
+        bit_buf_ = 0;
+        byte_index_ = 0;
+        bit_index_ = 0;
+        corrupt_ = false;
+        coefficients_only_ = false;
+    }
+
+    // Walks the segments, entropy decodes the (single) scan
+    bool decodeSegments() {
+        while (offset_ + 1 < data.size()) {
+            uint16_t marker = (data[offset_] << 8) | data[offset_ + 1];
+            log_ << "**********************************" << std::endl;
+            log_ << markerName(marker) << std::endl;
+            offset_ += 2; // skip marker
+
+            if (marker == SOI) {
+                continue;
+            } 
+            else if (marker == DQT) {
+                if (!decodeDQT())
+                    return false;
+            } 
+            else if (marker == SOF0) {
+                if (!decodeSOF())
+                    return false;
+            } 
+            else if (marker == DHT) {
+                if (!decodeDHT())
+                    return false;
+            } 
+            else if (marker == SOS) {
+                if (num_of_components_ != 1 && num_of_components_ != 3)
+                    return false; // no baseline frame header, or CMYK
+                if (!decodeSOS())
+                    return false;
+                readData();
+                // testData();
+                offset_ = data.size() - 2;
+            }
+            else if (marker == EOI) {
+                return decoded() && !corrupt_;
+            }
+            else {
+                uint16_t length = segmentLength();
+                if (length == 0)
+                    return false; // truncated, or a length that would not move on
+                offset_ += length; // skip segment length
+            }
+
+            if (offset_ >= data.size()) {
+                log_ << "offset exceed" << std::endl;
+                break;
+            }
+        }
+        return decoded() && !corrupt_;
+    }
+
+    bool decoded() const {
+        return coefficients_only_ ? !coefs_.empty() : !planes_.empty();
+    }
+
+    void readData(void) {
+        std::vector<uint8_t> comp_data;
+        removeFF00(data, comp_data);
+        int mcu_height = 8*max_ver_sr_;
+        int mcu_width = 8*max_hor_sr_;
+        int mcu_ver_num = ceil(image_height_ / static_cast<double>(mcu_height));
+        int mcu_hor_num = ceil(image_width_ / static_cast<double>(mcu_width));
+
+        if(coefficients_only_) {
+            int blocks_per_mcu = 0;
+            for(int comp = 0; comp < num_of_components_; comp++)
+                blocks_per_mcu += components[comp].ver_sr * components[comp].hor_sr;
+            coefs_.clear();
+            coefs_.reserve(static_cast<size_t>(mcu_ver_num) * mcu_hor_num * blocks_per_mcu * 64);
+            for(int i = 0; i < mcu_ver_num * mcu_hor_num; i++) {
+                readMCU(comp_data);
+                storeCoefficients();
+            }
+            output_width_ = mcu_width * mcu_hor_num;
+            output_height_ = mcu_height * mcu_ver_num;
+            return;
+        }
+
+        allocatePlanes(mcu_hor_num, mcu_ver_num);
+        for(int i = 0; i < mcu_ver_num; i++) {
+            for(int j = 0; j < mcu_hor_num; j++) {
+                readMCU(comp_data); // update mcu_
+                deQuantize();
+                deZigzag();
+                idct();
+                storeMCU(i, j);
+            }
+        }
+        output_width_ = mcu_width * mcu_hor_num;
+        output_height_ = mcu_height * mcu_ver_num;
+    }
+
+    void readMCU(const std::vector<uint8_t>& comp_data) {
+        for(int comp = 0; comp < num_of_components_; comp++)  {
+            for(int j = 0; j < components[comp].ver_sr; j++) {
+                for(int k = 0; k < components[comp].hor_sr; k++) {
+                    // Read block
+                    // log_ << "comp: " << comp << std::endl;
+                    readDC(comp_data, comp, j, k);
+                    readAC(comp_data, comp, j, k);
+                }
+            }
+        }
+    }
+
+    void readDC(const std::vector<uint8_t>& comp_data, uint8_t comp, int j, int k) {
+        int* dc = dc_;
+        uint8_t length = matchHuff(comp_data, 0, components[comp].hf_table_dc_id);
+        if(length == 0) {
+            dc[comp] += 0;
+            this->mcu_[comp][j][k][0][0] = dc[comp];
+            // log_ << std::setw(4) << dc[comp] << " ";
+            return;
+        }
+        if(length > 11) { // not a baseline DC difference
+            corrupt_ = true;
+            return;
+        }
+        bool sign = getBit(comp_data);
+        int dcValue = sign;
+        for(int i = 1; i < length; i++) {
+            dcValue <<= 1;
+            dcValue |= getBit(comp_data);
+        }
+        dcValue = sign ? dcValue:(dcValue-((1<<length)-1));
+        dc[comp] += dcValue;
+        this->mcu_[comp][j][k][0][0] = dc[comp];
+        // log_ << std::setw(4) << dc[comp] << " ";
+    }
+
+    void readAC(const std::vector<uint8_t>& comp_data, uint8_t comp, int j, int k) {
+        int count = 1;
+        while (count < 64) {
+            uint8_t acinfo = matchHuff(comp_data, 1, components[comp].hf_table_ac_id);
+            uint8_t zeros = acinfo >> 4;
+            uint8_t length = acinfo & 0x0F;
+
+            // all zeros
+            if (zeros == 0 && length == 0) {
+                while (count < 64) {
+                    this->mcu_[comp][j][k][count/8][count%8] = 0;
+                    count++;
+                }
+            } 
+            // a run past the last coefficient
+            else if (count + zeros > 63) {
+                corrupt_ = true;
+                return;
+            }
+            // 16 subsequent zeros
+            else if (zeros == 0x0F && length == 0) { 
+                for(int i = 0; i < 16; i++) {
+                    this->mcu_[comp][j][k][count/8][count%8] = 0;
+                    count++;
+                }
+            }
+            else {
+                bool sign = getBit(comp_data);
+                int acValue = sign;
+                for(int i = 1; i < length; i++) {
+                    acValue <<= 1;
+                    acValue |= getBit(comp_data);
+                }
+                acValue = sign ? acValue:(acValue-((1<<length)-1));
+
+                for (int i = 0; i < zeros; i++) {
+                    this->mcu_[comp][j][k][count/8][count%8] = 0;
+                    count++;
+                }
+                this->mcu_[comp][j][k][count/8][count%8] = acValue;
+                count++;
+            }
+        }
+    }
+
+    // mcu_ still holds the zigzag ordered, quantized values after readMCU()
+    void storeCoefficients(void) {
+        for(int comp = 0; comp < num_of_components_; comp++) {
+            for(int j = 0; j < components[comp].ver_sr; j++) {
+                for(int k = 0; k < components[comp].hor_sr; k++) {
+                    const double* block = &mcu_[comp][j][k][0][0];
+                    for(int z = 0; z < 64; z++)
+                        coefs_.push_back(static_cast<int16_t>(block[z]));
+                }
+            }
+        }
+    }
+
+    void deQuantize(void) {
+        for(int comp = 0; comp < num_of_components_; comp++) {
+            for(int h = 0; h < components[comp].ver_sr; h++) {
+                for(int w = 0; w < components[comp].hor_sr; w++) {
+                    for(int i = 0; i < 8; i++) {
+                        for(int j = 0; j < 8; j++) {
+                            mcu_[comp][h][w][i][j] *= quantTable_[components[comp].quan_table_id][i][j];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void deZigzag(void) {
+        for(int comp = 0; comp < num_of_components_; comp++) {
+            for(int h = 0; h < components[comp].ver_sr; h++) {
+                for(int w = 0; w < components[comp].hor_sr; w++) {
+                    int zz[8][8] = {
+                            { 0,  1,  5,  6, 14, 15, 27, 28},
+                            { 2,  4,  7, 13, 16, 26, 29, 42},
+                            { 3,  8, 12, 17, 25, 30, 41, 43},
+                            { 9, 11, 18, 24, 31, 40, 44, 53},
+                            {10, 19, 23, 32, 39, 45, 52, 54},
+                            {20, 22, 33, 38, 46, 51, 55, 60},
+                            {21, 34, 37, 47, 50, 56, 59, 61},
+                            {35, 36, 48, 49, 57, 58, 62, 63}
+                    };
+                    for (int i = 0; i < 8; i++) {
+                        for (int j = 0; j < 8; j++) {
+                            zz[i][j] = mcu_[comp][h][w][zz[i][j] / 8][zz[i][j] % 8];
+                        }
+                    }
+                    for (int i = 0; i < 8; i++) {
+                        for (int j = 0; j < 8; j++) {
+                            mcu_[comp][h][w][i][j] = zz[i][j];
+                        }
+                    }
+                }
+            }
+        } 
+    }
+
+    void idct(void) {
+        const double PI = 3.14159265358979323846;
+        double temp[8][8];
+
+        for(int comp = 0; comp < num_of_components_; comp++) {
+            for(int h = 0; h < components[comp].ver_sr; h++) {
+                for(int w = 0; w < components[comp].hor_sr; w++) {
+                    for (int x = 0; x < 8; x++) {
+                        for (int y = 0; y < 8; y++) {
+                            temp[x][y] = 0;
+                            for (int u = 0; u < 8; u++) {
+                                for (int v = 0; v < 8; v++) {
+                                    double Cu = (u == 0) ? 1 / sqrt(2) : 1;
+                                    double Cv = (v == 0) ? 1 / sqrt(2) : 1;
+                                    temp[x][y] += Cu * Cv * mcu_[comp][h][w][u][v] *
+                                                  cos((2 * x + 1) * u * PI / 16.0) *
+                                                  cos((2 * y + 1) * v * PI / 16.0);
+                                }
+                            }
+                            temp[x][y] /= 4.0; // Normalization factor
+                        }
+                    }
+                    // Copying the temporary results back to mcu_
+                    for (int i = 0; i < 8; i++) {
+                        for (int j = 0; j < 8; j++) {
+                            mcu_[comp][h][w][i][j] = temp[i][j];
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // -------------------------------------------------------------
+    // Planar output: every component gets its own plane sized by its
+    // sampling factors, upsampling happens row by row afterwards.
+    void allocatePlanes(int mcu_hor_num, int mcu_ver_num) {
+        planes_.resize(num_of_components_);
+        for(int comp = 0; comp < num_of_components_; comp++) {
+            planes_[comp].width = mcu_hor_num * components[comp].hor_sr * 8;
+            planes_[comp].height = mcu_ver_num * components[comp].ver_sr * 8;
+            planes_[comp].samples.assign(static_cast<size_t>(planes_[comp].width) * planes_[comp].height, 0);
+        }
+    }
+
+    // Level shift mcu_ back to 0..255 and copy it into the planes
+    void storeMCU(int mcu_i, int mcu_j) {
+        for(int comp = 0; comp < num_of_components_; comp++) {
+            Plane& plane = planes_[comp];
+            for(int h = 0; h < components[comp].ver_sr; h++) {
+                for(int w = 0; w < components[comp].hor_sr; w++) {
+                    int y0 = (mcu_i * components[comp].ver_sr + h) * 8;
+                    int x0 = (mcu_j * components[comp].hor_sr + w) * 8;
+                    for(int i = 0; i < 8; i++) {
+                        uint8_t* out = plane.row(y0 + i) + x0;
+                        for(int j = 0; j < 8; j++) {
+                            long v = lround(mcu_[comp][h][w][i][j] + 128);
+                            out[j] = static_cast<uint8_t>(std::min(std::max(v, 0L), 255L));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Returns row y of the component upsampled to full resolution, either
+    // pointing straight into the plane or into `buf` (width samples).
+    const uint8_t* upsampleRow(int comp, int y, uint8_t* buf) {
+        Plane& plane = planes_[comp];
+        int h_factor = max_hor_sr_ / components[comp].hor_sr;
+        int v_factor = max_ver_sr_ / components[comp].ver_sr;
+        int in_y = y / v_factor;
+
+        if(h_factor == 1 && v_factor == 1)
+            return plane.row(y);
+        if(fancy_upsampling_ && h_factor == 2 && v_factor == 1) {
+            h2v1_fancy_row(plane.row(in_y), buf, plane.width);
+            return buf;
+        }
+        if(fancy_upsampling_ && h_factor == 2 && v_factor == 2) {
+            // upper output row leans on the input row above, lower one on the row below
+            int far_y = (y % 2 == 0) ? std::max(in_y - 1, 0) : std::min(in_y + 1, plane.height - 1);
+            h2v2_fancy_row(plane.row(in_y), plane.row(far_y), buf, plane.width);
+            return buf;
+        }
+        int_replicate_row(plane.row(in_y), buf, plane.width, h_factor);
+        return buf;
+    }
+
+    // Pixels go straight into a mapping of the output file
+    BMP* createOutputBMP(const char* filename, int depth) {
+        BMP *bmp = BMP_CreateMapped(filename, output_width_, output_height_, depth);
+        if(bmp == NULL) // e.g. mmap unavailable, fall back to an in-memory bitmap
+            bmp = BMP_Create(output_width_, output_height_, depth);
+        return bmp;
+    }
+
+    // Grayscale: Y samples are palette indices of an 8-bit BMP, no
+    // upsampling and no color conversion needed.
+    void writeGrayBMP(const char* filename) {
+        BMP *bmp = createOutputBMP(filename, 8);
+        for(int i = 0; i < 256; i++)
+            BMP_SetPaletteColor(bmp, i, i, i, i);
+
+        for(int y = 0; y < output_height_; y++)
+            BMP_SetRow(bmp, y, planes_[0].row(y));
+        BMP_WriteFile(bmp, filename);
+        BMP_Free(bmp);
+    }
+
+    void writeColorBMP(const char* filename) {
+        BMP *bmp = createOutputBMP(filename, 24);
+        for(int y = 0; y < output_height_; y++)
+            readRow(y, BMP_GetRow(bmp, y));
+        BMP_WriteFile(bmp, filename);
+        BMP_Free(bmp);
+    }
+
+    // -------------------------------------------------------------
+    void removeFF00(const std::vector<uint8_t>& data, std::vector<uint8_t>& comp_data) {
+        uint8_t b1, b2;
+        size_t i = 0;
+        while(offset_ + i + 1 < data.size()) {
+            b1 = data[offset_+i];
+            b2 = data[offset_+i+1];
+            if(b1 == 0xff) {
+                if(b2 != 0) // encounter real marker
+                    break;
+                comp_data.push_back(b1);
+                i += 2;
+            }
+            else {
+                comp_data.push_back(b1);
+                i += 1;
+            }
+        }
+    }
+
+    bool getBit(const std::vector<uint8_t>& comp_data) {
+        if (bit_index_ == 0) {
+            if (byte_index_ >= comp_data.size()) { // truncated scan
+                corrupt_ = true;
+                return 0;
+            }
+            bit_buf_ = comp_data[byte_index_++];
+        }
+        bool bit = bit_buf_ & (1 << (7 - bit_index_));
+        bit_index_ = (bit_index_ == 7 ? 0 : bit_index_ + 1);
+        return bit;
+    }
+
+    uint8_t matchHuff(const std::vector<uint8_t>& comp_data, uint8_t is_ac, uint8_t tableID) {
+        uint32_t code = 0;
+        uint8_t codeLen;
+        for (int level = 1; level <= 16; level++) {
+            code = code << 1;
+            code += getBit(comp_data);
+            if (huffTable_[is_ac][tableID].find(std::make_pair(level, code)) != huffTable_[is_ac][tableID].end()) {
+                codeLen = huffTable_[is_ac][tableID][std::make_pair(level, code)];
+                return codeLen;
+            }
+        }
+        corrupt_ = true;
+        return 0;
+    }
+
+    std::vector<std::pair<uint8_t, uint32_t>> createHuffCode(const std::vector<uint8_t>& huffman_table) {
+        std::vector<std::pair<uint8_t, uint32_t>> vector_of_pair;
+        int code = 0;
+        for (int i = 0; i < 16; i++) {
+            for (int j = 0; j < huffman_table[i]; j++) {
+                vector_of_pair.push_back(std::make_pair(i + 1, code));
+                code += 1;
+            }
+            code = code << 1;
+        }
+        return vector_of_pair;
+    }
+
+};
+
+#endif
@@ -0,0 +1,618 @@
+// jpegd: long running JPEG decode service
+//
+// usage: ./jpegd <port | unix:path> [workers] [cache MB] [max megapixels]
+//
+// One request per line:
+//     <path> [scale=1|2|4|8] [crop=x,y,w,h] [format=bmp|ppm]
+// Answer:
+//     OK <length>\n<length bytes of image>    or    ERR <reason>\n
+//
+// The event loop follows event-driven-server (init_server / run_server
+// over poll). Decoding runs on a worker pool, finished jobs are handed
+// back through a pipe. Outputs are kept in a byte-budgeted LRU cache keyed
+// by the file's identity (device, inode, size, mtime) and the parameters,
+// hits are answered with a single writev. Images declaring more pixels
+// than the limit are not decoded at all.
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <list>
+#include <deque>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "jpeg.h"
+
+#define ERR_EXIT(a) do { perror(a); exit(1); } while(0)
+
+#define MAX_LINE_LEN 4096
+#define DEFAULT_WORKERS 4
+#define DEFAULT_CACHE_MB 256
+#define DEFAULT_MAX_MP 100
+
+typedef std::shared_ptr<const std::vector<uint8_t>> Buffer;
+
+struct decode_params {
+    int scale;                  // 1, 2, 4 or 8
+    bool crop;                  // crop rectangle given
+    int crop_x, crop_y, crop_w, crop_h;
+    bool ppm;                   // format=ppm, otherwise bmp
+};
+
+typedef struct {
+    char hostname[512];         // server's hostname
+    char unix_path[108];        // unix socket path ("" for TCP)
+    unsigned short port;        // port to listen
+    int listen_fd;              // fd to wait for a new connection
+    int wake_fd[2];             // workers -> event loop
+} server;
+
+typedef struct {
+    int conn_fd;                // fd to talk with client (-1: unused)
+    unsigned long conn_id;      // tells apart clients reusing the same fd
+    std::string in;             // bytes received, not processed yet
+    bool busy;                  // waiting for a worker
+    std::string header;         // response header
+    Buffer body;                // response body (shared with the cache)
+    size_t sent;                // bytes of header + body already written
+} request;
+
+struct job {
+    std::string key;
+    std::string path;
+    decode_params params;
+    Buffer output;
+    std::string error;
+};
+
+// -------------------------------------------------------------
+// LRU cache of encoded outputs, only touched by the event loop thread
+class LRUCache {
+public:
+    explicit LRUCache(size_t budget) : budget_(budget), used_(0) {}
+
+    Buffer get(const std::string& key) {
+        auto it = index_.find(key);
+        if (it == index_.end())
+            return nullptr;
+        order_.splice(order_.begin(), order_, it->second); // most recently used
+        return it->second->second;
+    }
+
+    void put(const std::string& key, const Buffer& value) {
+        if (value->size() > budget_ || index_.count(key))
+            return;
+        order_.emplace_front(key, value);
+        index_[key] = order_.begin();
+        used_ += value->size();
+        while (used_ > budget_) {
+            used_ -= order_.back().second->size();
+            index_.erase(order_.back().first);
+            order_.pop_back();
+        }
+    }
+
+private:
+    size_t budget_;
+    size_t used_;
+    std::list<std::pair<std::string, Buffer>> order_;
+    std::unordered_map<std::string, std::list<std::pair<std::string, Buffer>>::iterator> index_;
+};
+
+// Global variables
+static server svr;
+static int maxfd;
+static request* requestP = NULL;
+static int max_conn_fd = -1; // highest fd handed to a client so far
+static unsigned long num_conn = 0;
+static LRUCache* cache;
+static uint64_t max_pixels;
+
+// Worker pool
+static std::mutex job_mutex;
+static std::condition_variable job_cv;
+static std::deque<job*> pending_jobs;
+static std::mutex done_mutex;
+static std::deque<job*> done_jobs;
+// key -> clients waiting for the same output (one decode for all of them)
+static std::unordered_map<std::string, std::vector<std::pair<int, unsigned long>>> in_flight;
+
+static const char* usage_msg = "usage: %s <port | unix:path> [workers] [cache MB] [max megapixels]\n";
+
+// -------------------------------------------------------------
+// Decoding (worker threads)
+
+static bool render(job* jb) {
+    JPEG jpeg(jb->path, true, false);
+    jpeg.setMaxPixels(max_pixels);
+    if (!jpeg.decode()) {
+        jb->error = "cannot decode";
+        return false;
+    }
+
+    const decode_params& p = jb->params;
+    int cx = 0, cy = 0, cw = jpeg.width(), ch = jpeg.height();
+    if (p.crop) {
+        // offsets and sizes are positive (parse_request): no sum that could overflow
+        if (p.crop_w > jpeg.width() - p.crop_x || p.crop_h > jpeg.height() - p.crop_y) {
+            jb->error = "crop outside of image";
+            return false;
+        }
+        cx = p.crop_x; cy = p.crop_y; cw = p.crop_w; ch = p.crop_h;
+    }
+
+    int c = jpeg.channels();
+    int s = p.scale;
+    int out_w = (cw + s - 1) / s;
+    int out_h = (ch + s - 1) / s;
+    size_t out_stride = static_cast<size_t>(out_w) * c;
+
+    std::vector<uint8_t> pixels(out_stride * out_h);   // top-down, BGR or gray
+    std::vector<uint8_t> full(static_cast<size_t>(jpeg.outputWidth()) * c);
+    std::vector<uint32_t> acc(out_stride);
+
+    // box filter: every output pixel averages an s*s block
+    for (int oy = 0; oy < out_h; oy++) {
+        int y0 = cy + oy * s;
+        int rows = std::min(s, cy + ch - y0);
+        std::fill(acc.begin(), acc.end(), 0);
+        for (int y = y0; y < y0 + rows; y++) {
+            jpeg.readRow(y, full.data());
+            const uint8_t* src = &full[static_cast<size_t>(cx) * c];
+            for (int x = 0; x < cw; x++)
+                for (int k = 0; k < c; k++)
+                    acc[(x / s) * c + k] += src[x * c + k];
+        }
+        uint8_t* dst = &pixels[oy * out_stride];
+        for (int ox = 0; ox < out_w; ox++) {
+            int cols = std::min(s, cw - ox * s);
+            for (int k = 0; k < c; k++)
+                dst[ox * c + k] = (acc[ox * c + k] + rows * cols / 2) / (rows * cols);
+        }
+    }
+
+    auto out = std::make_shared<std::vector<uint8_t>>();
+    if (p.ppm) {
+        char header[64];
+        int n = snprintf(header, sizeof(header), "P%d\n%d %d\n255\n", c == 1 ? 5 : 6, out_w, out_h);
+        out->reserve(n + pixels.size());
+        out->insert(out->end(), header, header + n);
+        for (size_t i = 0; i < pixels.size(); i += c) {
+            if (c == 1) {
+                out->push_back(pixels[i]);
+            } else { // BGR -> RGB
+                out->push_back(pixels[i + 2]);
+                out->push_back(pixels[i + 1]);
+                out->push_back(pixels[i]);
+            }
+        }
+    } else {
+        BMP* bmp = BMP_Create(out_w, out_h, c == 1 ? 8 : 24);
+        if (bmp == NULL) {
+            jb->error = BMP_GetErrorDescription();
+            return false;
+        }
+        if (c == 1)
+            for (int i = 0; i < 256; i++)
+                BMP_SetPaletteColor(bmp, i, i, i, i);
+        for (int y = 0; y < out_h; y++)
+            BMP_SetRow(bmp, y, &pixels[y * out_stride]);
+        UINT size;
+        UCHAR* file = BMP_WriteMemory(bmp, &size);
+        BMP_Free(bmp);
+        if (file == NULL) {
+            jb->error = "out of memory";
+            return false;
+        }
+        out->assign(file, file + size);
+        free(file);
+    }
+    jb->output = out;
+    return true;
+}
+
+static void worker_main(void) {
+    while (1) {
+        job* jb;
+        {
+            std::unique_lock<std::mutex> lock(job_mutex);
+            job_cv.wait(lock, [] { return !pending_jobs.empty(); });
+            jb = pending_jobs.front();
+            pending_jobs.pop_front();
+        }
+        // a failure is the request's, the daemon goes on
+        try {
+            render(jb);
+        } catch (const std::bad_alloc&) {
+            jb->output = nullptr;
+            jb->error = "out of memory";
+        } catch (const std::exception& e) {
+            jb->output = nullptr;
+            jb->error = e.what();
+        }
+        {
+            std::lock_guard<std::mutex> lock(done_mutex);
+            done_jobs.push_back(jb);
+        }
+        char c = 1;
+        write(svr.wake_fd[1], &c, 1); // wake up the event loop
+    }
+}
+
+// -------------------------------------------------------------
+// Request handling (event loop thread)
+
+static void init_request(request* reqP) {
+    reqP->conn_fd = -1;
+    reqP->conn_id = 0;
+    reqP->in.clear();
+    reqP->busy = false;
+    reqP->header.clear();
+    reqP->body = nullptr;
+    reqP->sent = 0;
+}
+
+static void close_conn(request* reqP) {
+    fprintf(stderr, "closing fd %d\n", reqP->conn_fd);
+    close(reqP->conn_fd);
+    init_request(reqP);
+}
+
+// One number of a crop rectangle, from min to INT_MAX and followed by end,
+// q moved past both
+static bool parse_dim(const char*& q, char end, long min, int& value) {
+    char* endptr;
+    errno = 0;
+    long v = strtol(q, &endptr, 10);
+    if (endptr == q || *endptr != end || errno == ERANGE || v < min || v > INT_MAX)
+        return false;
+    value = (int) v;
+    q = endptr + 1;
+    return true;
+}
+
+// Parses "<path> [scale=N] [crop=x,y,w,h] [format=bmp|ppm]"
+static bool parse_request(const std::string& line, std::string& path, decode_params& p, std::string& key) {
+    char buf[MAX_LINE_LEN];
+    snprintf(buf, sizeof(buf), "%s", line.c_str());
+    p.scale = 1;
+    p.crop = false;
+    p.crop_x = p.crop_y = p.crop_w = p.crop_h = 0;
+    p.ppm = false;
+
+    char* save;
+    char* tok = strtok_r(buf, " \t", &save);
+    if (tok == NULL)
+        return false;
+    path = tok;
+    while ((tok = strtok_r(NULL, " \t", &save)) != NULL) {
+        if (strncmp(tok, "scale=", 6) == 0) {
+            p.scale = atoi(tok + 6);
+            if (p.scale != 1 && p.scale != 2 && p.scale != 4 && p.scale != 8)
+                return false;
+        } else if (strncmp(tok, "crop=", 5) == 0) {
+            const char* q = tok + 5;
+            if (!parse_dim(q, ',', 0, p.crop_x) || !parse_dim(q, ',', 0, p.crop_y)
+                    || !parse_dim(q, ',', 1, p.crop_w) || !parse_dim(q, '\0', 1, p.crop_h))
+                return false;
+            p.crop = true;
+        } else if (strcmp(tok, "format=bmp") == 0) {
+            p.ppm = false;
+        } else if (strcmp(tok, "format=ppm") == 0) {
+            p.ppm = true;
+        } else {
+            return false;
+        }
+    }
+
+    // Same file content <=> same device, inode, size and mtime
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+        return false;
+    char k[256];
+    snprintf(k, sizeof(k), "%lu:%lu:%ld:%ld.%09ld|%d|%d,%d,%d,%d|%s",
+             (unsigned long) st.st_dev, (unsigned long) st.st_ino, (long) st.st_size,
+             (long) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec, p.scale,
+             p.crop ? p.crop_x : -1, p.crop_y, p.crop_w, p.crop_h, p.ppm ? "ppm" : "bmp");
+    key = k;
+    return true;
+}
+
+static void set_response(request* reqP, const Buffer& body, const std::string& error) {
+    if (body) {
+        reqP->header = "OK " + std::to_string(body->size()) + "\n";
+        reqP->body = body;
+    } else {
+        reqP->header = "ERR " + error + "\n";
+        reqP->body = nullptr;
+    }
+    reqP->sent = 0;
+}
+
+// Writes as much of the pending response as the socket takes.
+// Return value: 1 done, 0 try again later, -1 error
+static int send_response(request* reqP) {
+    while (1) {
+        struct iovec iov[2];
+        int iovcnt = 0;
+        size_t header_len = reqP->header.size();
+        size_t body_len = reqP->body ? reqP->body->size() : 0;
+        if (reqP->sent < header_len) {
+            iov[iovcnt].iov_base = &reqP->header[reqP->sent];
+            iov[iovcnt].iov_len = header_len - reqP->sent;
+            iovcnt++;
+        }
+        if (body_len > 0 && reqP->sent < header_len + body_len) {
+            size_t off = reqP->sent > header_len ? reqP->sent - header_len : 0;
+            iov[iovcnt].iov_base = (void*) (reqP->body->data() + off);
+            iov[iovcnt].iov_len = body_len - off;
+            iovcnt++;
+        }
+        if (iovcnt == 0) {
+            reqP->header.clear();
+            reqP->body = nullptr;
+            reqP->sent = 0;
+            return 1;
+        }
+        ssize_t r = writev(reqP->conn_fd, iov, iovcnt);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        reqP->sent += r;
+    }
+}
+
+static bool has_response(request* reqP) {
+    return !reqP->header.empty();
+}
+
+// Handles complete lines in reqP->in until the client has to wait
+// (job queued or response not fully written)
+static int process_input(request* reqP) {
+    while (!reqP->busy && !has_response(reqP)) {
+        size_t eol = reqP->in.find('\n');
+        if (eol == std::string::npos) {
+            if (reqP->in.size() > MAX_LINE_LEN)
+                return -1;
+            return 0;
+        }
+        std::string line = reqP->in.substr(0, eol);
+        reqP->in.erase(0, eol + 1);
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+
+        std::string path, key;
+        decode_params params;
+        if (!parse_request(line, path, params, key)) {
+            set_response(reqP, nullptr, "bad request");
+        } else if (Buffer hit = cache->get(key)) {
+            set_response(reqP, hit, "");
+        } else {
+            reqP->busy = true;
+            auto it = in_flight.find(key);
+            if (it != in_flight.end()) { // somebody asked already, wait for the same job
+                it->second.push_back(std::make_pair(reqP->conn_fd, reqP->conn_id));
+                return 0;
+            }
+            in_flight[key].push_back(std::make_pair(reqP->conn_fd, reqP->conn_id));
+            job* jb = new job;
+            jb->key = key;
+            jb->path = path;
+            jb->params = params;
+            {
+                std::lock_guard<std::mutex> lock(job_mutex);
+                pending_jobs.push_back(jb);
+            }
+            job_cv.notify_one();
+            return 0;
+        }
+        if (send_response(reqP) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void handle_read(request* reqP) {
+    char buf[MAX_LINE_LEN];
+    ssize_t r = read(reqP->conn_fd, buf, sizeof(buf));
+    if (r < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if (r <= 0) { // EOF or error
+        close_conn(reqP);
+        return;
+    }
+    reqP->in.append(buf, r);
+    if (process_input(reqP) < 0)
+        close_conn(reqP);
+}
+
+static void handle_write(request* reqP) {
+    int ret = send_response(reqP);
+    if (ret == 1)
+        ret = process_input(reqP); // next pipelined request
+    if (ret < 0)
+        close_conn(reqP);
+}
+
+static void finish_jobs(void) {
+    char drain[256];
+    while (read(svr.wake_fd[0], drain, sizeof(drain)) > 0)
+        ;
+
+    std::deque<job*> finished;
+    {
+        std::lock_guard<std::mutex> lock(done_mutex);
+        finished.swap(done_jobs);
+    }
+    for (job* jb : finished) {
+        if (jb->output)
+            cache->put(jb->key, jb->output);
+        // answering a waiter may queue its next (pipelined) request, which
+        // starts a list of its own
+        auto waiters = std::move(in_flight[jb->key]);
+        in_flight.erase(jb->key);
+        for (auto& waiter : waiters) {
+            request* reqP = &requestP[waiter.first];
+            if (reqP->conn_fd != waiter.first || reqP->conn_id != waiter.second)
+                continue; // client went away
+            reqP->busy = false;
+            set_response(reqP, jb->output, jb->error);
+            handle_write(reqP);
+        }
+        delete jb;
+    }
+}
+
+static void accept_conn(void) {
+    int conn_fd = accept(svr.listen_fd, NULL, NULL);
+    if (conn_fd < 0) {
+        if (errno == EINTR || errno == EAGAIN) return;  // try again
+        if (errno == ENFILE || errno == EMFILE) {
+            (void) fprintf(stderr, "out of file descriptor table ... (maxfd %d)\n", maxfd);
+            return;
+        }
+        ERR_EXIT("accept");
+    }
+    if (conn_fd >= maxfd) {
+        close(conn_fd);
+        return;
+    }
+    fcntl(conn_fd, F_SETFL, fcntl(conn_fd, F_GETFL) | O_NONBLOCK);
+    init_request(&requestP[conn_fd]);
+    requestP[conn_fd].conn_fd = conn_fd;
+    requestP[conn_fd].conn_id = ++num_conn;
+    max_conn_fd = std::max(max_conn_fd, conn_fd);
+    fprintf(stderr, "getting a new request... fd %d\n", conn_fd);
+}
+
+// -------------------------------------------------------------
+
+static void init_server(const char* addr, int workers, size_t cache_bytes) {
+    int tmp = 1;
+
+    gethostname(svr.hostname, sizeof(svr.hostname));
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un servaddr;
+        snprintf(svr.unix_path, sizeof(svr.unix_path), "%s", addr + 5);
+        svr.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (svr.listen_fd < 0) ERR_EXIT("socket");
+        memset(&servaddr, 0, sizeof(servaddr));
+        servaddr.sun_family = AF_UNIX;
+        snprintf(servaddr.sun_path, sizeof(servaddr.sun_path), "%s", svr.unix_path);
+        unlink(svr.unix_path);
+        if (bind(svr.listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+            ERR_EXIT("bind");
+        }
+    } else {
+        struct sockaddr_in servaddr;
+        svr.port = (unsigned short) atoi(addr);
+        svr.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (svr.listen_fd < 0) ERR_EXIT("socket");
+        memset(&servaddr, 0, sizeof(servaddr));
+        servaddr.sin_family = AF_INET;
+        servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        servaddr.sin_port = htons(svr.port);
+        if (setsockopt(svr.listen_fd, SOL_SOCKET, SO_REUSEADDR, (void*)&tmp, sizeof(tmp)) < 0) {
+            ERR_EXIT("setsockopt");
+        }
+        if (bind(svr.listen_fd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+            ERR_EXIT("bind");
+        }
+    }
+    if (listen(svr.listen_fd, 1024) < 0) {
+        ERR_EXIT("listen");
+    }
+
+    if (pipe(svr.wake_fd) < 0) ERR_EXIT("pipe");
+    fcntl(svr.wake_fd[0], F_SETFL, O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN); // clients may hang up in the middle of a response
+
+    maxfd = getdtablesize();
+    requestP = new request[maxfd];
+    for (int i = 0; i < maxfd; i++) {
+        init_request(&requestP[i]);
+    }
+    cache = new LRUCache(cache_bytes);
+
+    for (int i = 0; i < workers; i++) {
+        std::thread(worker_main).detach();
+    }
+}
+
+static void run_server(void) {
+    std::vector<struct pollfd> fds;
+
+    while (1) {
+        // listen fd, wake pipe, then every client
+        fds.clear();
+        fds.push_back({svr.listen_fd, POLLIN, 0});
+        fds.push_back({svr.wake_fd[0], POLLIN, 0});
+        for (int fd = 0; fd <= max_conn_fd; fd++) {
+            request* reqP = &requestP[fd];
+            if (reqP->conn_fd < 0)
+                continue;
+            short events = has_response(reqP) ? POLLOUT : (reqP->busy ? 0 : POLLIN);
+            fds.push_back({fd, events, 0});
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) continue;
+            ERR_EXIT("poll");
+        }
+
+        if (fds[1].revents & POLLIN)
+            finish_jobs();
+        for (size_t i = 2; i < fds.size(); i++) {
+            request* reqP = &requestP[fds[i].fd];
+            if (reqP->conn_fd < 0)
+                continue; // closed while finishing jobs
+            if (fds[i].revents & POLLOUT)
+                handle_write(reqP);
+            else if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                handle_read(reqP);
+        }
+        if (fds[0].revents & POLLIN)
+            accept_conn();
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 5) {
+        fprintf(stderr, usage_msg, argv[0]);
+        exit(1);
+    }
+    int workers = (argc > 2) ? atoi(argv[2]) : DEFAULT_WORKERS;
+    long cache_mb = (argc > 3) ? atol(argv[3]) : DEFAULT_CACHE_MB;
+    long max_mp = (argc > 4) ? atol(argv[4]) : DEFAULT_MAX_MP;
+    if (workers <= 0 || cache_mb < 0 || max_mp <= 0) {
+        fprintf(stderr, usage_msg, argv[0]);
+        exit(1);
+    }
+
+    max_pixels = (uint64_t) max_mp * 1000000;
+    init_server(argv[1], workers, (size_t) cache_mb << 20);
+    fprintf(stderr, "\n[pid: %d] jpegd starting on %.80s, %s %s, %d workers, %ld MB cache...\n",
+            getpid(), svr.hostname, svr.unix_path[0] ? "unix socket" : "port",
+            svr.unix_path[0] ? svr.unix_path : std::to_string(svr.port).c_str(), workers, cache_mb);
+
+    run_server();
+    return 0;
+}
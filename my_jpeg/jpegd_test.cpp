@@ -0,0 +1,222 @@
+// jpegd_test: requests jpegd has to turn down without going down
+//
+// usage: ./jpegd_test
+//
+// Writes a 16x16 grayscale JPEG (quantization and Huffman tables of one
+// entry, every block flat), starts ./jpegd on a unix socket and sends it
+// requests one connection each, then copies of the JPEG with a header or
+// scan it cannot decode. After every bad request a good one must still be
+// answered. Exits 1 if any check failed.
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "checks.h"
+
+#define SIZE 16
+
+static char sock_path[64];
+static std::string jpeg_path;
+
+// Baseline grayscale JPEG, SIZE x SIZE, all blocks flat
+static std::vector<uint8_t> make_jpeg() {
+    std::vector<uint8_t> b = { 0xFF, 0xD8 };
+    // DQT: table 0, 8-bit, all ones
+    b.insert(b.end(), { 0xFF, 0xDB, 0, 67, 0x00 });
+    b.insert(b.end(), 64, 1);
+    // SOF0: 8-bit, SIZE x SIZE, one component, 1x1 sampling, table 0
+    b.insert(b.end(), { 0xFF, 0xC0, 0, 11, 8, 0, SIZE, 0, SIZE, 1, 1, 0x11, 0 });
+    // DHT: DC 0 and AC 0, one code of 1 bit each (DC category 0, EOB)
+    for (uint8_t tc : { 0x00, 0x10 }) {
+        b.insert(b.end(), { 0xFF, 0xC4, 0, 20, tc, 1 });
+        b.insert(b.end(), 15, 0);
+        b.push_back(0);
+    }
+    // SOS: component 1, tables 0/0, spectral selection 0..63
+    b.insert(b.end(), { 0xFF, 0xDA, 0, 8, 1, 1, 0x00, 0, 63, 0 });
+    // 2 bits a block
+    b.insert(b.end(), (SIZE / 8) * (SIZE / 8) * 2 / 8, 0);
+    b.insert(b.end(), { 0xFF, 0xD9 });
+    return b;
+}
+
+// Offset of the first byte after the first 0xFF marker in the file
+static size_t segment(const std::vector<uint8_t>& b, uint8_t marker) {
+    size_t i = 2;
+    while (!(b[i] == 0xFF && b[i + 1] == marker))
+        i += 2 + (b[i + 2] << 8 | b[i + 3]);
+    return i + 2;
+}
+
+// A socket connected to the daemon, if it came up in time
+static int connect_daemon() {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct timeval tv = { 5, 0 }; // a daemon gone or stuck fails the check, not the run
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock_path);
+    // it may still be starting
+    for (int i = 0; i < 100 && connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0; i++)
+        usleep(20000);
+    return fd;
+}
+
+// Answer lines to n requests sent at once on one connection, as many as
+// came (answers with a body would be cut up: ERR only)
+static std::vector<std::string> ask_pipelined(const std::string& lines, int n) {
+    int fd = connect_daemon();
+    std::vector<std::string> answers;
+    if (write(fd, lines.data(), lines.size()) == (ssize_t) lines.size()) {
+        std::string answer;
+        char c;
+        while ((int) answers.size() < n && read(fd, &c, 1) == 1) {
+            if (c != '\n') {
+                answer += c;
+                continue;
+            }
+            answers.push_back(answer);
+            answer.clear();
+        }
+    }
+    close(fd);
+    return answers;
+}
+
+// First line of jpegd's answer to one request, "" if none came
+static std::string ask(const std::string& line) {
+    int fd = connect_daemon();
+    std::string answer;
+    std::string req = line + "\n";
+    if (write(fd, req.data(), req.size()) == (ssize_t) req.size()) {
+        char c;
+        while (read(fd, &c, 1) == 1 && c != '\n')
+            answer += c;
+    }
+    close(fd);
+    return answer;
+}
+
+static bool ok(const std::string& answer) {
+    return answer.compare(0, 3, "OK ") == 0;
+}
+
+int main() {
+    char dir[] = "/tmp/jpegd_test.XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror(dir);
+        return 1;
+    }
+    snprintf(sock_path, sizeof(sock_path), "%s/sock", dir);
+    jpeg_path = std::string(dir) + "/flat.jpg";
+    write_file(jpeg_path, make_jpeg());
+
+    std::string listen = std::string("unix:") + sock_path;
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stderr); // per connection logs
+        execl("./jpegd", "./jpegd", listen.c_str(), "1", "1", (char*) NULL);
+        _exit(127);
+    }
+    CHECK(ok(ask(jpeg_path)));
+    CHECK(ok(ask(jpeg_path + " crop=4,4,12,12")));
+    CHECK(ok(ask(jpeg_path + " crop=15,15,1,1 scale=8 format=ppm")));
+
+    // crop: x + w used to be computed on int
+    const char* bad_crops[] = {
+        "crop=2147483647,0,10,10", "crop=0,2147483647,10,10", "crop=10,10,2147483647,2147483647",
+        "crop=1,0,16,16", "crop=16,0,1,1", "crop=-1,0,4,4", "crop=0,0,0,4",
+        "crop=99999999999,0,1,1", "crop=0,0,4", "crop=0,0,4,4,4", "crop=0,0,4,4x",
+    };
+    for (const char* crop : bad_crops) {
+        std::string answer = ask(jpeg_path + " " + crop);
+        if (answer.compare(0, 4, "ERR ") != 0)
+            fprintf(stderr, "%s: %s\n", crop, answer.c_str());
+        CHECK(answer.compare(0, 4, "ERR ") == 0);
+        CHECK(ok(ask(jpeg_path + " scale=2")));
+    }
+
+    // headers and scans the decoder used to index its tables with, divide
+    // by or loop on; byte offsets are from the segment's length field
+    struct { uint8_t marker; int at; uint8_t value; const char* what; } bad_bytes[] = {
+        { 0xDB, 2, 0x20, "DQT precision 2" },
+        { 0xDB, 2, 0x04, "DQT table 4" },
+        { 0xDB, 1, 66, "DQT one entry short" },
+        { 0xC0, 9, 0x00, "SOF sampling 0x0" },
+        { 0xC0, 9, 0xFF, "SOF sampling 15x15" },
+        { 0xC0, 9, 0x51, "SOF sampling 5x1" },
+        { 0xC0, 10, 4, "SOF quantization table 4" },
+        { 0xC0, 7, 4, "SOF 4 components" },
+        { 0xC0, 7, 0, "SOF no component" },
+        { 0xC4, 2, 0x20, "DHT class 2" },
+        { 0xC4, 2, 0x05, "DHT table 5" },
+        { 0xC4, 1, 200, "DHT past the end" },
+        { 0xC4, 3, 255, "DHT more symbols than bytes" },
+        { 0xC4, 19, 200, "DC category 200" },
+        { 0xDA, 4, 0x22, "SOS table 2" },
+        { 0xDA, 2, 2, "SOS 2 components" },
+    };
+    const std::vector<uint8_t> good = make_jpeg();
+    std::string bad_path = std::string(dir) + "/bad.jpg";
+    for (auto& bad : bad_bytes) {
+        std::vector<uint8_t> b = good;
+        b[segment(b, bad.marker) + bad.at] = bad.value;
+        write_file(bad_path, b);
+        std::string answer = ask(bad_path);
+        if (answer.compare(0, 4, "ERR ") != 0)
+            fprintf(stderr, "%s: %s\n", bad.what, answer.c_str());
+        CHECK(answer.compare(0, 4, "ERR ") == 0);
+        CHECK(ok(ask(jpeg_path + " scale=2")));
+    }
+    // AC symbol 0xF0, 16 zeros, each time: the fourth run goes past the
+    // last coefficient (the AC table is the second DHT)
+    std::vector<uint8_t> b = good;
+    size_t ac = segment(b, 0xC4);
+    ac += b[ac] << 8 | b[ac + 1];
+    b[ac + 2 + 2 + 1 + 16] = 0xF0;
+    write_file(bad_path, b);
+    CHECK(ask(bad_path).compare(0, 4, "ERR ") == 0);
+    CHECK(ok(ask(jpeg_path + " scale=2")));
+
+    // a segment that says it is 0 bytes long, one cut off by the end of the file
+    std::vector<std::vector<uint8_t>> bad_files = { good, { 0xFF, 0xD8, 0xFF, 0xFE, 0 } };
+    bad_files[0].insert(bad_files[0].begin() + 2, { 0xFF, 0xFE, 0, 0 });
+    for (auto& file : bad_files) {
+        write_file(bad_path, file);
+        CHECK(ask(bad_path).compare(0, 4, "ERR ") == 0);
+        CHECK(ok(ask(jpeg_path + " scale=2")));
+    }
+
+    // 65535x65535: planes of 4 GB a component, turned down before any
+    b = good;
+    memset(&b[segment(b, 0xC0) + 3], 0xFF, 4);
+    write_file(bad_path, b);
+    CHECK(ask(bad_path).compare(0, 4, "ERR ") == 0);
+    CHECK(ok(ask(jpeg_path + " scale=2")));
+
+    // the same undecodable file twice in a row: the second one is read while
+    // the waiters of the first are answered, and needs a decode of its own
+    std::vector<std::string> answers = ask_pipelined(bad_path + "\n" + bad_path + "\n", 2);
+    CHECK(answers.size() == 2);
+    for (const std::string& answer : answers)
+        CHECK(answer.compare(0, 4, "ERR ") == 0);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(jpeg_path.c_str());
+    unlink(bad_path.c_str());
+    unlink(sock_path);
+    rmdir(dir);
+    if (!failed)
+        printf("jpegd: ok\n");
+    return failed;
+}
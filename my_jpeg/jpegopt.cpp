@@ -0,0 +1,444 @@
+// jpegopt: rewrites a baseline JPEG with Huffman tables built from its own
+// symbol statistics (the equivalent of `jpegtran -optimize`)
+//
+// usage: ./jpegopt <in.jpg> <out.jpg>
+//        ./jpegopt -bench <jpeg files...>
+//
+// The quantized coefficients are read with the decoder's readMCU path
+// (JPEG::decodeCoefficients), symbol frequencies are counted per Huffman
+// table, and optimal code lengths limited to 16 bits are derived the same
+// way libjpeg does (jpeg_gen_optimal_table). Every segment except DHT is
+// copied as is and only the entropy coded data is re-encoded, so the
+// decoded pixels are identical. The output is decoded again and compared
+// coefficient by coefficient before it is written.
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "jpeg.h"
+
+// Huffman table classes as used in DHT / SOS
+#define DC_CLASS 0
+#define AC_CLASS 1
+#define MAX_CLEN 32             // code lengths before limiting to 16 bits
+
+struct huff_table {
+    uint8_t bits[17];           // bits[l]: number of codes of length l
+    uint8_t huffval[256];       // symbols ordered by code length
+    int num_symbols;
+    uint16_t code[256];         // symbol -> code
+    uint8_t size[256];          // symbol -> code length, 0 if unused
+};
+
+struct table_set {
+    long freq[2][4][257];       // [class][table id][symbol], 256 is reserved
+    bool used[2][4];
+    huff_table table[2][4];
+};
+
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<uint8_t>& out) : out_(out), acc_(0), bits_(0) {}
+
+    void put(uint32_t value, int size) {
+        acc_ = (acc_ << size) | (value & ((1u << size) - 1));
+        bits_ += size;
+        while (bits_ >= 8) {
+            uint8_t b = static_cast<uint8_t>(acc_ >> (bits_ - 8));
+            out_.push_back(b);
+            if (b == 0xFF)
+                out_.push_back(0x00); // byte stuffing
+            bits_ -= 8;
+        }
+    }
+
+    // Pads the last byte with 1 bits (never forms a marker)
+    void flush(void) {
+        if (bits_ > 0)
+            put(0x7F, 8 - bits_);
+    }
+
+private:
+    std::vector<uint8_t>& out_;
+    uint64_t acc_;
+    int bits_;
+};
+
+static const char* usage_msg = "usage: %s <in.jpg> <out.jpg>\n       %s -bench <jpeg files...>\n";
+
+static bool read_file(const char* path, std::vector<uint8_t>& bytes) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL)
+        return false;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    bytes.resize(size > 0 ? size : 0);
+    bool ok = size > 0 && fread(&bytes[0], 1, size, fp) == static_cast<size_t>(size);
+    fclose(fp);
+    return ok;
+}
+
+static bool write_file(const char* path, const std::vector<uint8_t>& bytes) {
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL)
+        return false;
+    bool ok = fwrite(&bytes[0], 1, bytes.size(), fp) == bytes.size();
+    return fclose(fp) == 0 && ok;
+}
+
+// Magnitude category: number of bits needed for |v|
+static inline int category(int v) {
+    if (v < 0)
+        v = -v;
+    int n = 0;
+    while (v) {
+        n++;
+        v >>= 1;
+    }
+    return n;
+}
+
+// -------------------------------------------------------------
+// Both passes walk the blocks in the order decodeCoefficients() stored them
+// and produce the same symbol stream: the first one counts, the second one
+// writes codes and magnitude bits.
+template <typename Emit>
+static void walk_symbols(const std::vector<int16_t>& coefs, const std::vector<Component>& comps, Emit emit) {
+    int blocks_per_mcu = 0;
+    for (const Component& c : comps)
+        blocks_per_mcu += c.hor_sr * c.ver_sr;
+    size_t num_mcu = coefs.size() / (64 * blocks_per_mcu);
+    int last_dc[3] = {0, 0, 0};
+    const int16_t* block = coefs.data();
+
+    for (size_t m = 0; m < num_mcu; m++) {
+        for (size_t comp = 0; comp < comps.size(); comp++) {
+            int dc_id = comps[comp].hf_table_dc_id;
+            int ac_id = comps[comp].hf_table_ac_id;
+            for (int b = 0; b < comps[comp].hor_sr * comps[comp].ver_sr; b++, block += 64) {
+                int diff = block[0] - last_dc[comp];
+                last_dc[comp] = block[0];
+                int nbits = category(diff);
+                emit(DC_CLASS, dc_id, nbits, nbits, diff < 0 ? diff - 1 : diff);
+
+                int run = 0;
+                for (int z = 1; z < 64; z++) {
+                    int v = block[z];
+                    if (v == 0) {
+                        run++;
+                        continue;
+                    }
+                    for (; run > 15; run -= 16)
+                        emit(AC_CLASS, ac_id, 0xF0, 0, 0); // ZRL
+                    nbits = category(v);
+                    emit(AC_CLASS, ac_id, (run << 4) | nbits, nbits, v < 0 ? v - 1 : v);
+                    run = 0;
+                }
+                if (run > 0)
+                    emit(AC_CLASS, ac_id, 0x00, 0, 0); // EOB
+            }
+        }
+    }
+}
+
+// Optimal code lengths limited to 16 bits (JPEG spec K.2, as in libjpeg's
+// jpeg_gen_optimal_table). freq[256] is a reserved one-count symbol that
+// keeps the all-ones code out of the table.
+static void gen_optimal_table(const long* counts, huff_table& tbl) {
+    long freq[257];
+    int codesize[257];
+    int others[257];
+    int bits[MAX_CLEN + 1];
+    memcpy(freq, counts, sizeof(freq));
+    freq[256] = 1;
+    memset(codesize, 0, sizeof(codesize));
+    memset(bits, 0, sizeof(bits));
+    for (int i = 0; i < 257; i++)
+        others[i] = -1;
+
+    for (;;) {
+        // c1: least frequent symbol, c2: the next one (ties go to the larger value)
+        int c1 = -1, c2 = -1;
+        long v = 1000000000L;
+        for (int i = 0; i <= 256; i++) {
+            if (freq[i] && freq[i] <= v) {
+                v = freq[i];
+                c1 = i;
+            }
+        }
+        v = 1000000000L;
+        for (int i = 0; i <= 256; i++) {
+            if (freq[i] && freq[i] <= v && i != c1) {
+                v = freq[i];
+                c2 = i;
+            }
+        }
+        if (c2 < 0)
+            break;
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+        codesize[c1]++;
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+        codesize[c2]++;
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    for (int i = 0; i <= 256; i++)
+        if (codesize[i])
+            bits[codesize[i]]++;
+
+    // Move the longest codes up the tree until nothing exceeds 16 bits
+    for (int i = MAX_CLEN; i > 16; i--) {
+        while (bits[i] > 0) {
+            int j = i - 2;
+            while (bits[j] == 0)
+                j--;
+            bits[i] -= 2;
+            bits[i - 1]++;
+            bits[j + 1] += 2;
+            bits[j]--;
+        }
+    }
+    // Drop the reserved symbol, it holds one of the longest codes
+    int i = 16;
+    while (bits[i] == 0)
+        i--;
+    bits[i]--;
+
+    memset(tbl.bits, 0, sizeof(tbl.bits));
+    for (int l = 1; l <= 16; l++)
+        tbl.bits[l] = bits[l];
+    int p = 0;
+    for (int l = 1; l <= MAX_CLEN; l++)
+        for (int s = 0; s < 256; s++)
+            if (codesize[s] == l)
+                tbl.huffval[p++] = s;
+    tbl.num_symbols = p;
+
+    // Canonical codes
+    memset(tbl.size, 0, sizeof(tbl.size));
+    uint16_t code = 0;
+    p = 0;
+    for (int l = 1; l <= 16; l++) {
+        for (int n = 0; n < tbl.bits[l]; n++) {
+            tbl.code[tbl.huffval[p]] = code++;
+            tbl.size[tbl.huffval[p]] = l;
+            p++;
+        }
+        code <<= 1;
+    }
+}
+
+static void put_u16(std::vector<uint8_t>& out, int v) {
+    out.push_back(v >> 8);
+    out.push_back(v & 0xFF);
+}
+
+// -------------------------------------------------------------
+// Returns false (with a reason) for files that cannot be rewritten
+static bool optimize(const std::vector<uint8_t>& in, std::vector<uint8_t>& out, std::string& error) {
+    // Only single scan baseline files without restart markers
+    size_t pos = 2;
+    size_t sos = 0;
+    while (pos + 4 <= in.size()) {
+        if (in[pos] != 0xFF) {
+            error = "malformed segment";
+            return false;
+        }
+        uint8_t marker = in[pos + 1];
+        if (marker == 0xFF) { // fill byte
+            pos++;
+            continue;
+        }
+        size_t length = (in[pos + 2] << 8) | in[pos + 3];
+        if (marker == 0xDA) {
+            sos = pos;
+            break;
+        }
+        if (marker == 0xDD) {
+            error = "restart intervals are not supported";
+            return false;
+        }
+        if (marker >= 0xC1 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            error = "not a baseline JPEG";
+            return false;
+        }
+        pos += 2 + length;
+    }
+    if (sos == 0) {
+        error = "no scan";
+        return false;
+    }
+
+    JPEG jpeg(in, true, false);
+    if (!jpeg.decodeCoefficients()) {
+        error = "cannot decode";
+        return false;
+    }
+    const std::vector<int16_t>& coefs = jpeg.coefficients();
+    const std::vector<Component>& comps = jpeg.frameComponents();
+
+    table_set ts;
+    memset(&ts, 0, sizeof(ts));
+    walk_symbols(coefs, comps, [&ts](int cls, int id, int symbol, int, int) {
+        ts.freq[cls][id][symbol]++;
+        ts.used[cls][id] = true;
+    });
+
+    // Segments before the scan, the old tables are replaced by one DHT
+    out.clear();
+    out.reserve(in.size());
+    out.insert(out.end(), in.begin(), in.begin() + 2);
+    for (pos = 2; pos < sos; ) {
+        if (in[pos + 1] == 0xFF) {
+            pos++;
+            continue;
+        }
+        size_t length = (in[pos + 2] << 8) | in[pos + 3];
+        if (in[pos + 1] != 0xC4)
+            out.insert(out.end(), in.begin() + pos, in.begin() + pos + 2 + length);
+        pos += 2 + length;
+    }
+
+    size_t dht_length = 2;
+    for (int cls = 0; cls < 2; cls++) {
+        for (int id = 0; id < 4; id++) {
+            if (!ts.used[cls][id])
+                continue;
+            gen_optimal_table(ts.freq[cls][id], ts.table[cls][id]);
+            dht_length += 17 + ts.table[cls][id].num_symbols;
+        }
+    }
+    put_u16(out, 0xFFC4);
+    put_u16(out, dht_length);
+    for (int cls = 0; cls < 2; cls++) {
+        for (int id = 0; id < 4; id++) {
+            if (!ts.used[cls][id])
+                continue;
+            const huff_table& tbl = ts.table[cls][id];
+            out.push_back((cls << 4) | id);
+            out.insert(out.end(), tbl.bits + 1, tbl.bits + 17);
+            out.insert(out.end(), tbl.huffval, tbl.huffval + tbl.num_symbols);
+        }
+    }
+
+    size_t sos_length = (in[sos + 2] << 8) | in[sos + 3];
+    out.insert(out.end(), in.begin() + sos, in.begin() + sos + 2 + sos_length);
+
+    BitWriter writer(out);
+    walk_symbols(coefs, comps, [&ts, &writer](int cls, int id, int symbol, int nbits, int value) {
+        const huff_table& tbl = ts.table[cls][id];
+        writer.put(tbl.code[symbol], tbl.size[symbol]);
+        if (nbits)
+            writer.put(value, nbits);
+    });
+    writer.flush();
+    put_u16(out, 0xFFD9);
+
+    // The rewritten file must carry exactly the same coefficients
+    JPEG check(out, true, false);
+    if (!check.decodeCoefficients() || check.coefficients() != coefs) {
+        error = "verification failed";
+        return false;
+    }
+    return true;
+}
+
+// -------------------------------------------------------------
+// Seconds per call of fn, repeated until at least 0.2s were spent
+template <typename Fn>
+static double time_per_call(Fn fn) {
+    typedef std::chrono::steady_clock clock;
+    int runs = 0;
+    clock::time_point start = clock::now();
+    double elapsed;
+    do {
+        fn();
+        runs++;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    } while (elapsed < 0.2 || runs < 3);
+    return elapsed / runs;
+}
+
+static int bench(int num_files, char** files) {
+    size_t total_in = 0, total_out = 0;
+    double total_raw = 0, t_opt = 0, t_dec_in = 0, t_dec_out = 0;
+
+    printf("%-32s %10s %10s %7s %9s %10s %10s\n",
+           "file", "bytes", "optimized", "saved", "opt MB/s", "dec MB/s", "dec' MB/s");
+    for (int i = 0; i < num_files; i++) {
+        std::vector<uint8_t> in, out;
+        std::string error;
+        if (!read_file(files[i], in)) {
+            printf("%-32s cannot read\n", files[i]);
+            continue;
+        }
+        if (!optimize(in, out, error)) {
+            printf("%-32s skipped: %s\n", files[i], error.c_str());
+            continue;
+        }
+
+        JPEG probe(in, true, false);
+        probe.decodeCoefficients();
+        // Decode throughput is measured on the raw image size so that both
+        // versions are compared on the same amount of work
+        double raw = static_cast<double>(probe.width()) * probe.height() * probe.channels();
+
+        double opt = time_per_call([&] { optimize(in, out, error); });
+        double dec_in = time_per_call([&] { JPEG(in, true, false).decodeCoefficients(); });
+        double dec_out = time_per_call([&] { JPEG(out, true, false).decodeCoefficients(); });
+
+        printf("%-32s %10zu %10zu %6.2f%% %9.2f %10.2f %10.2f\n", files[i], in.size(), out.size(),
+               100.0 * (in.size() - static_cast<double>(out.size())) / in.size(),
+               in.size() / opt / 1e6, raw / dec_in / 1e6, raw / dec_out / 1e6);
+        total_in += in.size();
+        total_out += out.size();
+        total_raw += raw;
+        t_opt += opt;
+        t_dec_in += dec_in;
+        t_dec_out += dec_out;
+    }
+    if (total_in == 0)
+        return 1;
+    printf("%-32s %10zu %10zu %6.2f%% %9.2f %10.2f %10.2f\n", "total", total_in, total_out,
+           100.0 * (total_in - static_cast<double>(total_out)) / total_in,
+           total_in / t_opt / 1e6, total_raw / t_dec_in / 1e6, total_raw / t_dec_out / 1e6);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 3 && strcmp(argv[1], "-bench") == 0)
+        return bench(argc - 2, argv + 2);
+    if (argc != 3) {
+        fprintf(stderr, usage_msg, argv[0], argv[0]);
+        return 1;
+    }
+
+    std::vector<uint8_t> in, out;
+    std::string error;
+    if (!read_file(argv[1], in)) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (!optimize(in, out, error)) {
+        fprintf(stderr, "%s: %s\n", argv[1], error.c_str());
+        return 1;
+    }
+    if (!write_file(argv[2], out)) {
+        perror(argv[2]);
+        return 1;
+    }
+    printf("%zu -> %zu bytes (%.2f%% smaller)\n", in.size(), out.size(),
+           100.0 * (in.size() - static_cast<double>(out.size())) / in.size());
+    return 0;
+}
@@ -1,6 +1,11 @@
 #include "qdbmp.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 /* Bitmap header */
@@ -31,11 +36,15 @@ struct _BMP
 	BMP_Header	Header;
 	UCHAR*		Palette;
 	UCHAR*		Data;
+	UINT		BytesPerRow;		/* Row size including padding (multiple of 4) */
+	UCHAR*		Map;				/* File mapping holding header, palette and data (NULL if not mapped) */
+	size_t		MapSize;			/* Length of the mapping */
+	char*		MapFilename;		/* Output file backing the mapping (BMP_CreateMapped only) */
 };
 
 
-/* Holds the last error code */
-static BMP_STATUS BMP_LAST_ERROR_CODE = BMP_OK;
+/* Holds the last error code (per thread, the decode service runs several workers) */
+static __thread BMP_STATUS BMP_LAST_ERROR_CODE = BMP_OK;
 
 
 /* Error description strings */
@@ -57,11 +66,19 @@ static const char* BMP_ERROR_STRING[] =
 #define BMP_PALETTE_SIZE	( 256 * 4 )
 
 
+/* Size of the file header plus the info header */
+#define BMP_HEADER_SIZE		54
+
+
 
 /*********************************** Forward declarations **********************************/
 int		ReadHeader	( BMP* bmp, FILE* f );
 int		WriteHeader	( BMP* bmp, FILE* f );
 
+int		SetupHeader	( BMP* bmp, UINT width, UINT height, USHORT depth );
+void	ReadHeaderBuffer	( BMP* bmp, const UCHAR* buf );
+void	WriteHeaderBuffer	( BMP* bmp, UCHAR* buf );
+
 int		ReadUINT	( UINT* x, FILE* f );
 int		ReadUSHORT	( USHORT *x, FILE* f );
 
@@ -83,21 +100,6 @@ int		WriteUSHORT	( USHORT x, FILE* f );
 BMP* BMP_Create( UINT width, UINT height, USHORT depth )
 {
 	BMP*	bmp;
-	int		bytes_per_pixel = depth >> 3;
-	UINT	bytes_per_row;
-
-	if ( height <= 0 || width <= 0 )
-	{
-		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
-		return NULL;
-	}
-
-	if ( depth != 8 && depth != 24 && depth != 32 )
-	{
-		BMP_LAST_ERROR_CODE = BMP_FILE_NOT_SUPPORTED;
-		return NULL;
-	}
-
 
 	/* Allocate the bitmap data structure */
 	bmp = (BMP*)calloc( 1, sizeof( BMP ) );
@@ -108,32 +110,12 @@ BMP* BMP_Create( UINT width, UINT height, USHORT depth )
 	}
 
 
-	/* Set header' default values */
-	bmp->Header.Magic				= 0x4D42;
-	bmp->Header.Reserved1			= 0;
-	bmp->Header.Reserved2			= 0;
-	bmp->Header.HeaderSize			= 40;
-	bmp->Header.Planes				= 1;
-	bmp->Header.CompressionType		= 0;
-	bmp->Header.HPixelsPerMeter		= 0;
-	bmp->Header.VPixelsPerMeter		= 0;
-	bmp->Header.ColorsUsed			= 0;
-	bmp->Header.ColorsRequired		= 0;
-
-
-	/* Calculate the number of bytes used to store a single image row. This is always
-	rounded up to the next multiple of 4. */
-	bytes_per_row = width * bytes_per_pixel;
-	bytes_per_row += ( bytes_per_row % 4 ? 4 - bytes_per_row % 4 : 0 );
-
-
-	/* Set header's image specific values */
-	bmp->Header.Width				= width;
-	bmp->Header.Height				= height;
-	bmp->Header.BitsPerPixel		= depth;
-	bmp->Header.ImageDataSize		= bytes_per_row * height;
-	bmp->Header.FileSize			= bmp->Header.ImageDataSize + 54 + ( depth == 8 ? BMP_PALETTE_SIZE : 0 );
-	bmp->Header.DataOffset			= 54 + ( depth == 8 ? BMP_PALETTE_SIZE : 0 );
+	/* Set header */
+	if ( SetupHeader( bmp, width, height, depth ) != BMP_OK )
+	{
+		free( bmp );
+		return NULL;
+	}
 
 
 	/* Allocate palette */
@@ -180,6 +162,16 @@ void BMP_Free( BMP* bmp )
 		return;
 	}
 
+	/* Palette and data live inside the mapping */
+	if ( bmp->Map != NULL )
+	{
+		munmap( bmp->Map, bmp->MapSize );
+		free( bmp->MapFilename );
+		free( bmp );
+		BMP_LAST_ERROR_CODE = BMP_OK;
+		return;
+	}
+
 	if ( bmp->Palette != NULL )
 	{
 		free( bmp->Palette );
@@ -279,6 +271,7 @@ BMP* BMP_ReadFile( const char* filename )
 
 
 	/* Allocate memory for image data */
+	bmp->BytesPerRow = bmp->Header.ImageDataSize / bmp->Header.Height;
 	bmp->Data = (UCHAR*) malloc( bmp->Header.ImageDataSize );
 	if ( bmp->Data == NULL )
 	{
@@ -317,13 +310,27 @@ void BMP_WriteFile( BMP* bmp, const char* filename )
 {
 	FILE*	f;
 
-	if ( filename == NULL )
+	if ( bmp == NULL || filename == NULL )
 	{
 		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
 		return;
 	}
 
 
+	/* Pixels of a mapped output file are already in place */
+	if ( bmp->MapFilename != NULL && strcmp( bmp->MapFilename, filename ) == 0 )
+	{
+		if ( msync( bmp->Map, bmp->MapSize, MS_ASYNC ) != 0 )
+		{
+			BMP_LAST_ERROR_CODE = BMP_IO_ERROR;
+			return;
+		}
+
+		BMP_LAST_ERROR_CODE = BMP_OK;
+		return;
+	}
+
+
 	/* Open file */
 	f = fopen( filename, "wb" );
 	if ( f == NULL )
@@ -368,6 +375,237 @@ void BMP_WriteFile( BMP* bmp, const char* filename )
 }
 
 
+/**************************************************************
+	Serializes the BMP image into a newly allocated buffer
+	holding the complete file. The caller frees the buffer.
+**************************************************************/
+UCHAR* BMP_WriteMemory( BMP* bmp, UINT* size )
+{
+	UCHAR*	buf;
+	UCHAR*	p;
+
+	if ( bmp == NULL || size == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+	buf = (UCHAR*) malloc( bmp->Header.FileSize );
+	if ( buf == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_OUT_OF_MEMORY;
+		return NULL;
+	}
+
+	WriteHeaderBuffer( bmp, buf );
+	p = buf + BMP_HEADER_SIZE;
+	if ( bmp->Palette )
+	{
+		memcpy( p, bmp->Palette, BMP_PALETTE_SIZE );
+		p += BMP_PALETTE_SIZE;
+	}
+	memcpy( p, bmp->Data, bmp->Header.ImageDataSize );
+
+	*size = bmp->Header.FileSize;
+
+	BMP_LAST_ERROR_CODE = BMP_OK;
+
+	return buf;
+}
+
+
+/**************************************************************
+	Maps the specified BMP image file into memory. Pixels are
+	read straight from the page cache; writes stay private to
+	the process.
+**************************************************************/
+BMP* BMP_MapFile( const char* filename )
+{
+	BMP*		bmp;
+	int			fd;
+	struct stat	st;
+	UCHAR*		map;
+	uint64_t	bytes_per_row;
+	uint64_t	data_size;
+
+	if ( filename == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+
+	/* Open and map file */
+	fd = open( filename, O_RDONLY );
+	if ( fd < 0 )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_NOT_FOUND;
+		return NULL;
+	}
+
+	if ( fstat( fd, &st ) != 0 || st.st_size < BMP_HEADER_SIZE )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_INVALID;
+		close( fd );
+		return NULL;
+	}
+
+	map = (UCHAR*) mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if ( map == MAP_FAILED )
+	{
+		BMP_LAST_ERROR_CODE = BMP_IO_ERROR;
+		return NULL;
+	}
+
+
+	/* Allocate */
+	bmp = (BMP*)calloc( 1, sizeof( BMP ) );
+	if ( bmp == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_OUT_OF_MEMORY;
+		munmap( map, st.st_size );
+		return NULL;
+	}
+
+	bmp->Map = map;
+	bmp->MapSize = st.st_size;
+
+
+	/* Read header and verify that the bitmap variant is supported */
+	ReadHeaderBuffer( bmp, map );
+	if ( bmp->Header.Magic != 0x4D42 )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_INVALID;
+		BMP_Free( bmp );
+		return NULL;
+	}
+
+	/* Negative heights (top-down bitmaps) are not supported either */
+	if ( ( bmp->Header.BitsPerPixel != 32 && bmp->Header.BitsPerPixel != 24 && bmp->Header.BitsPerPixel != 8 )
+		|| bmp->Header.CompressionType != 0 || bmp->Header.HeaderSize != 40
+		|| (int) bmp->Header.Width <= 0 || (int) bmp->Header.Height <= 0 )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_NOT_SUPPORTED;
+		BMP_Free( bmp );
+		return NULL;
+	}
+
+
+	/* Locate palette and image data inside the mapping. Sizes come from the
+	header, so they are computed on 64 bits (UINT may be 32) and checked
+	against the file before anything is read. Width and height are below
+	2^31, so the product cannot wrap. */
+	bytes_per_row = (uint64_t) bmp->Header.Width * ( bmp->Header.BitsPerPixel >> 3 );
+	bytes_per_row += ( bytes_per_row % 4 ? 4 - bytes_per_row % 4 : 0 );
+	data_size = bytes_per_row * bmp->Header.Height;
+
+	if ( bmp->Header.DataOffset < BMP_HEADER_SIZE
+		|| (uint64_t) bmp->Header.DataOffset + data_size > bmp->MapSize
+		|| ( bmp->Header.BitsPerPixel == 8 && BMP_HEADER_SIZE + BMP_PALETTE_SIZE > bmp->Header.DataOffset ) )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_INVALID;
+		BMP_Free( bmp );
+		return NULL;
+	}
+
+	bmp->BytesPerRow = (UINT) bytes_per_row;
+	bmp->Header.ImageDataSize = (UINT) data_size;
+	bmp->Palette = ( bmp->Header.BitsPerPixel == 8 ? map + BMP_HEADER_SIZE : NULL );
+	bmp->Data = map + bmp->Header.DataOffset;
+
+	BMP_LAST_ERROR_CODE = BMP_OK;
+
+	return bmp;
+}
+
+
+/**************************************************************
+	Creates a blank BMP image backed by a memory mapping of
+	the specified output file. Pixels are written straight
+	into the file, BMP_WriteFile() with the same filename
+	only flushes the mapping.
+**************************************************************/
+BMP* BMP_CreateMapped( const char* filename, UINT width, UINT height, USHORT depth )
+{
+	BMP*	bmp;
+	int		fd;
+	UCHAR*	map;
+
+	if ( filename == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+
+	/* Allocate the bitmap data structure */
+	bmp = (BMP*)calloc( 1, sizeof( BMP ) );
+	if ( bmp == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_OUT_OF_MEMORY;
+		return NULL;
+	}
+
+	if ( SetupHeader( bmp, width, height, depth ) != BMP_OK )
+	{
+		free( bmp );
+		return NULL;
+	}
+
+	bmp->MapFilename = strdup( filename );
+	if ( bmp->MapFilename == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_OUT_OF_MEMORY;
+		free( bmp );
+		return NULL;
+	}
+
+
+	/* Create the output file at its final size and map it */
+	fd = open( filename, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+	if ( fd < 0 )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_NOT_FOUND;
+		free( bmp->MapFilename );
+		free( bmp );
+		return NULL;
+	}
+
+	if ( ftruncate( fd, bmp->Header.FileSize ) != 0 )
+	{
+		BMP_LAST_ERROR_CODE = BMP_IO_ERROR;
+		close( fd );
+		free( bmp->MapFilename );
+		free( bmp );
+		return NULL;
+	}
+
+	map = (UCHAR*) mmap( NULL, bmp->Header.FileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( map == MAP_FAILED )
+	{
+		BMP_LAST_ERROR_CODE = BMP_IO_ERROR;
+		free( bmp->MapFilename );
+		free( bmp );
+		return NULL;
+	}
+
+	bmp->Map = map;
+	bmp->MapSize = bmp->Header.FileSize;
+
+
+	/* The file is zero filled, only the header needs to be written */
+	WriteHeaderBuffer( bmp, map );
+	bmp->Palette = ( depth == 8 ? map + BMP_HEADER_SIZE : NULL );
+	bmp->Data = map + bmp->Header.DataOffset;
+
+	BMP_LAST_ERROR_CODE = BMP_OK;
+
+	return bmp;
+}
+
+
 /**************************************************************
 	Returns the image's width.
 **************************************************************/
@@ -440,7 +678,7 @@ void BMP_GetPixelRGB( BMP* bmp, UINT x, UINT y, UCHAR* r, UCHAR* g, UCHAR* b )
 		bytes_per_pixel = bmp->Header.BitsPerPixel >> 3;
 
 		/* Row's size is rounded up to the next multiple of 4 bytes */
-		bytes_per_row = bmp->Header.ImageDataSize / bmp->Header.Height;
+		bytes_per_row = bmp->BytesPerRow;
 
 		/* Calculate the location of the relevant pixel (rows are flipped) */
 		pixel = bmp->Data + ( ( bmp->Header.Height - y - 1 ) * bytes_per_row + x * bytes_per_pixel );
@@ -486,7 +724,7 @@ void BMP_SetPixelRGB( BMP* bmp, UINT x, UINT y, UCHAR r, UCHAR g, UCHAR b )
 		bytes_per_pixel = bmp->Header.BitsPerPixel >> 3;
 
 		/* Row's size is rounded up to the next multiple of 4 bytes */
-		bytes_per_row = bmp->Header.ImageDataSize / bmp->Header.Height;
+		bytes_per_row = bmp->BytesPerRow;
 
 		/* Calculate the location of the relevant pixel (rows are flipped) */
 		pixel = bmp->Data + ( ( bmp->Header.Height - y - 1 ) * bytes_per_row + x * bytes_per_pixel );
@@ -522,7 +760,7 @@ void BMP_GetPixelIndex( BMP* bmp, UINT x, UINT y, UCHAR* val )
 		BMP_LAST_ERROR_CODE = BMP_OK;
 
 		/* Row's size is rounded up to the next multiple of 4 bytes */
-		bytes_per_row = bmp->Header.ImageDataSize / bmp->Header.Height;
+		bytes_per_row = bmp->BytesPerRow;
 
 		/* Calculate the location of the relevant pixel */
 		pixel = bmp->Data + ( ( bmp->Header.Height - y - 1 ) * bytes_per_row + x );
@@ -556,7 +794,7 @@ void BMP_SetPixelIndex( BMP* bmp, UINT x, UINT y, UCHAR val )
 		BMP_LAST_ERROR_CODE = BMP_OK;
 
 		/* Row's size is rounded up to the next multiple of 4 bytes */
-		bytes_per_row = bmp->Header.ImageDataSize / bmp->Header.Height;
+		bytes_per_row = bmp->BytesPerRow;
 
 		/* Calculate the location of the relevant pixel */
 		pixel = bmp->Data + ( ( bmp->Header.Height - y - 1 ) * bytes_per_row + x );
@@ -566,6 +804,43 @@ void BMP_SetPixelIndex( BMP* bmp, UINT x, UINT y, UCHAR val )
 }
 
 
+/**************************************************************
+	Returns a pointer to the specified row's pixels (BGR(A)
+	bytes, or palette indices for 8 BPP images).
+**************************************************************/
+UCHAR* BMP_GetRow( BMP* bmp, UINT y )
+{
+	if ( bmp == NULL || y >= bmp->Header.Height )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return NULL;
+	}
+
+	BMP_LAST_ERROR_CODE = BMP_OK;
+
+	/* Rows are flipped */
+	return bmp->Data + ( bmp->Header.Height - y - 1 ) * bmp->BytesPerRow;
+}
+
+
+/**************************************************************
+	Copies a whole row of pixels, given in the same layout
+	BMP_GetRow() returns.
+**************************************************************/
+void BMP_SetRow( BMP* bmp, UINT y, const UCHAR* pixels )
+{
+	UCHAR*	row;
+
+	if ( pixels == NULL || ( row = BMP_GetRow( bmp, y ) ) == NULL )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return;
+	}
+
+	memcpy( row, pixels, bmp->Header.Width * ( bmp->Header.BitsPerPixel >> 3 ) );
+}
+
+
 /**************************************************************
 	Gets the color value for the specified palette index.
 **************************************************************/
@@ -649,6 +924,60 @@ const char* BMP_GetErrorDescription()
 /*********************************** Private methods **********************************/
 
 
+/**************************************************************
+	Fills in the header of a new image with the specified
+	dimensions and bit depth. Returns BMP_OK on success.
+**************************************************************/
+int SetupHeader( BMP* bmp, UINT width, UINT height, USHORT depth )
+{
+	int		bytes_per_pixel = depth >> 3;
+	UINT	bytes_per_row;
+
+	if ( height <= 0 || width <= 0 )
+	{
+		BMP_LAST_ERROR_CODE = BMP_INVALID_ARGUMENT;
+		return BMP_INVALID_ARGUMENT;
+	}
+
+	if ( depth != 8 && depth != 24 && depth != 32 )
+	{
+		BMP_LAST_ERROR_CODE = BMP_FILE_NOT_SUPPORTED;
+		return BMP_FILE_NOT_SUPPORTED;
+	}
+
+
+	/* Set header' default values */
+	bmp->Header.Magic				= 0x4D42;
+	bmp->Header.Reserved1			= 0;
+	bmp->Header.Reserved2			= 0;
+	bmp->Header.HeaderSize			= 40;
+	bmp->Header.Planes				= 1;
+	bmp->Header.CompressionType		= 0;
+	bmp->Header.HPixelsPerMeter		= 0;
+	bmp->Header.VPixelsPerMeter		= 0;
+	bmp->Header.ColorsUsed			= 0;
+	bmp->Header.ColorsRequired		= 0;
+
+
+	/* Calculate the number of bytes used to store a single image row. This is always
+	rounded up to the next multiple of 4. */
+	bytes_per_row = width * bytes_per_pixel;
+	bytes_per_row += ( bytes_per_row % 4 ? 4 - bytes_per_row % 4 : 0 );
+	bmp->BytesPerRow = bytes_per_row;
+
+
+	/* Set header's image specific values */
+	bmp->Header.Width				= width;
+	bmp->Header.Height				= height;
+	bmp->Header.BitsPerPixel		= depth;
+	bmp->Header.ImageDataSize		= bytes_per_row * height;
+	bmp->Header.FileSize			= bmp->Header.ImageDataSize + BMP_HEADER_SIZE + ( depth == 8 ? BMP_PALETTE_SIZE : 0 );
+	bmp->Header.DataOffset			= BMP_HEADER_SIZE + ( depth == 8 ? BMP_PALETTE_SIZE : 0 );
+
+	return BMP_OK;
+}
+
+
 /**************************************************************
 	Reads the BMP file's header into the data structure.
 	Returns BMP_OK on success.
@@ -717,6 +1046,63 @@ int	WriteHeader( BMP* bmp, FILE* f )
 }
 
 
+/**************************************************************
+	Reads the header from the first BMP_HEADER_SIZE bytes of
+	a buffer (e.g. a file mapping).
+**************************************************************/
+#define GET_USHORT( p )		( (USHORT)( (p)[ 1 ] << 8 | (p)[ 0 ] ) )
+/* 32-bit fields: a byte shifted as int would sign extend into a 64-bit UINT */
+#define GET_UINT( p )		( (UINT)( (uint32_t) (p)[ 3 ] << 24 | (p)[ 2 ] << 16 | (p)[ 1 ] << 8 | (p)[ 0 ] ) )
+
+void ReadHeaderBuffer( BMP* bmp, const UCHAR* buf )
+{
+	bmp->Header.Magic			= GET_USHORT( buf + 0 );
+	bmp->Header.FileSize		= GET_UINT( buf + 2 );
+	bmp->Header.Reserved1		= GET_USHORT( buf + 6 );
+	bmp->Header.Reserved2		= GET_USHORT( buf + 8 );
+	bmp->Header.DataOffset		= GET_UINT( buf + 10 );
+	bmp->Header.HeaderSize		= GET_UINT( buf + 14 );
+	bmp->Header.Width			= GET_UINT( buf + 18 );
+	bmp->Header.Height			= GET_UINT( buf + 22 );
+	bmp->Header.Planes			= GET_USHORT( buf + 26 );
+	bmp->Header.BitsPerPixel	= GET_USHORT( buf + 28 );
+	bmp->Header.CompressionType	= GET_UINT( buf + 30 );
+	bmp->Header.ImageDataSize	= GET_UINT( buf + 34 );
+	bmp->Header.HPixelsPerMeter	= GET_UINT( buf + 38 );
+	bmp->Header.VPixelsPerMeter	= GET_UINT( buf + 42 );
+	bmp->Header.ColorsUsed		= GET_UINT( buf + 46 );
+	bmp->Header.ColorsRequired	= GET_UINT( buf + 50 );
+}
+
+
+/**************************************************************
+	Writes the header into the first BMP_HEADER_SIZE bytes of
+	a buffer.
+**************************************************************/
+#define PUT_USHORT( p, x )	do { (p)[ 0 ] = (UCHAR)( (x) & 0xff ); (p)[ 1 ] = (UCHAR)( ( (x) >> 8 ) & 0xff ); } while ( 0 )
+#define PUT_UINT( p, x )	do { PUT_USHORT( (p), (x) & 0xffff ); PUT_USHORT( (p) + 2, ( (x) >> 16 ) & 0xffff ); } while ( 0 )
+
+void WriteHeaderBuffer( BMP* bmp, UCHAR* buf )
+{
+	PUT_USHORT( buf + 0, bmp->Header.Magic );
+	PUT_UINT( buf + 2, bmp->Header.FileSize );
+	PUT_USHORT( buf + 6, bmp->Header.Reserved1 );
+	PUT_USHORT( buf + 8, bmp->Header.Reserved2 );
+	PUT_UINT( buf + 10, bmp->Header.DataOffset );
+	PUT_UINT( buf + 14, bmp->Header.HeaderSize );
+	PUT_UINT( buf + 18, bmp->Header.Width );
+	PUT_UINT( buf + 22, bmp->Header.Height );
+	PUT_USHORT( buf + 26, bmp->Header.Planes );
+	PUT_USHORT( buf + 28, bmp->Header.BitsPerPixel );
+	PUT_UINT( buf + 30, bmp->Header.CompressionType );
+	PUT_UINT( buf + 34, bmp->Header.ImageDataSize );
+	PUT_UINT( buf + 38, bmp->Header.HPixelsPerMeter );
+	PUT_UINT( buf + 42, bmp->Header.VPixelsPerMeter );
+	PUT_UINT( buf + 46, bmp->Header.ColorsUsed );
+	PUT_UINT( buf + 50, bmp->Header.ColorsRequired );
+}
+
+
 /**************************************************************
 	Reads a little-endian unsigned int from the file.
 	Returns non-zero on success.
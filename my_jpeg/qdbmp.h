@@ -97,6 +97,12 @@ void			BMP_Free					( BMP* bmp );
 /* I/O */
 BMP*			BMP_ReadFile				( const char* filename );
 void			BMP_WriteFile				( BMP* bmp, const char* filename );
+UCHAR*			BMP_WriteMemory				( BMP* bmp, UINT* size );
+
+
+/* Memory mapped I/O */
+BMP*			BMP_MapFile					( const char* filename );
+BMP*			BMP_CreateMapped			( const char* filename, UINT width, UINT height, USHORT depth );
 
 
 /* Meta info */
@@ -112,6 +118,11 @@ void			BMP_GetPixelIndex			( BMP* bmp, UINT x, UINT y, UCHAR* val );
 void			BMP_SetPixelIndex			( BMP* bmp, UINT x, UINT y, UCHAR val );
 
 
+/* Row access (rows are stored in file order: BGR(A) or palette indices) */
+UCHAR*			BMP_GetRow					( BMP* bmp, UINT y );
+void			BMP_SetRow					( BMP* bmp, UINT y, const UCHAR* pixels );
+
+
 /* Palette handling */
 void			BMP_GetPaletteColor			( BMP* bmp, UCHAR index, UCHAR* r, UCHAR* g, UCHAR* b );
 void			BMP_SetPaletteColor			( BMP* bmp, UCHAR index, UCHAR r, UCHAR g, UCHAR b );
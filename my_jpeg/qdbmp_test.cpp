@@ -0,0 +1,109 @@
+// qdbmp_test: BMP_MapFile against headers that do not match the file
+//
+// usage: ./qdbmp_test
+//
+// Writes a small valid BMP, then copies of it with a header lying about the
+// size of the image, and checks that only the valid one is mapped. Exits 1
+// if any check failed.
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include "qdbmp.h"
+#include "checks.h"
+
+// Header fields, as offsets in the file
+#define OFF_DATA_OFFSET 10
+#define OFF_WIDTH 18
+#define OFF_HEIGHT 22
+#define OFF_DEPTH 28
+
+static std::vector<uint8_t> read_file(const char* path) {
+    std::vector<uint8_t> bytes;
+    FILE* f = fopen(path, "rb");
+    int c;
+    while (f != NULL && (c = fgetc(f)) != EOF)
+        bytes.push_back(c);
+    if (f != NULL)
+        fclose(f);
+    return bytes;
+}
+
+static void put_u32(std::vector<uint8_t>& bytes, int off, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        bytes[off + i] = v >> (8 * i);
+}
+
+// Whether BMP_MapFile takes bytes, written to path
+static bool maps(const char* path, const std::vector<uint8_t>& bytes) {
+    write_file(path, bytes);
+    BMP* bmp = BMP_MapFile(path);
+    if (bmp == NULL)
+        return false;
+    BMP_Free(bmp);
+    return true;
+}
+
+int main() {
+    char path[] = "/tmp/qdbmp_test.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    close(fd);
+
+    // 5x3 at 24 bits: rows of 15 bytes padded to 16
+    BMP* bmp = BMP_Create(5, 3, 24);
+    BMP_WriteFile(bmp, path);
+    BMP_Free(bmp);
+    const std::vector<uint8_t> good = read_file(path);
+    CHECK(good.size() == 54 + 16 * 3);
+    CHECK(maps(path, good));
+
+    std::vector<uint8_t> bad;
+    // cut short: the last row is missing
+    bad.assign(good.begin(), good.end() - 16);
+    CHECK(!maps(path, bad));
+    // shorter than a header
+    bad.assign(good.begin(), good.begin() + 20);
+    CHECK(!maps(path, bad));
+    // more rows than the file holds
+    bad = good;
+    put_u32(bad, OFF_HEIGHT, 4);
+    CHECK(!maps(path, bad));
+    // rows of 2^31 bytes, 2 of them: 2^32 wraps to 0 where UINT is 32 bits
+    bad = good;
+    put_u32(bad, OFF_WIDTH, 1u << 29);
+    put_u32(bad, OFF_HEIGHT, 2);
+    bad[OFF_DEPTH] = 32;
+    CHECK(!maps(path, bad));
+    // width * 3 wraps on 32 bits, and a top bit set used to sign extend
+    bad = good;
+    put_u32(bad, OFF_WIDTH, 0x55555556);
+    CHECK(!maps(path, bad));
+    // negative height (top-down), zero and negative width
+    bad = good;
+    put_u32(bad, OFF_HEIGHT, (uint32_t) -3);
+    CHECK(!maps(path, bad));
+    bad = good;
+    put_u32(bad, OFF_WIDTH, 0);
+    CHECK(!maps(path, bad));
+    bad = good;
+    put_u32(bad, OFF_WIDTH, (uint32_t) -5);
+    CHECK(!maps(path, bad));
+    // data past the end of the file, or inside the header
+    bad = good;
+    put_u32(bad, OFF_DATA_OFFSET, 0xFFFFFFF0);
+    CHECK(!maps(path, bad));
+    bad = good;
+    put_u32(bad, OFF_DATA_OFFSET, 10);
+    CHECK(!maps(path, bad));
+
+    unlink(path);
+    if (!failed)
+        printf("qdbmp: ok\n");
+    return failed;
+}
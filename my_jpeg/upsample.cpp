@@ -0,0 +1,162 @@
+#include "upsample.h"
+#include <cstring>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// -------------------------------------------------------------
+// h2v1: every input sample covers two output samples
+void h2v1_replicate_row(const uint8_t* in, uint8_t* out, int in_width) {
+    int c = 0;
+#ifdef __SSE2__
+    for (; c + 16 <= in_width; c += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + c));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2*c), _mm_unpacklo_epi8(x, x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2*c + 16), _mm_unpackhi_epi8(x, x));
+    }
+#endif
+    for (; c < in_width; c++) {
+        out[2*c] = in[c];
+        out[2*c + 1] = in[c];
+    }
+}
+
+// Triangle filter (same weights as libjpeg's h2v1_fancy_upsample):
+// each output sample is 3/4 of the nearer input plus 1/4 of the further one.
+void h2v1_fancy_row(const uint8_t* in, uint8_t* out, int in_width) {
+    if (in_width == 1) {
+        out[0] = out[1] = in[0];
+        return;
+    }
+    out[0] = in[0];
+    out[1] = (in[0]*3 + in[1] + 2) >> 2;
+
+    int c = 1;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i two = _mm_set1_epi16(2);
+    for (; c + 9 <= in_width; c += 8) {
+        __m128i prev = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + c - 1)), zero);
+        __m128i cur  = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + c)), zero);
+        __m128i next = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in + c + 1)), zero);
+        __m128i cur3 = _mm_add_epi16(_mm_add_epi16(cur, cur), cur);
+        __m128i even = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(cur3, prev), one), 2);
+        __m128i odd  = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(cur3, next), two), 2);
+        // results fit in a byte, so (odd << 8 | even) is the interleaved pair
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2*c), _mm_or_si128(even, _mm_slli_epi16(odd, 8)));
+    }
+#endif
+    for (; c < in_width - 1; c++) {
+        int cur3 = in[c] * 3;
+        out[2*c] = (cur3 + in[c - 1] + 1) >> 2;
+        out[2*c + 1] = (cur3 + in[c + 1] + 2) >> 2;
+    }
+
+    c = in_width - 1;
+    out[2*c] = (in[c]*3 + in[c - 1] + 1) >> 2;
+    out[2*c + 1] = in[c];
+}
+
+// -------------------------------------------------------------
+// h2v2: triangle filter in both directions. The vertical pass mixes the
+// nearer input row (3/4) with the further one (1/4), then the horizontal
+// pass is the same as h2v1 on those column sums.
+void h2v2_fancy_row(const uint8_t* near, const uint8_t* far, uint8_t* out, int in_width) {
+    int last = in_width - 1;
+    int cs_first = near[0]*3 + far[0];
+    if (in_width == 1) {
+        out[0] = (cs_first*4 + 8) >> 4;
+        out[1] = (cs_first*4 + 7) >> 4;
+        return;
+    }
+    out[0] = (cs_first*4 + 8) >> 4;
+    out[1] = (cs_first*3 + near[1]*3 + far[1] + 7) >> 4;
+
+    int c = 1;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i seven = _mm_set1_epi16(7);
+    const __m128i eight = _mm_set1_epi16(8);
+    for (; c + 9 <= in_width; c += 8) {
+        __m128i n0 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(near + c - 1)), zero);
+        __m128i n1 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(near + c)), zero);
+        __m128i n2 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(near + c + 1)), zero);
+        __m128i f0 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(far + c - 1)), zero);
+        __m128i f1 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(far + c)), zero);
+        __m128i f2 = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(far + c + 1)), zero);
+        // column sums: 3*near + far (at most 1020, fits in 16 bits)
+        __m128i prev = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(n0, n0), n0), f0);
+        __m128i cur  = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(n1, n1), n1), f1);
+        __m128i next = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(n2, n2), n2), f2);
+        __m128i cur3 = _mm_add_epi16(_mm_add_epi16(cur, cur), cur);
+        __m128i even = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(cur3, prev), eight), 4);
+        __m128i odd  = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(cur3, next), seven), 4);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2*c), _mm_or_si128(even, _mm_slli_epi16(odd, 8)));
+    }
+#endif
+    for (; c < last; c++) {
+        int prev = near[c - 1]*3 + far[c - 1];
+        int cur3 = (near[c]*3 + far[c]) * 3;
+        int next = near[c + 1]*3 + far[c + 1];
+        out[2*c] = (cur3 + prev + 8) >> 4;
+        out[2*c + 1] = (cur3 + next + 7) >> 4;
+    }
+
+    int cs_last = near[last]*3 + far[last];
+    out[2*last] = (cs_last*3 + near[last - 1]*3 + far[last - 1] + 8) >> 4;
+    out[2*last + 1] = (cs_last*4 + 7) >> 4;
+}
+
+// -------------------------------------------------------------
+void int_replicate_row(const uint8_t* in, uint8_t* out, int in_width, int factor) {
+    if (factor == 1) {
+        memcpy(out, in, in_width);
+        return;
+    }
+    if (factor == 2) {
+        h2v1_replicate_row(in, out, in_width);
+        return;
+    }
+    for (int c = 0; c < in_width; c++) {
+        memset(out + c*factor, in[c], factor);
+    }
+}
+
+// -------------------------------------------------------------
+// Fixed point YCbCr -> RGB (16 fractional bits), tables built once
+namespace {
+struct ColorTables {
+    int cr_r[256];
+    int cb_b[256];
+    int cr_g[256];
+    int cb_g[256];
+
+    ColorTables() {
+        const int scale = 1 << 16;
+        const int half = 1 << 15;
+        for (int i = 0; i < 256; i++) {
+            int x = i - 128;
+            cr_r[i] = (static_cast<int>(1.40200 * scale + 0.5) * x + half) >> 16;
+            cb_b[i] = (static_cast<int>(1.77200 * scale + 0.5) * x + half) >> 16;
+            cr_g[i] = -static_cast<int>(0.714136 * scale + 0.5) * x;
+            cb_g[i] = -static_cast<int>(0.344136 * scale + 0.5) * x + half;
+        }
+    }
+};
+
+inline uint8_t clamp8(int v) {
+    return static_cast<uint8_t>(std::min(std::max(v, 0), 255));
+}
+}
+
+void ycc_to_bgr_row(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, uint8_t* bgr, int width) {
+    static const ColorTables tab;
+    for (int x = 0; x < width; x++) {
+        int Y = y[x];
+        bgr[3*x + 0] = clamp8(Y + tab.cb_b[cb[x]]);
+        bgr[3*x + 1] = clamp8(Y + ((tab.cb_g[cb[x]] + tab.cr_g[cr[x]]) >> 16));
+        bgr[3*x + 2] = clamp8(Y + tab.cr_r[cr[x]]);
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef UPSAMPLE_H
+#define UPSAMPLE_H
+
+#include <cstdint>
+
+// Row kernels used after IDCT. All of them work on planar 8-bit samples
+// (level shifted to 0..255) and process a whole row per call.
+
+// Chroma upsampling: `in` holds `in_width` samples, `out` receives the
+// upsampled row (2 * in_width samples unless stated otherwise).
+void h2v1_replicate_row(const uint8_t* in, uint8_t* out, int in_width);
+void h2v1_fancy_row(const uint8_t* in, uint8_t* out, int in_width);
+// near: input row closest to the output row, far: the row above/below it
+void h2v2_fancy_row(const uint8_t* near, const uint8_t* far, uint8_t* out, int in_width);
+// Generic integer factor replication (out gets in_width * factor samples)
+void int_replicate_row(const uint8_t* in, uint8_t* out, int in_width, int factor);
+
+// Color conversion: writes `width` pixels in BMP byte order (B, G, R)
+void ycc_to_bgr_row(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, uint8_t* bgr, int width);
+
+#endif